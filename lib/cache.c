@@ -0,0 +1,394 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <bsd/string.h> /* strlcpy */
+#include <dirent.h>     /* opendir */
+#include <errno.h>
+#include <fcntl.h>      /* AT_FDCWD */
+#include <glob.h>
+#include <inttypes.h>   /* PRIx64 */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>     /* mkstemp qsort */
+#include <string.h>
+#include <sys/stat.h>   /* mkdir stat utimensat */
+#include <unistd.h>     /* close readlink symlink unlink */
+
+#include "cache.h"
+#include "image.h"      /* scale_image */
+
+/* The extension of the copies, and the suffix of the links to their
+   wallpapers */
+#define CACHE_EXTENSION ".jpg"
+#define SOURCE_SUFFIX ".src"
+
+/* A copy in the cache, for cache_prune() */
+struct cache_entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec used;   /* The modification time, see cache_get() */
+};
+
+/* Function prototypes */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+static int compare_entries(const void *a, const void *b);
+static int remove_entry(const struct wallpaper_cache *cache, const char *name);
+
+/**
+  Set up a wallpaper cache.
+
+  @param[out] cache The cache.
+  @param[in] dir The cache directory, which is created if it does not exist.
+  @param[in] width The width of the screen.
+  @param[in] height The height of the screen.
+  @param[in] size The maximum size of the copies in bytes.
+  @return Returns 0 on success, -1 on failure.
+ */
+int cache_init(struct wallpaper_cache *cache, const char *dir, int width,
+        int height, off_t size) {
+    if (snprintf(cache->dir, sizeof cache->dir, "%s%s", dir,
+                dir[strlen(dir) - 1] == '/' ? "" : "/") >= (int)sizeof cache->dir) {
+        fprintf(stderr, "Error: path truncation occurred.\n");
+        return -1;
+    }
+
+    if (mkdir(cache->dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", cache->dir,
+                strerror(errno));
+        return -1;
+    }
+
+    cache->width = width;
+    cache->height = height;
+    cache->size = size;
+
+    return 0;
+}
+
+/**
+  Return the path of the copy of a wallpaper in the cache.
+
+  @param[in] cache The cache.
+  @param[in] path The path of the wallpaper.
+  @param[out] dest Is set to the path of the copy, which may not exist.
+  @param[in] size The size of `dest`.
+  @return Returns 0 on success, -1 if the wallpaper can't be accessed.
+ */
+int cache_path(const struct wallpaper_cache *cache, const char *path,
+        char *dest, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    int64_t fingerprint[5];
+    struct stat statbuf;
+
+    if (stat(path, &statbuf) == -1) {
+        return -1;
+    }
+
+    fingerprint[0] = statbuf.st_mtim.tv_sec;
+    fingerprint[1] = statbuf.st_mtim.tv_nsec;
+    fingerprint[2] = statbuf.st_size;
+    fingerprint[3] = cache->width;
+    fingerprint[4] = cache->height;
+
+    hash = hash_bytes(hash, path, strlen(path));
+    hash = hash_bytes(hash, fingerprint, sizeof fingerprint);
+
+    if (snprintf(dest, size, "%s%016" PRIx64 CACHE_EXTENSION, cache->dir,
+                hash) >= (int)size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Return the file to set as the background for a wallpaper.
+
+  This is the copy of the wallpaper in the cache, which is made if it does
+  not exist yet, or the wallpaper itself if it is not larger than the
+  screen. Using a copy marks it as recently used; when a new copy makes the
+  cache too large, the copies that were used least recently are removed.
+
+  @param[in] cache The cache.
+  @param[in] path The path of the wallpaper.
+  @param[out] dest Is set to the path of the file to set, and must be
+              PATH_MAX bytes.
+  @return Returns 0 on success, -1 on failure.
+ */
+int cache_get(const struct wallpaper_cache *cache, const char *path, char *dest) {
+    int rc, fd;
+    char tmp[PATH_MAX];
+    char source[PATH_MAX];
+
+    if (cache_path(cache, path, dest, PATH_MAX) == -1) {
+        return -1;
+    }
+
+    // Mark the copy as used; this fails if there is no copy yet
+    if (utimensat(AT_FDCWD, dest, NULL, 0) == 0) {
+        return 0;
+    }
+
+    // Another thread or process may make the same copy at the same time
+    if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", dest) >= (int)sizeof tmp ||
+            snprintf(source, sizeof source, "%s" SOURCE_SUFFIX, dest) >= (int)sizeof source ||
+            (fd = mkstemp(tmp)) == -1) {
+        return -1;
+    }
+
+    close(fd);
+
+    if ((rc = scale_image(path, tmp, cache->width, cache->height)) != 1) {
+        unlink(tmp);
+
+        if (rc == 0) {
+            strlcpy(dest, path, PATH_MAX);
+            return 0;
+        }
+
+        fprintf(stderr, "Error: Failed to scale %s\n", path);
+        return -1;
+    }
+
+    // Link the copy to its wallpaper before it appears, see cache_source().
+    // The name of the copy includes the path, so an existing link is right.
+    if ((symlink(path, source) == -1 && errno != EEXIST) ||
+            rename(tmp, dest) == -1) {
+        fprintf(stderr, "Error: Cannot add %s to the cache: %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+        unlink(source);
+        return -1;
+    }
+
+    cache_prune(cache, dest);
+
+    return 0;
+}
+
+/**
+  Return the wallpaper of a copy in the cache.
+
+  The background is set to the copy of a wallpaper, so this tells which
+  wallpaper is the current one.
+
+  @param[in] path The path of a file, which may be `dest`.
+  @param[out] dest Is set to the path of the wallpaper if `path` is a copy.
+  @param[in] size The size of `dest`.
+  @return Returns 0 if `path` is a copy, -1 otherwise.
+ */
+int cache_source(const char *path, char *dest, size_t size) {
+    char source[PATH_MAX];
+    ssize_t length;
+
+    if (snprintf(source, sizeof source, "%s" SOURCE_SUFFIX, path) >= (int)sizeof source ||
+            (length = readlink(source, dest, size - 1)) == -1) {
+        return -1;
+    }
+
+    dest[length] = '\0';
+
+    return 0;
+}
+
+/**
+  Remove the least recently used copies until the cache fits its size.
+
+  @param[in] cache The cache.
+  @param[in] keep The path of a copy to keep regardless, or NULL.
+  @return Returns the number of bytes freed, or -1 on failure.
+ */
+off_t cache_prune(const struct wallpaper_cache *cache, const char *keep) {
+    off_t total = 0, freed = 0;
+    size_t count = 0, capacity = 0, i, length;
+    char path[PATH_MAX];
+    struct cache_entry *entries = NULL, *tmp;
+    struct dirent *entry;
+    struct stat statbuf;
+    DIR *dir;
+
+    if (!(dir = opendir(cache->dir))) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        length = strlen(entry->d_name);
+
+        if (length <= strlen(CACHE_EXTENSION) ||
+                strcmp(entry->d_name + length - strlen(CACHE_EXTENSION),
+                    CACHE_EXTENSION) != 0 ||
+                snprintf(path, sizeof path, "%s%s", cache->dir,
+                    entry->d_name) >= (int)sizeof path ||
+                stat(path, &statbuf) == -1) {
+            continue;
+        }
+
+        total += statbuf.st_size;
+
+        // The copy to keep counts, but is not a candidate for removal
+        if (keep && strcmp(path, keep) == 0) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+
+            if (!(tmp = realloc(entries, capacity * sizeof *entries))) {
+                fprintf(stderr, "Error: out of memory\n");
+                free(entries);
+                closedir(dir);
+                return -1;
+            }
+
+            entries = tmp;
+        }
+
+        strlcpy(entries[count].name, entry->d_name, sizeof entries[count].name);
+        entries[count].size = statbuf.st_size;
+        entries[count].used = statbuf.st_mtim;
+        count++;
+    }
+
+    closedir(dir);
+
+    if (total > cache->size) {
+        qsort(entries, count, sizeof *entries, compare_entries);
+
+        for (i = 0; i < count && total - freed > cache->size; i++) {
+            if (remove_entry(cache, entries[i].name) == 0) {
+                freed += entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+
+    return freed;
+}
+
+/**
+  Return the resolution of the largest connected screen.
+
+  This reads the preferred mode of each connector from sysfs, which does not
+  need a connection to the display server.
+
+  @param[out] width Is set to the width of the screen.
+  @param[out] height Is set to the height of the screen.
+  @return Returns 0 on success, -1 if no screen was found.
+ */
+int get_display_resolution(int *width, int *height) {
+    int w, h, connected, found = -1;
+    char line[32];
+    char path[PATH_MAX];
+    size_t i;
+    glob_t connectors;
+    FILE *file;
+
+    if (glob("/sys/class/drm/card*-*", 0, NULL, &connectors) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < connectors.gl_pathc; i++) {
+        snprintf(path, sizeof path, "%s/status", connectors.gl_pathv[i]);
+
+        if (!(file = fopen(path, "r"))) {
+            continue;
+        }
+
+        connected = fgets(line, sizeof line, file) &&
+            strcmp(line, "connected\n") == 0;
+        fclose(file);
+
+        snprintf(path, sizeof path, "%s/modes", connectors.gl_pathv[i]);
+
+        if (!connected || !(file = fopen(path, "r"))) {
+            continue;
+        }
+
+        // The first mode is the preferred one
+        if (fgets(line, sizeof line, file) &&
+                sscanf(line, "%dx%d", &w, &h) == 2 &&
+                (found == -1 || (long)w * h > (long)*width * *height)) {
+            *width = w;
+            *height = h;
+            found = 0;
+        }
+
+        fclose(file);
+    }
+
+    globfree(&connectors);
+
+    return found;
+}
+
+/**
+  Add bytes to an FNV-1a hash.
+
+  @param[in] hash The hash so far.
+  @param[in] data The bytes.
+  @param[in] size The number of bytes.
+  @return Returns the new hash.
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+  Compare two copies by the time they were last used, for qsort().
+ */
+int compare_entries(const void *a, const void *b) {
+    const struct timespec *x = &((const struct cache_entry *)a)->used;
+    const struct timespec *y = &((const struct cache_entry *)b)->used;
+
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+  Remove a copy and the link to its wallpaper from the cache.
+
+  @param[in] cache The cache.
+  @param[in] name The file name of the copy.
+  @return Returns 0 on success, -1 on failure.
+ */
+int remove_entry(const struct wallpaper_cache *cache, const char *name) {
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof path, "%s%s" SOURCE_SUFFIX, cache->dir,
+                name) >= (int)sizeof path) {
+        return -1;
+    }
+
+    unlink(path);
+    path[strlen(path) - strlen(SOURCE_SUFFIX)] = '\0';
+
+    return unlink(path);
+}
@@ -0,0 +1,53 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_CACHE_H
+#define NEXTWALL_CACHE_H
+
+#include <limits.h>     /* PATH_MAX */
+#include <stddef.h>
+#include <sys/types.h>  /* off_t */
+
+/* The default size of the wallpaper cache in MiB */
+#define CACHE_SIZE_DEFAULT 256
+
+/* A directory with copies of wallpapers scaled to the screen, see
+   cache_get(). Each copy is named after a hash of the path, modification
+   time and size of its wallpaper and the resolution, so a changed file or
+   screen gets a new copy, and old copies are removed when the cache grows
+   beyond its size. */
+struct wallpaper_cache {
+    char dir[PATH_MAX];     /* The cache directory, ending in a slash */
+    int width;              /* The resolution the copies are scaled for */
+    int height;
+    off_t size;             /* The maximum size of the copies in bytes */
+};
+
+/* Function prototypes */
+int cache_init(struct wallpaper_cache *cache, const char *dir, int width,
+        int height, off_t size);
+int cache_path(const struct wallpaper_cache *cache, const char *path,
+        char *dest, size_t size);
+int cache_get(const struct wallpaper_cache *cache, const char *path, char *dest);
+int cache_source(const char *path, char *dest, size_t size);
+off_t cache_prune(const struct wallpaper_cache *cache, const char *keep);
+int get_display_resolution(int *width, int *height);
+
+#endif
@@ -24,14 +24,19 @@
 #include <stdio.h>      /* perror */
 #include <stdbool.h>
 #include <floatfann.h>
+#include <glib.h>       /* GRecMutex */
 #include <magic.h>
 #include <limits.h>     /* realpath */
+#include <math.h>       /* exp ldexp */
 #include <stdlib.h>     /* realpath */
+#include <stdint.h>     /* INT64_MAX */
 #include <string.h>     /* strcmp */
 #include <sqlite3.h>
 #include <sys/types.h>  /* open opendir stat */
 #include <sys/stat.h>   /* open opendir stat */
 #include <sys/ioctl.h>  /* ioctl TIOCGWINSZ */
+#include <sys/random.h> /* getrandom */
+#include <time.h>       /* clock_gettime */
 #include <unistd.h>     /* stat */
 #include <dirent.h>     /* open opendir */
 #include <fcntl.h>      /* open opendir */
@@ -40,19 +45,445 @@
 #include "database.h"
 #include "gnome.h"      /* file_trash */
 #include "image.h"      /* get_image_info */
+#include "maintain.h"
+#include "snapshot.h"
+#include "solar.h"      /* solar_elevation */
 #include "std.h"        /* get_brightness */
 
 extern int errno;
 
-static int wallpaper_list_populated = 0;
-static int wallpaper_count = 0;
-static int wallpaper_current = 0;
-static int wallpaper_list[LIST_MAX];
+/* The directories below a base directory, see get_path_range() */
+struct path_range {
+    char dir[PATH_MAX];     /* The base directory itself */
+    char lower[PATH_MAX];   /* Inclusive lower bound for the directories below */
+    char upper[PATH_MAX];   /* Exclusive upper bound for the directories below */
+};
+
+/* A step of update_database(), see `migrations` */
+struct migration {
+    double version;             /* The version of the database after the step */
+    const char *description;    /* Printed while the step runs, or NULL */
+    bool backup;                /* Back up the database before the step */
+    int (*needed)(sqlite3 *db); /* Returns 1 if the step has work to do, or
+                                   NULL if it always has */
+    const char *const *query;   /* The statements of the step */
+};
+
+/* The statements that are prepared once per context, see get_statement() */
+enum statement {
+    STMT_INSERT_WALLPAPER,
+    STMT_WALLPAPER_ID,
+    STMT_PATH_FROM_ID,
+    STMT_WALLPAPER_INFO,
+    STMT_GET_ROTATION,
+    STMT_NEXT_IN_ROTATION,
+    STMT_NEXT_IN_ROTATION_BRIGHTNESS,
+    STMT_SAVE_ROTATION,
+    STMT_ID_RANGE,
+    STMT_SAMPLE_ID,
+    STMT_COUNTS,
+    STMT_SAMPLE_RANK,
+    STMT_LIGHTNESS_RANGE,
+    STMT_SEEK_LIGHTNESS,
+    STMT_LIGHTNESS_IDS,
+    STMT_LOAD_WEIGHTS,
+    STMT_GET_WEIGHT,
+    STMT_MARK_SHOWN,
+    STMT_RATE,
+    STMT_REMOVE_PATH,
+    STMT_REMOVE_ID,
+    STMT_COUNT
+};
+
+/* The query of each statement. The rotation queries force the join order,
+   so that the rows are visited in key order using the index, and so is the
+   query of sample_by_id(), so that each try is two primary key lookups. */
+static const char *statement_queries[STMT_COUNT] = {
+    [STMT_INSERT_WALLPAPER] =
+        "INSERT INTO wallpaper_paths (dir, name, lightness, brightness) " \
+        "VALUES (?, ?, ?, ?);",
+    [STMT_WALLPAPER_ID] =
+        "SELECT w.id FROM wallpapers w " \
+        "JOIN directories d ON d.id = w.dir_id " \
+        "WHERE d.path = ? AND w.name = ?;",
+    [STMT_PATH_FROM_ID] =
+        "SELECT path FROM wallpaper_paths WHERE id = ?;",
+    [STMT_WALLPAPER_INFO] =
+        "SELECT lightness, brightness FROM wallpapers WHERE id = ?;",
+    [STMT_GET_ROTATION] =
+        "SELECT start, position, wrapped FROM rotations " \
+        "WHERE base = ? AND brightness = ?;",
+    [STMT_NEXT_IN_ROTATION] =
+        "SELECT w.id, w.shuffle_key FROM wallpapers w " \
+        "CROSS JOIN directories d ON d.id = w.dir_id " \
+        "WHERE w.shuffle_key > ?1 AND w.shuffle_key < ?2 " \
+        "AND (d.path = ?3 OR (d.path >= ?4 AND d.path < ?5)) " \
+        "ORDER BY w.shuffle_key LIMIT 1;",
+    [STMT_NEXT_IN_ROTATION_BRIGHTNESS] =
+        "SELECT w.id, w.shuffle_key FROM wallpapers w " \
+        "CROSS JOIN directories d ON d.id = w.dir_id " \
+        "WHERE w.brightness = ?6 " \
+        "AND w.shuffle_key > ?1 AND w.shuffle_key < ?2 " \
+        "AND (d.path = ?3 OR (d.path >= ?4 AND d.path < ?5)) " \
+        "ORDER BY w.shuffle_key LIMIT 1;",
+    [STMT_SAVE_ROTATION] =
+        "INSERT OR REPLACE INTO rotations " \
+        "(base, brightness, start, position, wrapped) " \
+        "VALUES (?, ?, ?, ?, ?);",
+    [STMT_ID_RANGE] =
+        "SELECT (SELECT MIN(id) FROM wallpapers), " \
+        "(SELECT MAX(id) FROM wallpapers);",
+    [STMT_SAMPLE_ID] =
+        "SELECT w.id FROM wallpapers w " \
+        "CROSS JOIN directories d ON d.id = w.dir_id " \
+        "WHERE w.id = ?1 AND (d.path = ?2 OR (d.path >= ?3 AND d.path < ?4)) " \
+        "AND (?5 = -1 OR w.brightness = ?5);",
+    [STMT_COUNTS] =
+        "SELECT c.dir_id, c.brightness, c.count FROM wallpaper_counts c " \
+        "JOIN directories d ON d.id = c.dir_id " \
+        "WHERE (d.path = ?1 OR (d.path >= ?2 AND d.path < ?3)) " \
+        "AND (?4 = -1 OR c.brightness = ?4);",
+    [STMT_SAMPLE_RANK] =
+        "SELECT id FROM wallpapers " \
+        "WHERE dir_id = ? AND brightness = ? AND group_rank = ?;",
+    [STMT_LIGHTNESS_RANGE] =
+        "SELECT (SELECT MIN(lightness) FROM wallpapers), " \
+        "(SELECT MAX(lightness) FROM wallpapers);",
+    [STMT_SEEK_LIGHTNESS] =
+        "SELECT w.id FROM wallpapers w " \
+        "CROSS JOIN directories d ON d.id = w.dir_id " \
+        "WHERE w.lightness >= ?1 AND w.lightness <= ?2 " \
+        "AND (d.path = ?3 OR (d.path >= ?4 AND d.path < ?5)) " \
+        "ORDER BY w.lightness LIMIT 1;",
+    [STMT_LIGHTNESS_IDS] =
+        "SELECT w.id FROM wallpapers w " \
+        "CROSS JOIN directories d ON d.id = w.dir_id " \
+        "WHERE w.lightness >= ?1 AND w.lightness <= ?2 " \
+        "AND (d.path = ?3 OR (d.path >= ?4 AND d.path < ?5));",
+    [STMT_LOAD_WEIGHTS] =
+        "SELECT w.id, w.rating, w.shown_at FROM wallpapers w " \
+        "JOIN directories d ON d.id = w.dir_id " \
+        "WHERE (d.path = ?1 OR (d.path >= ?2 AND d.path < ?3)) " \
+        "AND (?4 = -1 OR w.brightness = ?4) ORDER BY w.id;",
+    [STMT_GET_WEIGHT] =
+        "SELECT rating, shown_at FROM wallpapers WHERE id = ?;",
+    [STMT_MARK_SHOWN] =
+        "UPDATE wallpapers SET shown_at = ? WHERE id = ?;",
+    [STMT_RATE] =
+        "UPDATE wallpapers SET rating = max(?3, min(?4, rating + ?2)) " \
+        "WHERE id = ?1;",
+    [STMT_REMOVE_PATH] =
+        "DELETE FROM wallpapers WHERE name = ? AND " \
+        "dir_id = (SELECT id FROM directories WHERE path = ?);",
+    [STMT_REMOVE_ID] =
+        "DELETE FROM wallpapers WHERE id = ?;"
+};
+
+/* A wallpaper considered by select_wallpaper() */
+struct candidate {
+    int id;
+    char path[PATH_MAX];
+};
+
+/* An image that a scan has analyzed but not saved yet, see save_image_info() */
+struct pending_image {
+    char dir[PATH_MAX];
+    char name[NAME_MAX + 1];
+    double lightness;
+    int brightness;
+};
+
+/* The wallpapers of a directory with a brightness, see peek_uniform() */
+struct group {
+    int dir_id;
+    int brightness;
+    int count;                      /* The number of wallpapers */
+    int start;                      /* The number of wallpapers in the
+                                       groups before it */
+};
+
+/* A nextwall context, see nextwall_open() */
+struct nextwall_ctx {
+    sqlite3 *db;                    /* The database handler */
+    struct fann *ann;               /* The ANN for scans, NULL until loaded */
+    sqlite3_stmt *statements[STMT_COUNT]; /* See get_statement() */
+    uint64_t random_state;          /* See nextwall_seed() */
+    struct scan_stats *scan_stats;  /* See scan_set_stats() */
+    struct candidate *candidates;   /* CANDIDATE_BATCH candidates */
+    bool readonly;                  /* See nextwall_open_readonly() */
+    char *snapshot_path;            /* See nextwall_use_snapshot() */
+    struct snapshot *snapshot;      /* The mapped snapshot, or NULL */
+    int64_t snapshot_generation;    /* Generation of the written snapshot */
+    bool located;                   /* See nextwall_use_location() */
+    double latitude;
+    double longitude;
+    struct pending_image *pending;  /* SCAN_BATCH images, see save_image_info() */
+    int pending_count;              /* Number of pending images */
+    double pending_start;           /* When the first pending image was added */
+    GRecMutex lock;                 /* Held while the context is used */
+};
+
+/* Add the time elapsed since `start` to a phase of the scan statistics */
+#define SCAN_STATS_ADD(ctx, phase, start) do { \
+    if ((ctx)->scan_stats) \
+        (ctx)->scan_stats->phase += get_time() - (start); \
+} while(0)
 
 /* Function prototypes */
-static int save_image_info(sqlite3_stmt *stmt, struct fann *ann, const char *path);
-static int is_known_image(sqlite3 *db, const char *path);
-static int callback_known_image(void *param, int argc, char **argv, char **colnames);
+static struct nextwall_ctx *new_context(void);
+static sqlite3_stmt *get_statement(struct nextwall_ctx *ctx, enum statement which);
+static int update_snapshot(struct nextwall_ctx *ctx);
+static int configure_connection(sqlite3 *db, bool readonly);
+static int step_retry(sqlite3_stmt *stmt);
+static int exec_retry(sqlite3 *db, const char *query);
+static int begin_transaction(struct nextwall_ctx *ctx);
+static int commit_transaction(struct nextwall_ctx *ctx);
+static int flush_images(struct nextwall_ctx *ctx, bool force);
+static int scan_tree(struct nextwall_ctx *ctx, magic_t magic, const char *base,
+        int recursive, int terminal_width);
+static int save_image_info(struct nextwall_ctx *ctx, const char *path);
+static int find_wallpaper(struct nextwall_ctx *ctx, const char *path);
+static int is_pending(struct nextwall_ctx *ctx, const char *path);
+static void print_progress(const char *path, int terminal_width);
+static int is_image_file(struct nextwall_ctx *ctx, magic_t magic, const char *path);
+static double get_time(void);
+static int has_column(sqlite3 *db, const char *table, const char *column);
+static double get_version(sqlite3 *db);
+static int set_version(sqlite3 *db, double version);
+static int backup_database(sqlite3 *db, double version);
+static int needs_split_paths(sqlite3 *db);
+static int needs_shuffle_key(sqlite3 *db);
+static int needs_weight_columns(sqlite3 *db);
+static int needs_group_rank(sqlite3 *db);
+static int next_wallpaper(struct nextwall_ctx *ctx, const char *base,
+        int brightness, struct weighted_pool *pool, char *result_path);
+static int sample_by_id(struct nextwall_ctx *ctx, struct path_range *range, int brightness);
+static int sample_by_count(struct nextwall_ctx *ctx, struct path_range *range, int brightness);
+static int get_id_by_rank(struct nextwall_ctx *ctx, int dir_id, int brightness,
+        long long rank);
+static int peek_uniform(struct nextwall_ctx *ctx, struct path_range *range,
+        int brightness, struct wallpaper_info *result, int count);
+static int peek_weighted(struct weighted_pool *pool,
+        struct wallpaper_info *result, int count);
+static int peek_lightness(struct nextwall_ctx *ctx, struct path_range *range,
+        struct wallpaper_info *result, int count);
+static int get_wallpaper_info(struct nextwall_ctx *ctx, int id,
+        struct wallpaper_info *info);
+static int seek_lightness(struct nextwall_ctx *ctx, struct path_range *range,
+        double low, double high);
+static double get_target_lightness(struct nextwall_ctx *ctx);
+static int set_path_range(const char *base, struct path_range *range);
+static int load_weights(struct weighted_pool *pool);
+static int find_pool_index(struct weighted_pool *pool, int id);
+static double get_weight(int rating, sqlite3_int64 shown_at, time_t now);
+
+/* Settings for each read-write connection. In WAL mode readers do not block
+   the writer and the writer does not block readers, so a scan no longer
+   makes selections fail. The journal mode is stored in the database; the
+   other settings only last for the connection. With WAL, `synchronous =
+   NORMAL` is still safe against corruption and only syncs on checkpoints.
+   The database is small, so up to 64 MiB of it is memory-mapped and the
+   page cache is 8 MiB. */
+static const char *connection_query =
+    "PRAGMA journal_mode = WAL;" \
+    "PRAGMA synchronous = NORMAL;" \
+    "PRAGMA mmap_size = 67108864;" \
+    "PRAGMA cache_size = -8192;";
+
+/* Statements that create the wallpaper tables. Paths are stored once per
+   directory in `directories`, and `wallpapers` only stores the file name.
+   The `wallpaper_paths` view rebuilds the full paths and accepts inserts of
+   (dir, name, lightness, brightness) rows. `wallpaper_counts` holds the
+   number of wallpapers per directory and brightness for sampling; when the
+   table is new, it is filled from `wallpapers`. The `group_rank` column that
+   numbers the wallpapers within these groups is added by group_rank_query.
+
+   Each wallpaper has a random `shuffle_key`, and `rotations` holds a cursor
+   in shuffle_key order per base directory and brightness, so that
+   rotate_wallpaper() shows every wallpaper once before repeating.
+
+   The `rating` and `shown_at` (Unix time, 0 if never shown) of a wallpaper
+   determine its weight for weighted_wallpaper().
+
+   The `generation` in `info` goes up whenever a wallpaper is added, removed,
+   or changes its path or brightness, which tells if a snapshot is stale;
+   see nextwall_use_snapshot(). */
+static const char *schema_query =
+    "CREATE TABLE IF NOT EXISTS directories (" \
+        "id INTEGER PRIMARY KEY," \
+        "path TEXT);" \
+    "CREATE UNIQUE INDEX IF NOT EXISTS directories_path_idx " \
+        "ON directories (path);" \
+    "CREATE TABLE IF NOT EXISTS wallpapers (" \
+        "id INTEGER PRIMARY KEY," \
+        "dir_id INTEGER," \
+        "name TEXT," \
+        "lightness FLOAT," \
+        "brightness INTEGER," \
+        "shuffle_key INTEGER," \
+        "rating INTEGER DEFAULT 0," \
+        "shown_at INTEGER DEFAULT 0);" \
+    "CREATE UNIQUE INDEX IF NOT EXISTS wallpapers_dir_name_idx " \
+        "ON wallpapers (dir_id, name);" \
+    "CREATE INDEX IF NOT EXISTS wallpapers_shuffle_key_idx " \
+        "ON wallpapers (shuffle_key);" \
+    "CREATE INDEX IF NOT EXISTS wallpapers_brightness_shuffle_key_idx " \
+        "ON wallpapers (brightness, shuffle_key);" \
+    "CREATE INDEX IF NOT EXISTS wallpapers_lightness_idx " \
+        "ON wallpapers (lightness);" \
+    "CREATE VIEW IF NOT EXISTS wallpaper_paths AS " \
+        "SELECT w.id, d.path AS dir, w.name, d.path || '/' || w.name AS path, " \
+        "w.lightness, w.brightness " \
+        "FROM wallpapers w JOIN directories d ON d.id = w.dir_id;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpaper_paths_insert " \
+        "INSTEAD OF INSERT ON wallpaper_paths BEGIN " \
+        "INSERT OR IGNORE INTO directories (path) VALUES (NEW.dir); " \
+        "INSERT INTO wallpapers (dir_id, name, lightness, brightness, " \
+        "shuffle_key) " \
+        "VALUES ((SELECT id FROM directories WHERE path = NEW.dir), " \
+        "NEW.name, NEW.lightness, NEW.brightness, " \
+        "random() & 9223372036854775807); " \
+        "END;" \
+    "CREATE TABLE IF NOT EXISTS wallpaper_counts (" \
+        "dir_id INTEGER," \
+        "brightness INTEGER," \
+        "count INTEGER," \
+        "PRIMARY KEY (dir_id, brightness));" \
+    "INSERT INTO wallpaper_counts " \
+        "SELECT dir_id, brightness, COUNT(*) FROM wallpapers " \
+        "WHERE NOT EXISTS (SELECT 1 FROM wallpaper_counts) " \
+        "GROUP BY dir_id, brightness;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_count_insert " \
+        "AFTER INSERT ON wallpapers BEGIN " \
+        "INSERT INTO wallpaper_counts VALUES (NEW.dir_id, NEW.brightness, 1) " \
+        "ON CONFLICT (dir_id, brightness) DO UPDATE SET count = count + 1; " \
+        "END;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_count_delete " \
+        "AFTER DELETE ON wallpapers BEGIN " \
+        "UPDATE wallpaper_counts SET count = count - 1 " \
+        "WHERE dir_id = OLD.dir_id AND brightness = OLD.brightness; " \
+        "END;" \
+    "CREATE TABLE IF NOT EXISTS rotations (" \
+        "id INTEGER PRIMARY KEY," \
+        "base TEXT," \
+        "brightness INTEGER," \
+        "start INTEGER," \
+        "position INTEGER," \
+        "wrapped INTEGER," \
+        "UNIQUE (base, brightness));" \
+    "INSERT INTO info (name, value) SELECT 'generation', 0 " \
+        "WHERE NOT EXISTS (SELECT 1 FROM info WHERE name = 'generation');" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_generation_insert " \
+        "AFTER INSERT ON wallpapers BEGIN " \
+        "UPDATE info SET value = value + 1 WHERE name = 'generation'; " \
+        "END;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_generation_delete " \
+        "AFTER DELETE ON wallpapers BEGIN " \
+        "UPDATE info SET value = value + 1 WHERE name = 'generation'; " \
+        "END;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_generation_update " \
+        "AFTER UPDATE OF dir_id, name, brightness ON wallpapers BEGIN " \
+        "UPDATE info SET value = value + 1 WHERE name = 'generation'; " \
+        "END;";
+
+/* Adds random shuffle keys to a database without them. The insert trigger is
+   recreated by schema_query to set the key for new wallpapers. */
+static const char *shuffle_key_query =
+    "ALTER TABLE wallpapers ADD COLUMN shuffle_key INTEGER;" \
+    "UPDATE wallpapers SET shuffle_key = random() & 9223372036854775807;" \
+    "DROP TRIGGER IF EXISTS wallpaper_paths_insert;";
+
+/* Numbers the wallpapers of each directory and brightness from 0, so that
+   sample_by_count() can seek to a random one. The triggers keep the numbers
+   dense: a new wallpaper gets the number after the last one of its group,
+   and the last one of the group takes over the number of a removed one. */
+static const char *group_rank_query =
+    "ALTER TABLE wallpapers ADD COLUMN group_rank INTEGER;" \
+    "CREATE TEMP TABLE group_ranks (id INTEGER PRIMARY KEY, rank INTEGER);" \
+    "INSERT INTO group_ranks SELECT id, row_number() OVER " \
+        "(PARTITION BY dir_id, brightness ORDER BY id) - 1 FROM wallpapers;" \
+    "UPDATE wallpapers SET group_rank = " \
+        "(SELECT rank FROM group_ranks WHERE group_ranks.id = wallpapers.id);" \
+    "DROP TABLE group_ranks;" \
+    "DROP INDEX IF EXISTS wallpapers_dir_brightness_idx;" \
+    "CREATE INDEX IF NOT EXISTS wallpapers_group_rank_idx " \
+        "ON wallpapers (dir_id, brightness, group_rank);" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_rank_insert " \
+        "AFTER INSERT ON wallpapers BEGIN " \
+        "UPDATE wallpapers SET group_rank = " \
+        "(SELECT coalesce(max(group_rank) + 1, 0) FROM wallpapers " \
+        "WHERE dir_id = NEW.dir_id AND brightness = NEW.brightness) " \
+        "WHERE id = NEW.id; " \
+        "END;" \
+    "CREATE TRIGGER IF NOT EXISTS wallpapers_rank_delete " \
+        "AFTER DELETE ON wallpapers BEGIN " \
+        "UPDATE wallpapers SET group_rank = OLD.group_rank " \
+        "WHERE dir_id = OLD.dir_id AND brightness = OLD.brightness " \
+        "AND group_rank > OLD.group_rank AND group_rank = " \
+        "(SELECT max(group_rank) FROM wallpapers " \
+        "WHERE dir_id = OLD.dir_id AND brightness = OLD.brightness); " \
+        "END;";
+
+/* Adds the columns for weighted selection to a database without them */
+static const char *weight_columns_query =
+    "ALTER TABLE wallpapers ADD COLUMN rating INTEGER DEFAULT 0;" \
+    "ALTER TABLE wallpapers ADD COLUMN shown_at INTEGER DEFAULT 0;";
+
+/* Moves the rows of a database with full paths in `wallpapers` (version 0.5)
+   to the tables created by schema_query. The directory of a path is what
+   remains after stripping the characters of the file name, which are all
+   characters except '/', from the right. */
+static const char *split_paths_query =
+    "ALTER TABLE wallpapers RENAME TO wallpapers_old;" \
+    "DROP INDEX IF EXISTS wallpapers_path_idx;" \
+    "DROP INDEX IF EXISTS wallpapers_brightness_path_idx;" \
+    "CREATE TEMP VIEW split_paths AS " \
+        "SELECT id, path, lightness, brightness, " \
+        "rtrim(rtrim(path, replace(path, '/', '')), '/') AS dir " \
+        "FROM wallpapers_old;" \
+    "CREATE TABLE directories (" \
+        "id INTEGER PRIMARY KEY," \
+        "path TEXT);" \
+    "INSERT INTO directories (path) SELECT DISTINCT dir FROM split_paths;" \
+    "CREATE TABLE wallpapers (" \
+        "id INTEGER PRIMARY KEY," \
+        "dir_id INTEGER," \
+        "name TEXT," \
+        "lightness FLOAT," \
+        "brightness INTEGER);" \
+    "INSERT INTO wallpapers (id, dir_id, name, lightness, brightness) " \
+        "SELECT s.id, d.id, substr(s.path, length(s.dir) + 2), " \
+        "s.lightness, s.brightness " \
+        "FROM split_paths s JOIN directories d ON d.path = s.dir;" \
+    "DROP VIEW split_paths;" \
+    "DROP TABLE wallpapers_old;" \
+    "DROP VIEW IF EXISTS wallpaper_paths;";
+
+/* The steps of update_database(), in the order they are applied. Each step
+   brings the database to its version, which must be higher than that of the
+   step before it, and the last one must be at NEXTWALL_DB_VERSION. A new
+   database starts at version 0 and takes all steps.
+
+   A step must be safe to apply to a database that already has its changes,
+   so that databases of versions that were never released are fine too; its
+   `needed` check skips it then. New tables and indexes go into schema_query,
+   with IF NOT EXISTS, and a new step with a higher version that runs it
+   again. Changes to existing data and tables, such as new columns, get a
+   step of their own. A step that rebuilds tables is marked `backup`. */
+static const struct migration migrations[] = {
+    {0.6, "Moving paths to the directories table", true,
+        needs_split_paths, &split_paths_query},
+    {0.7, "Adding shuffle keys", false,
+        needs_shuffle_key, &shuffle_key_query},
+    {0.8, "Adding ratings", false,
+        needs_weight_columns, &weight_columns_query},
+    {0.9, NULL, false,
+        NULL, &schema_query},
+    {1.0, NULL, false,
+        NULL, &schema_query},
+    {1.1, "Numbering the wallpapers of each directory", false,
+        needs_group_rank, &group_rank_query}
+};
 
 /**
   Create a new nextwall database.
@@ -61,17 +492,12 @@ static int callback_known_image(void *param, int argc, char **argv, char **colna
   @return Returns 0 on success, -1 on failure.
  */
 int create_database(sqlite3 *db) {
-    int rc = 0, rc2 = 0;
-    char *query, *mquery = NULL;
-
-    query = "CREATE TABLE wallpapers (" \
-        "id INTEGER PRIMARY KEY," \
-        "path TEXT," \
-        "lightness FLOAT," \
-        "brightness INTEGER" \
-        ");";
+    int rc = 0;
+    char *query;
 
-    rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+    // Let nextwall_maintain() return free pages without a full VACUUM. This
+    // only works before the first table is created.
+    rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL);
 
     if (rc != SQLITE_OK)
         goto Return;
@@ -86,430 +512,2879 @@ int create_database(sqlite3 *db) {
     if (rc != SQLITE_OK)
         goto Return;
 
-    if ((rc2 = asprintf(&mquery,
-            "INSERT INTO info VALUES (null, 'version', %f);",
-            NEXTWALL_DB_VERSION)) == -1) {
-        fprintf(stderr, "asprintf() failed: %s\n", strerror(errno));
-        goto Return;
-    }
-
-    rc = sqlite3_exec(db, mquery, NULL, NULL, NULL);
+    // update_database() takes it from here
+    rc = sqlite3_exec(db, "INSERT INTO info VALUES (null, 'version', 0);",
+            NULL, NULL, NULL);
 
     if (rc != SQLITE_OK)
         goto Return;
 
-    rc = sqlite3_exec(db,
-        "CREATE UNIQUE INDEX wallpapers_path_idx ON wallpapers (path);",
-        NULL, NULL, NULL);
+    if (update_database(db) != 0)
+        rc = SQLITE_ERROR;
 
     goto Return;
 
 Return:
-    if (mquery)
-        free(mquery);
-
-    if (rc != SQLITE_OK || rc2 == -1)
+    if (rc != SQLITE_OK)
         return -1;
 
     return 0;
 }
 
 /**
-  Scan the directory for new wallpapers.
+  Bring an existing nextwall database up to date.
 
-  The path of each image file that is found in the directory is saved along
-  with additional information (e.g. lightness) to the database. It will use the
-  Artificial Neural Network to define the brightness value of each image.
+  Applies the steps in `migrations` that are newer than the version stored
+  in the database, in order and each in its own transaction, which also
+  stores the version of the step. If nextwall stops halfway, the next start
+  continues with the step that was not done. The version is read again in
+  each transaction, in case another nextwall process updates the database
+  at the same time. If any of the steps rebuilds tables, the database is
+  copied first; see backup_database().
+
+  A database that is up to date costs a single query.
 
   @param[in] db The database handler.
-  @param[in] name The base directory.
-  @param[in] recursive If set to 1, the base directory is scanned recursively.
-  @return The number of new wallpapers that were found.
+  @return Returns 0 on success, -1 on failure, or if the database is newer
+          than this version of nextwall.
  */
-int scan_dir(sqlite3 *db, const char *base, struct fann *ann, int recursive) {
-    int found = 0;
-    int terminal_width = get_terminal_width();
-    char *path_tmp = NULL;
-    char *query;
-    char path[PATH_MAX];
-    const char *tail = 0;
-    struct dirent *entry;
-    DIR *dir;
-    sqlite3_stmt *stmt;
-
-    // Initialize Magic Number Recognition Library
-    magic_t magic = magic_open(MAGIC_MIME_TYPE);
-    magic_load(magic, NULL);
-
-    if (recursive < 2) {
-        sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+int update_database(sqlite3 *db) {
+    int rc = SQLITE_OK;
+    size_t i;
+    double version;
+    const struct migration *step;
+
+    if ((version = get_version(db)) == -1) {
+        fprintf(stderr, "Failed to read the database version: %s\n",
+                sqlite3_errmsg(db));
+        return -1;
     }
 
-    if (!(dir = opendir(base))) {
-        return found;
+    if (version > NEXTWALL_DB_VERSION + VERSION_EPSILON) {
+        fprintf(stderr, "Error: The database has version %g, but this " \
+                "version of nextwall only knows up to %g.\n",
+                version, NEXTWALL_DB_VERSION);
+        return -1;
     }
 
-    if (!(entry = readdir(dir))) {
-        return found;
+    if (version > NEXTWALL_DB_VERSION - VERSION_EPSILON) {
+        return 0;
     }
 
-    // Prepare INSERT statement
-    query = "INSERT INTO wallpapers VALUES (null, @PATH, @LGT, @BRI);";
-    sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, &tail);
+    // The copy is made before the first transaction, as SQLite can't copy a
+    // database while the same connection writes to it.
+    for (i = 0; i < sizeof migrations / sizeof *migrations; i++) {
+        step = &migrations[i];
 
-    do {
-        if (asprintf(&path_tmp, "%s/%s", base, entry->d_name) == -1) {
-            perror("asprintf");
-            goto Return;
+        if (step->backup && version < step->version - VERSION_EPSILON &&
+                (!step->needed || step->needed(db))) {
+            if (backup_database(db, version) != SQLITE_OK) {
+                return -1;
+            }
+            break;
         }
+    }
 
-        if (realpath(path_tmp, path) == NULL) {
-            perror("realpath");
-            goto Return;
+    for (i = 0; i < sizeof migrations / sizeof *migrations; i++) {
+        step = &migrations[i];
+
+        if ((rc = exec_retry(db, "BEGIN IMMEDIATE")) != SQLITE_OK) {
+            break;
         }
 
-        if (entry->d_type == DT_DIR) {
-            if (!recursive) {
-                continue;
+        if ((version = get_version(db)) == -1) {
+            rc = SQLITE_ERROR;
+        }
+        else if (version < step->version - VERSION_EPSILON &&
+                (!step->needed || step->needed(db))) {
+            if (step->description) {
+                fprintf(stderr, "%s... ", step->description);
             }
 
-            if (strcmp(entry->d_name, ".") == 0 || \
-                strcmp(entry->d_name, "..") == 0 || \
-                strcmp(entry->d_name, ".thumbs") == 0) {
-                continue;
-            }
+            rc = sqlite3_exec(db, *step->query, NULL, NULL, NULL);
 
-            found += scan_dir(db, path, ann, recursive + 1);
+            if (step->description) {
+                fprintf(stderr, rc == SQLITE_OK ? "Done\n" : "Failed\n");
+            }
         }
-        else if (strstr(magic_file(magic, path), "image")) {
-            // Build the full line to be printed
-            char line_buffer[terminal_width + 1];
-            strlcpy(line_buffer, path, sizeof(line_buffer));
 
-            // Use %-*s to print the line and pad it with spaces to fill the terminal
-            printf("\r%-*s", terminal_width, line_buffer);
-            fflush(stdout);
+        if (rc == SQLITE_OK && version < step->version - VERSION_EPSILON) {
+            rc = set_version(db, step->version);
+        }
 
-            if (is_known_image(db, path)) {
-                continue;
-            }
+        if (rc == SQLITE_OK) {
+            rc = exec_retry(db, "COMMIT");
+        }
 
-            if (save_image_info(stmt, ann, path) == 0) {
-                ++found;
-            }
-            else {
-                fprintf(stderr, "\nError: Failed to save image info for %s\n", path);
-                goto Return;
-            }
+        if (rc != SQLITE_OK) {
+            break;
         }
-        else if (entry->d_type == DT_UNKNOWN) {
-            // The file type could not be determined. Fallback to using stat.
+    }
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to update the database: %s\n",
+                sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
 
-            struct stat statbuf;
-            _Bool is_dir;
+    return 0;
+}
 
-            stat(entry->d_name, &statbuf);
-            is_dir = S_ISDIR(statbuf.st_mode);
+/**
+  Return the version of a nextwall database.
 
-            if (is_dir) {
-                if (!recursive) {
-                    continue;
-                }
+  @param[in] db The database handler.
+  @return Returns the version, or -1 on error.
+ */
+double get_version(sqlite3 *db) {
+    double version = -1;
+    sqlite3_stmt *stmt;
 
-                if (strcmp(entry->d_name, ".") == 0 || \
-                    strcmp(entry->d_name, "..") == 0 || \
-                    strcmp(entry->d_name, ".thumbs") == 0) {
-                    continue;
-                }
+    if (sqlite3_prepare_v2(db,
+                "SELECT value FROM info WHERE name = 'version';",
+                -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_double(stmt, 0);
+    }
 
-                found += scan_dir(db, path, ann, recursive + 1);
-            }
-            else {
-                // TODO: Check if it is an image file.
-                fprintf(stderr, "\nCould not determine file type of '%s'; skipping...\n", path);
-            }
-        }
-    } while ((entry = readdir(dir)));
+    sqlite3_finalize(stmt);
 
-    goto Return;
+    return version;
+}
 
-Return:
-    if (recursive < 2) {
-        sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-    }
+/**
+  Store the version of a nextwall database.
 
-    magic_close(magic);
+  @param[in] db The database handler.
+  @param[in] version The version.
+  @return Returns SQLITE_OK on success, or an SQLite error code.
+ */
+int set_version(sqlite3 *db, double version) {
+    int rc;
+    sqlite3_stmt *stmt;
 
-    if (path_tmp) {
-        free(path_tmp);
+    if ((rc = sqlite3_prepare_v2(db,
+                "UPDATE info SET value = ? WHERE name = 'version';",
+                -1, &stmt, NULL)) != SQLITE_OK) {
+        return rc;
     }
 
-    closedir(dir);
+    sqlite3_bind_double(stmt, 1, version);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
 
-    return found;
+    return rc;
 }
 
 /**
-  Check if a wallpaper is already present in the nextwall database.
+  Copy a nextwall database before it is updated.
+
+  The copy is written next to the database, with the old version in its
+  name, e.g. `nextwall.db.0.5.bak`. Databases in memory are not copied.
 
   @param[in] db The database handler.
-  @param[in] path The absolute path of the wallpaper to check.
-  @return Returns 1 if the wallpaper is known, 0 otherwise.
+  @param[in] version The current version of the database.
+  @return Returns SQLITE_OK on success, or an SQLite error code.
  */
-int is_known_image(sqlite3 *db, const char *path) {
-    int known = 0;
-	int rc = 0;
-    char *query = NULL;
+int backup_database(sqlite3 *db, double version) {
+    int rc;
+    char path[PATH_MAX];
+    const char *db_path = sqlite3_db_filename(db, "main");
+    sqlite3 *copy = NULL;
+    sqlite3_backup *backup;
 
-    if (asprintf(&query, "SELECT id FROM wallpapers WHERE path='%s';", path) == -1) {
-        fprintf(stderr, "asprintf() failed: %s\n", strerror(errno));
-        goto on_error;
+    if (!db_path || *db_path == '\0') {
+        return SQLITE_OK;
     }
 
-    rc = sqlite3_exec(db, query, callback_known_image, &known, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Error: Failed to execute query: %s\n", query);
-        goto on_error;
+    if (snprintf(path, sizeof path, "%s.%g.bak", db_path, version) >=
+            (int)sizeof path) {
+        fprintf(stderr, "Error: path truncation occurred.\n");
+        return SQLITE_ERROR;
+    }
+
+    fprintf(stderr, "Backing up the database to %s... ", path);
+
+    if ((rc = sqlite3_open(path, &copy)) == SQLITE_OK) {
+        if ((backup = sqlite3_backup_init(copy, "main", db, "main"))) {
+            sqlite3_backup_step(backup, -1);
+            sqlite3_backup_finish(backup);
+        }
+        rc = sqlite3_errcode(copy);
     }
 
-    free(query);
+    if (rc == SQLITE_OK) {
+        fprintf(stderr, "Done\n");
+    }
+    else {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(copy));
+        unlink(path);
+    }
 
-    return known;
+    sqlite3_close(copy);
 
-on_error:
-    free(query);
-    exit(1);
+    return rc;
 }
 
 /**
-  Callback function for is_known_image().
+  Check if a database still stores full paths in `wallpapers` (version 0.5).
+ */
+int needs_split_paths(sqlite3 *db) {
+    return has_column(db, "wallpapers", "path");
+}
 
-  Sets the first argument to the callback to 1.
+/**
+  Check if the wallpapers of a database have no shuffle keys yet.
+ */
+int needs_shuffle_key(sqlite3 *db) {
+    return has_column(db, "wallpapers", "id") &&
+        !has_column(db, "wallpapers", "shuffle_key");
+}
 
-  @param[out] param Pointer to an integer that will be set to 1.
-  @param[in] argc The number of columns in the result.
-  @param[in] argv An array of pointers to strings obtained for each column.
-  @param[in] colnames An array of pointers to strings where each entry
-             represents the name of corresponding result column.
+/**
+  Check if the wallpapers of a database have no ratings yet.
  */
-int callback_known_image(void *param, int argc, char **argv, char **colnames) {
-    int *known = (int *)param;
-    *known = 1;
+int needs_weight_columns(sqlite3 *db) {
+    return has_column(db, "wallpapers", "id") &&
+        !has_column(db, "wallpapers", "rating");
+}
 
-    return 0;
+/**
+  Check if the wallpapers of a database are not numbered per group yet.
+ */
+int needs_group_rank(sqlite3 *db) {
+    return has_column(db, "wallpapers", "id") &&
+        !has_column(db, "wallpapers", "group_rank");
 }
 
 /**
-  Saves the wallpaper information to the nextwall database.
+  Check if a table has a column.
 
-  Saves the wallpaper path along with the lightness and brightness value for
-  the wallpaper.
+  @param[in] db The database handler.
+  @param[in] table The name of the table.
+  @param[in] column The name of the column.
+  @return Returns 1 if the column exists, 0 otherwise.
+ */
+int has_column(sqlite3 *db, const char *table, const char *column) {
+    int found = 0;
+    sqlite3_stmt *stmt;
+    const char *query =
+        "SELECT 1 FROM pragma_table_info(?) WHERE name = ?;";
 
-  @param[in] The prepared insert statement.
-  @param[in] The Artificial Neural Network.
-  @param[in] The absolute path of the wallpaper file.
-  @return Returns 0 on success, -1 otherwise.
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+
+    found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+
+    return found;
+}
+
+/**
+  Open a nextwall context.
+
+  The context owns the database connection, the ANN for scans, the prepared
+  statements and the state of the random number generator. Functions that
+  take a context may be called from several threads; each call holds the
+  lock of the context while it runs. Separate contexts can be used without
+  any locking between them.
+
+  The database is created if it does not exist, and updated otherwise.
+
+  @param[in] db_path The path of the database file.
+  @return Returns the context, or NULL on error. Close it with
+          nextwall_close().
  */
-int save_image_info(sqlite3_stmt *stmt, struct fann *ann, const char *path) {
-    double lightness;
-    int brightness;
-	int rc = 0;
+struct nextwall_ctx *nextwall_open(const char *db_path) {
+    int exists;
+    struct nextwall_ctx *ctx;
 
-    // Get the lightness for this image
-    if (get_image_info(path, &lightness) == -1) {
-        return -1;
+    if ( !(ctx = new_context()) ) {
+        return NULL;
     }
 
-    // Get image brigthness
-    brightness = get_brightness(ann, lightness);
+    exists = access(db_path, F_OK) == 0;
 
-    // Bind values to prepared statement
-    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_double(stmt, 2, lightness);
-    sqlite3_bind_int(stmt, 3, brightness);
+    if (sqlite3_open(db_path, &ctx->db) != SQLITE_OK) {
+        fprintf(stderr, "Error: Can't open database: %s\n",
+                sqlite3_errmsg(ctx->db));
+        goto Error;
+    }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        return -1;
+    if (!exists && create_database(ctx->db) != 0) {
+        fprintf(stderr, "Error: Creating database failed.\n");
+        // Don't leave an incomplete database behind
+        unlink(db_path);
+        goto Error;
     }
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
+    // After create_database(), since WAL mode must not be set before it
+    if (configure_connection(ctx->db, false) != 0) {
+        goto Error;
+    }
 
-    return 0;
+    if (exists && update_database(ctx->db) != 0) {
+        goto Error;
+    }
+
+    return ctx;
+
+Error:
+    nextwall_close(ctx);
+    return NULL;
 }
 
 /**
-  Select a random wallpaper from the nextwall database.
+  Open a nextwall context with a read-only database connection.
 
-  @param[in] db The database handler.
-  @param[in] base The base directory from which to select wallpapers.
-  @param[in] brightness If set to 0, 1, or 2, wallpapers matching this
-             brightness value are returned.
-  @param[out] result_path Will be set to the path of the randomly selected wallpaper.
-  @return Returns the ID of a randomly selected wallpaper on success, -1
-          otherwise.
- */
-int nextwall(sqlite3 *db, const char *base, int brightness, char *result_path) {
-    int id;
-    int rc;
-    sqlite3_stmt *stmt;
-    const char *query;
+  This is the fast way to open a context for only selecting a wallpaper
+  with peek_wallpaper(). The database is neither created nor updated, and
+  since the context has its own lock, SQLite does not take any.
 
-    if (!wallpaper_list_populated) {
-        /* Make sure the base path is absolute, since only absolute paths are
-           stored in the database. */
-        char real_base[PATH_MAX];
-        if (realpath(base, real_base) == NULL) {
-            fprintf(stderr, "realpath() failed: %s\n", strerror(errno));
-            return -1;
-        }
+  @param[in] db_path The path of the database file.
+  @return Returns the context, or NULL if the database does not exist, is
+          not up to date, or on error. Use nextwall_open() in that case.
+ */
+struct nextwall_ctx *nextwall_open_readonly(const char *db_path) {
+    int current = 0;
+    struct nextwall_ctx *ctx;
 
-        // Construct the LIKE pattern by appending '%'.
-        char like_pattern[PATH_MAX];
-        strlcpy(like_pattern, real_base, sizeof(like_pattern));
-        strlcat(like_pattern, "%", sizeof(like_pattern));
+    if ( !(ctx = new_context()) ) {
+        return NULL;
+    }
 
-        if (brightness != -1) {
-            query = "SELECT id FROM wallpapers WHERE path LIKE ? AND brightness = ? ORDER BY RANDOM() LIMIT ?;";
-        }
-        else {
-            query = "SELECT id FROM wallpapers WHERE path LIKE ? ORDER BY RANDOM() LIMIT ?;";
-        }
+    if (sqlite3_open_v2(db_path, &ctx->db,
+                SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) == SQLITE_OK &&
+            configure_connection(ctx->db, true) == 0) {
+        current = fabs(get_version(ctx->db) - NEXTWALL_DB_VERSION) <
+            VERSION_EPSILON;
+    }
 
-        rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-            sqlite3_close(db);
-            return -1;
-        }
+    if (!current) {
+        nextwall_close(ctx);
+        return NULL;
+    }
 
-        sqlite3_bind_text(stmt, 1, like_pattern, -1, SQLITE_TRANSIENT);
-        if (brightness != -1) {
-            sqlite3_bind_int(stmt, 2, brightness);
-            sqlite3_bind_int(stmt, 3, LIST_MAX);
-        }
-        else {
-            sqlite3_bind_int(stmt, 2, LIST_MAX);
-        }
+    ctx->readonly = true;
 
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            wallpaper_list[wallpaper_count] = id;
-            ++wallpaper_count;
-        }
+    return ctx;
+}
 
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(db));
-        }
+/**
+  Allocate a nextwall context without a database connection.
 
-        sqlite3_finalize(stmt);
+  The random number generator is seeded from the kernel, or from the time
+  and the process ID if that fails.
 
-        wallpaper_list_populated = 1;
+  @return Returns the context, or NULL if memory allocation failed.
+ */
+struct nextwall_ctx *new_context(void) {
+    uint64_t seed;
+    struct nextwall_ctx *ctx;
+
+    if ( !(ctx = calloc(1, sizeof *ctx)) ||
+            !(ctx->candidates = malloc(CANDIDATE_BATCH * sizeof *ctx->candidates)) ) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(ctx);
+        return NULL;
     }
 
-    if (wallpaper_count == 0) {
-        return -1;
-    }
+    g_rec_mutex_init(&ctx->lock);
+    ctx->snapshot_generation = -1;
 
-    // Get the next ID from the list.
-    if (wallpaper_current == wallpaper_count) {
-        wallpaper_current = 0;
+    if (getrandom(&seed, sizeof seed, GRND_NONBLOCK) != sizeof seed) {
+        seed = time(NULL) ^ ((uint64_t)getpid() << 32);
     }
-    id = wallpaper_list[wallpaper_current++];
 
-    set_path_from_id(db, id, result_path);
+    ctx->random_state = seed;
 
-    return id;
+    return ctx;
 }
 
 /**
-  Set the wallpaper path from an ID.
+  Close a nextwall context.
 
-  @param[in] db The database handler.
-  @param[in] id The ID of the wallpaper.
-  @param[out] result_path Will be set to the path of the randomly selected wallpaper.
-  @return 0 on success, -1 otherwise.
+  A stale snapshot is written first, see nextwall_sync_snapshot().
+
+  @param[in] ctx The context to close, may be NULL.
  */
-int set_path_from_id(sqlite3 *db, int id, char *result_path) {
-    int rc;
-    sqlite3_stmt *stmt;
-    const char *query = "SELECT path FROM wallpapers WHERE id = ?;";
+void nextwall_close(struct nextwall_ctx *ctx) {
+    int i;
 
-    rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return -1;
+    if (!ctx) {
+        return;
     }
 
-    sqlite3_bind_int(stmt, 1, id);
+    update_snapshot(ctx);
 
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        const unsigned char *found_path = sqlite3_column_text(stmt, 0);
+    for (i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(ctx->statements[i]);
+    }
 
-        if (strlcpy(result_path, (const char *)found_path, PATH_MAX) >= PATH_MAX) {
-            fprintf(stderr, "Error: path truncation occurred.\n");
-            sqlite3_finalize(stmt);
-            return -1;
-        }
+    sqlite3_close(ctx->db);
+
+    if (ctx->ann) {
+        fann_destroy(ctx->ann);
     }
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(db));
+    snapshot_close(ctx->snapshot);
+    free(ctx->snapshot_path);
+    g_rec_mutex_clear(&ctx->lock);
+    free(ctx->pending);
+    free(ctx->candidates);
+    free(ctx);
+}
+
+/**
+  Load the ANN that scans use to define the brightness of images.
+
+  @param[in] ctx The nextwall context.
+  @param[in] ann_path The path of the ANN file.
+  @return Returns 0 on success, -1 on failure.
+ */
+int nextwall_load_ann(struct nextwall_ctx *ctx, const char *ann_path) {
+    struct fann *ann;
+
+    if ( !(ann = fann_create_from_file(ann_path)) ) {
+        fprintf(stderr, "Error: Could not load ANN %s\n", ann_path);
+        return -1;
     }
 
-    sqlite3_finalize(stmt);
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (ctx->ann) {
+        fann_destroy(ctx->ann);
+    }
+    ctx->ann = ann;
+
+    g_rec_mutex_unlock(&ctx->lock);
 
     return 0;
 }
 
 /**
-  Move wallpaper to trash and remove it from the nextwall database.
+  Seed the random number generator of a context.
 
-  @param[in] db The database handler.
-  @param[in] path Absolute path of the wallpaper.
-  @return Returns 0 on successful completion, and -1 on error.
+  @param[in] ctx The nextwall context.
+  @param[in] seed The seed.
  */
-int remove_wallpaper(sqlite3 *db, char *path, bool trash_file) {
-    sqlite3_stmt *stmt;
-    const char *query = "DELETE FROM wallpapers WHERE path = ?;";
-    int rc;
+void nextwall_seed(struct nextwall_ctx *ctx, unsigned long long seed) {
+    g_rec_mutex_lock(&ctx->lock);
+    ctx->random_state = seed;
+    g_rec_mutex_unlock(&ctx->lock);
+}
 
-    rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return -1;
+/**
+  Use a snapshot file for fast selection.
+
+  The snapshot holds the paths of the wallpapers, so that peek_wallpaper()
+  can select a wallpaper without any SQL. With a context from
+  nextwall_open_readonly(), the snapshot is mapped if it is as new as the
+  database. Otherwise it is written whenever it is stale: now, after scans
+  and maintenance, and after removals on nextwall_sync_snapshot() or
+  nextwall_close().
+
+  @param[in] ctx The nextwall context.
+  @param[in] path The path of the snapshot file.
+  @return Returns 0 if the snapshot is up to date, -1 otherwise.
+ */
+int nextwall_use_snapshot(struct nextwall_ctx *ctx, const char *path) {
+    int rc = -1;
+    struct snapshot *snapshot;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    snapshot_close(ctx->snapshot);
+    ctx->snapshot = NULL;
+    free(ctx->snapshot_path);
+
+    if ( !(ctx->snapshot_path = strdup(path)) ) {
+        goto Return;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to bind parameter: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return -1;
+    ctx->snapshot_generation = -1;
+
+    if ((snapshot = snapshot_open(path))) {
+        ctx->snapshot_generation = snapshot->header->generation;
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    if (ctx->readonly) {
+        if (snapshot && ctx->snapshot_generation == snapshot_generation(ctx->db)) {
+            ctx->snapshot = snapshot;
+            rc = 0;
+        }
+        else {
+            snapshot_close(snapshot);
+        }
+    }
+    else {
+        snapshot_close(snapshot);
+        rc = update_snapshot(ctx);
     }
 
-    sqlite3_finalize(stmt);
+    goto Return;
 
-    if (trash_file && file_trash(path) == -1) {
-        return -1;
-    }
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
 
-    return 0;
+    return rc;
 }
 
 /**
- * Return the current width of the terminal.
- *
- * @return The width in columns, or a fallback of 80 on error.
- */
+  Write the snapshot if it is stale, such as after removals.
+
+  Writing the snapshot takes time in the number of wallpapers, so removals
+  leave it stale rather than writing it while the context is locked; a
+  reader falls back to SQL until then. Call this when the context is idle.
+
+  @param[in] ctx The nextwall context.
+  @return Returns 0 if the snapshot is up to date or not used, -1 on error.
+ */
+int nextwall_sync_snapshot(struct nextwall_ctx *ctx) {
+    int rc;
+
+    g_rec_mutex_lock(&ctx->lock);
+    rc = update_snapshot(ctx);
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc;
+}
+
+/**
+  Match the lightness of wallpapers to the altitude of the sun.
+
+  From then on, select_wallpaper() and peek_wallpaper() draw wallpapers with
+  sample_lightness(). The target goes from the darkest wallpapers when the
+  sun is ELEVATION_DARK degrees below the horizon to the lightest when it is
+  ELEVATION_LIGHT degrees up, so evenings get darker gradually instead of
+  in steps of brightness. The brightness value, pool, rotation and snapshot
+  are not used for these selections.
+
+  @param[in] ctx The nextwall context.
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+ */
+void nextwall_use_location(struct nextwall_ctx *ctx, double lat, double lon) {
+    g_rec_mutex_lock(&ctx->lock);
+    ctx->located = true;
+    ctx->latitude = lat;
+    ctx->longitude = lon;
+    g_rec_mutex_unlock(&ctx->lock);
+}
+
+/**
+  Return the target lightness for the altitude of the sun now.
+
+  @param[in] ctx The nextwall context, see nextwall_use_location().
+  @return Returns the target for sample_lightness().
+ */
+double get_target_lightness(struct nextwall_ctx *ctx) {
+    double elevation = solar_elevation(ctx->latitude, ctx->longitude, time(NULL));
+
+    return fmin(1, fmax(0, (elevation - ELEVATION_DARK) /
+                (ELEVATION_LIGHT - ELEVATION_DARK)));
+}
+
+/**
+  Maintain the database of a context and print its statistics.
+
+  See maintain_database() and print_database_stats(). The snapshot is
+  brought up to date too, since orphans may have been removed.
+
+  @param[in] ctx The nextwall context.
+  @param[in] stream The stream to print the statistics to.
+  @return Returns 0 on success, -1 on failure.
+ */
+int nextwall_maintain(struct nextwall_ctx *ctx, FILE *stream) {
+    int rc = -1;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (ctx->readonly) {
+        fprintf(stderr, "Error: The database is opened read-only\n");
+    }
+    else if (maintain_database(ctx->db) == 0) {
+        update_snapshot(ctx);
+        rc = print_database_stats(ctx->db, stream);
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc;
+}
+
+/**
+  Write the snapshot of a context if it is stale.
+
+  @param[in] ctx The nextwall context.
+  @return Returns 0 if the snapshot is up to date or not used, -1 on error.
+ */
+int update_snapshot(struct nextwall_ctx *ctx) {
+    int64_t generation;
+
+    if (!ctx->snapshot_path || ctx->readonly ||
+            ctx->snapshot_generation == snapshot_generation(ctx->db)) {
+        return 0;
+    }
+
+    if (snapshot_write(ctx->db, ctx->snapshot_path, &generation) == -1) {
+        fprintf(stderr, "Error: Failed to write the snapshot %s\n",
+                ctx->snapshot_path);
+        return -1;
+    }
+
+    ctx->snapshot_generation = generation;
+
+    return 0;
+}
+
+/**
+  Return a prepared statement of a context.
+
+  Each statement is prepared on first use and kept until the context is
+  closed. Reset the statement with sqlite3_reset() when done with it, so
+  that it does not keep the database locked.
+
+  @param[in] ctx The nextwall context.
+  @param[in] which The statement.
+  @return Returns the statement, or NULL if it could not be prepared.
+ */
+sqlite3_stmt *get_statement(struct nextwall_ctx *ctx, enum statement which) {
+    sqlite3_stmt **stmt = &ctx->statements[which];
+
+    if (!*stmt && sqlite3_prepare_v3(ctx->db, statement_queries[which], -1,
+                SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n",
+                sqlite3_errmsg(ctx->db));
+        return NULL;
+    }
+
+    return *stmt;
+}
+
+/**
+  Configure a new database connection.
+
+  Sets the busy timeout, so that a statement waits for other processes that
+  hold a lock instead of failing right away. Read-write connections also get
+  the settings of `connection_query`. A database that cannot switch to WAL
+  mode yet, because another process is using it, keeps working in its old
+  journal mode; the switch is tried again on the next start.
+
+  @param[in] db The database handler.
+  @param[in] readonly True if the connection is read-only.
+  @return Returns 0 on success or if the database is busy, -1 on failure.
+ */
+int configure_connection(sqlite3 *db, bool readonly) {
+    int rc;
+
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT);
+
+    if (readonly) {
+        return sqlite3_exec(db, "PRAGMA mmap_size = 67108864;",
+                NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+    }
+
+    rc = sqlite3_exec(db, connection_query, NULL, NULL, NULL);
+
+    if (rc == SQLITE_BUSY) {
+        fprintf(stderr, "Warning: Failed to configure the database: %s\n",
+                sqlite3_errmsg(db));
+    }
+    else if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error: Failed to configure the database: %s\n",
+                sqlite3_errmsg(db));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Step a statement that writes to the database until it is done.
+
+  The busy timeout already makes SQLite wait for a lock. If the database is
+  still busy after that, for example because a scan on a slow disk holds the
+  write lock, the statement is reset and tried again up to BUSY_RETRIES
+  times. Only use this for statements that do not return rows.
+
+  @param[in] stmt The statement.
+  @return Returns the result of the last sqlite3_step().
+ */
+int step_retry(sqlite3_stmt *stmt) {
+    int rc;
+    int tries = 0;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_BUSY && ++tries < BUSY_RETRIES) {
+        sqlite3_reset(stmt);
+    }
+
+    return rc;
+}
+
+/**
+  Execute a query without results, retrying while the database is busy.
+
+  See step_retry().
+
+  @param[in] db The database handler.
+  @param[in] query The query.
+  @return Returns the result of the last sqlite3_exec().
+ */
+int exec_retry(sqlite3 *db, const char *query) {
+    int rc;
+    int tries = 0;
+
+    do {
+        rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+    } while (rc == SQLITE_BUSY && ++tries < BUSY_RETRIES);
+
+    return rc;
+}
+
+/**
+  Begin a write transaction.
+
+  The write lock is taken right away, so that the transaction waits for other
+  writers here rather than failing halfway on a write.
+
+  @param[in] ctx The nextwall context.
+  @return Returns SQLITE_OK on success, or an SQLite error code.
+ */
+int begin_transaction(struct nextwall_ctx *ctx) {
+    int rc;
+
+    if ((rc = exec_retry(ctx->db, "BEGIN IMMEDIATE")) != SQLITE_OK) {
+        fprintf(stderr, "Error: Failed to begin a transaction: %s\n",
+                sqlite3_errmsg(ctx->db));
+    }
+
+    return rc;
+}
+
+/**
+  Commit the transaction started with begin_transaction().
+
+  @param[in] ctx The nextwall context.
+  @return Returns SQLITE_OK on success, or an SQLite error code.
+ */
+int commit_transaction(struct nextwall_ctx *ctx) {
+    int rc;
+
+    if ((rc = exec_retry(ctx->db, "COMMIT")) != SQLITE_OK) {
+        fprintf(stderr, "Error: Failed to commit a transaction: %s\n",
+                sqlite3_errmsg(ctx->db));
+    }
+
+    return rc;
+}
+
+/**
+  Scan the directory for new wallpapers.
+
+  The path of each image file that is found in the directory is saved along
+  with additional information (e.g. lightness) to the database. It will use the
+  Artificial Neural Network to define the brightness value of each image, so
+  load it with nextwall_load_ann() first.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory.
+  @param[in] recursive If set to 1, the base directory is scanned recursively.
+  @return The number of new wallpapers that were saved, or -1 if no ANN is
+          loaded or saving them failed.
+ */
+int scan_dir(struct nextwall_ctx *ctx, const char *base, int recursive) {
+    int found = -1;
+    int saved;
+    magic_t magic;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!ctx->ann) {
+        fprintf(stderr, "Error: No ANN loaded for the scan\n");
+        goto Return;
+    }
+
+    // Initialize Magic Number Recognition Library
+    magic = magic_open(MAGIC_MIME_TYPE);
+    magic_load(magic, NULL);
+
+    found = scan_tree(ctx, magic, base, recursive, get_terminal_width());
+    if (found != -1 && (saved = flush_images(ctx, true)) != -1) {
+        found += saved;
+    }
+    else {
+        found = -1;
+    }
+    update_snapshot(ctx);
+
+    magic_close(magic);
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return found;
+}
+
+/**
+  Scan a directory and, if recursive, its subdirectories for scan_dir().
+
+  @param[in] ctx The nextwall context.
+  @param[in] magic The Magic Number Recognition Library cookie.
+  @param[in] base The directory.
+  @param[in] recursive If set to 1, subdirectories are scanned too.
+  @param[in] terminal_width The width of the terminal in columns.
+  @return The number of new wallpapers that were saved, or -1 if saving
+          them failed. Wallpapers that are still pending are not counted.
+ */
+int scan_tree(struct nextwall_ctx *ctx, magic_t magic, const char *base,
+        int recursive, int terminal_width) {
+    int found = 0;
+    int saved;
+    int is_dir;
+    char path_tmp[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat statbuf;
+    DIR *dir;
+
+    if (!(dir = opendir(base))) {
+        return found;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (snprintf(path_tmp, sizeof path_tmp, "%s/%s", base,
+                    entry->d_name) >= (int)sizeof path_tmp) {
+            fprintf(stderr, "\nError: path truncation occurred.\n");
+            continue;
+        }
+
+        if (realpath(path_tmp, path) == NULL) {
+            perror("realpath");
+            break;
+        }
+
+        if (entry->d_type == DT_UNKNOWN) {
+            // The file type could not be determined. Fallback to using stat.
+            is_dir = stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+        }
+        else {
+            is_dir = entry->d_type == DT_DIR;
+        }
+
+        if (is_dir) {
+            if (!recursive) {
+                continue;
+            }
+
+            if (strcmp(entry->d_name, ".") == 0 || \
+                strcmp(entry->d_name, "..") == 0 || \
+                strcmp(entry->d_name, ".thumbs") == 0) {
+                continue;
+            }
+
+            if ((saved = scan_tree(ctx, magic, path, recursive,
+                            terminal_width)) == -1) {
+                found = -1;
+                break;
+            }
+            found += saved;
+        }
+        else if (is_image_file(ctx, magic, path)) {
+            print_progress(path, terminal_width);
+
+            if (find_wallpaper(ctx, path) != -1 || is_pending(ctx, path)) {
+                continue;
+            }
+
+            if (save_image_info(ctx, path) == -1) {
+                fprintf(stderr, "\nError: Failed to save image info for %s\n", path);
+                break;
+            }
+
+            if ((saved = flush_images(ctx, false)) == -1) {
+                found = -1;
+                break;
+            }
+            found += saved;
+        }
+    }
+
+    closedir(dir);
+
+    return found;
+}
+
+/**
+  Scan a list of files for new wallpapers.
+
+  Reads NUL-delimited file paths from `stream` (e.g. the output of
+  `find -print0`) and saves each new image file to the database, just like
+  scan_dir() does for the files it finds. Paths that are already in the
+  database or listed before are skipped. A path that cannot be resolved or analyzed is
+  reported and skipped, so one bad entry does not abort the scan.
+
+  @param[in] ctx The nextwall context.
+  @param[in] stream The stream to read the NUL-delimited paths from.
+  @return The number of new wallpapers that were saved, or -1 if no ANN is
+          loaded or saving them failed.
+ */
+int scan_list(struct nextwall_ctx *ctx, FILE *stream) {
+    int found = -1;
+    int saved;
+    int terminal_width = get_terminal_width();
+    char *entry = NULL;
+    char path[PATH_MAX];
+    size_t entry_size = 0;
+    magic_t magic;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!ctx->ann) {
+        fprintf(stderr, "Error: No ANN loaded for the scan\n");
+        goto Return;
+    }
+
+    // Initialize Magic Number Recognition Library
+    magic = magic_open(MAGIC_MIME_TYPE);
+    magic_load(magic, NULL);
+    found = 0;
+
+    while (getdelim(&entry, &entry_size, '\0', stream) != -1) {
+        // Ignore empty entries, such as a trailing delimiter.
+        if (*entry == '\0') {
+            continue;
+        }
+
+        if (realpath(entry, path) == NULL) {
+            fprintf(stderr, "\nError: %s: %s\n", entry, strerror(errno));
+            continue;
+        }
+
+        if (!is_image_file(ctx, magic, path)) {
+            fprintf(stderr, "\n'%s' is not an image file; skipping...\n", path);
+            continue;
+        }
+
+        print_progress(path, terminal_width);
+
+        // A path can be listed more than once
+        if (find_wallpaper(ctx, path) != -1 || is_pending(ctx, path)) {
+            continue;
+        }
+
+        if (save_image_info(ctx, path) == -1) {
+            fprintf(stderr, "\nError: Failed to save image info for %s\n", path);
+            continue;
+        }
+
+        if ((saved = flush_images(ctx, false)) == -1) {
+            found = -1;
+            break;
+        }
+        found += saved;
+    }
+
+    if (ferror(stream)) {
+        fprintf(stderr, "\nError: Failed to read the file list: %s\n",
+                strerror(errno));
+    }
+
+    if (found != -1 && (saved = flush_images(ctx, true)) != -1) {
+        found += saved;
+    }
+    else {
+        found = -1;
+    }
+    update_snapshot(ctx);
+    magic_close(magic);
+    free(entry);
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return found;
+}
+
+/**
+  Check the MIME type of a file to see if it is an image file.
+
+  @param[in] ctx The nextwall context.
+  @param[in] magic The Magic Number Recognition Library cookie.
+  @param[in] path The path of the file to check.
+  @return Returns 1 if the file is an image file, 0 otherwise.
+ */
+int is_image_file(struct nextwall_ctx *ctx, magic_t magic, const char *path) {
+    const char *mime;
+    double start = get_time();
+
+    mime = magic_file(magic, path);
+    SCAN_STATS_ADD(ctx, sniff, start);
+
+    return mime && strstr(mime, "image");
+}
+
+/**
+  Print the path of the file being scanned on a single terminal line.
+
+  @param[in] path The path to print.
+  @param[in] terminal_width The width of the terminal in columns.
+ */
+void print_progress(const char *path, int terminal_width) {
+    // Only show progress on a terminal, so it doesn't end up in redirected
+    // output.
+    if (!isatty(STDOUT_FILENO)) {
+        return;
+    }
+
+    // Build the full line to be printed
+    char line_buffer[terminal_width + 1];
+    strlcpy(line_buffer, path, sizeof(line_buffer));
+
+    // Use %-*s to print the line and pad it with spaces to fill the terminal
+    printf("\r%-*s", terminal_width, line_buffer);
+    fflush(stdout);
+}
+
+/**
+  Saves the wallpaper information to the nextwall database.
+
+  Saves the wallpaper path along with the lightness and brightness value for
+  the wallpaper. The image is analyzed right away, but saved later with
+  flush_images(), together with the other images that were analyzed in the
+  meantime. This way a scan only holds the write lock of the database for
+  short moments, and not while it reads images. Call flush_images() after
+  each image.
+
+  @param[in] ctx The nextwall context.
+  @param[in] path The absolute path of the wallpaper file.
+  @return Returns 0 on success, -1 otherwise.
+ */
+int save_image_info(struct nextwall_ctx *ctx, const char *path) {
+    double lightness;
+    double start;
+    const char *name;
+    struct pending_image *image;
+
+    if (!ctx->pending &&
+            !(ctx->pending = malloc(SCAN_BATCH * sizeof *ctx->pending))) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    image = &ctx->pending[ctx->pending_count];
+
+    if (split_path(path, image->dir, sizeof image->dir, &name) == -1 ||
+            strlcpy(image->name, name, sizeof image->name) >= sizeof image->name) {
+        return -1;
+    }
+
+    // Get the lightness for this image
+    start = get_time();
+    if (get_image_info(path, &lightness) == -1) {
+        return -1;
+    }
+    SCAN_STATS_ADD(ctx, decode, start);
+
+    // Get image brigthness
+    start = get_time();
+    image->lightness = lightness;
+    image->brightness = get_brightness(ctx->ann, lightness);
+    SCAN_STATS_ADD(ctx, classify, start);
+
+    if (ctx->pending_count++ == 0) {
+        ctx->pending_start = get_time();
+    }
+
+    return 0;
+}
+
+/**
+  Save the images that save_image_info() has analyzed in one transaction.
+
+  Unless forced, the images are only saved once there are SCAN_BATCH of them,
+  or the first one is SCAN_COMMIT_TIME seconds old. An image that another
+  process has saved in the meantime is skipped.
+
+  @param[in] ctx The nextwall context.
+  @param[in] force If true, save the pending images right away.
+  @return Returns the number of images that were saved, or -1 on error.
+ */
+int flush_images(struct nextwall_ctx *ctx, bool force) {
+    int i, rc;
+    int saved = 0;
+    double start = get_time();
+    struct pending_image *image;
+    sqlite3_stmt *stmt;
+
+    if (ctx->pending_count == 0 || (!force &&
+                ctx->pending_count < SCAN_BATCH &&
+                start - ctx->pending_start < SCAN_COMMIT_TIME)) {
+        return 0;
+    }
+
+    if (!(stmt = get_statement(ctx, STMT_INSERT_WALLPAPER)) ||
+            begin_transaction(ctx) != SQLITE_OK) {
+        ctx->pending_count = 0;
+        return -1;
+    }
+
+    for (i = 0; i < ctx->pending_count; i++) {
+        image = &ctx->pending[i];
+
+        // Bind values to prepared statement
+        sqlite3_bind_text(stmt, 1, image->dir, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, image->name, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 3, image->lightness);
+        sqlite3_bind_int(stmt, 4, image->brightness);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc == SQLITE_DONE) {
+            saved++;
+        }
+        else if (rc != SQLITE_CONSTRAINT) {
+            fprintf(stderr, "\nError: Failed to save image info for %s/%s: %s\n",
+                    image->dir, image->name, sqlite3_errmsg(ctx->db));
+        }
+    }
+
+    ctx->pending_count = 0;
+
+    if (commit_transaction(ctx) != SQLITE_OK) {
+        sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+
+    SCAN_STATS_ADD(ctx, insert, start);
+
+    if (ctx->scan_stats) {
+        ctx->scan_stats->images += saved;
+    }
+
+    return saved;
+}
+
+/**
+  Check if an image was analyzed by save_image_info() but not saved yet.
+
+  @param[in] ctx The nextwall context.
+  @param[in] path Absolute path of the image.
+  @return Returns 1 if the image is pending, 0 otherwise.
+ */
+int is_pending(struct nextwall_ctx *ctx, const char *path) {
+    int i;
+    char dir[PATH_MAX];
+    const char *name;
+
+    if (split_path(path, dir, sizeof dir, &name) == -1) {
+        return 0;
+    }
+
+    for (i = 0; i < ctx->pending_count; i++) {
+        if (strcmp(ctx->pending[i].name, name) == 0 &&
+                strcmp(ctx->pending[i].dir, dir) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+  Select a random wallpaper from the nextwall database.
+
+  Wallpapers are selected with rotate_wallpaper(), so the same wallpaper is
+  not selected again until all wallpapers below `base` have been selected.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, wallpapers matching this
+             brightness value are returned.
+  @param[out] result_path Will be set to the path of the randomly selected wallpaper.
+  @return Returns the ID of a randomly selected wallpaper on success, -1
+          otherwise.
+ */
+int nextwall(struct nextwall_ctx *ctx, const char *base, int brightness, char *result_path) {
+    int id;
+    int tries;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    // A wallpaper that another process removed right after it was selected
+    // has no path anymore; move on to the next one in the rotation.
+    for (tries = 0; tries < SAMPLE_TRIES; tries++) {
+        if ((id = rotate_wallpaper(ctx, base, brightness)) == -1 ||
+                set_path_from_id(ctx, id, result_path) == 0) {
+            break;
+        }
+        id = -1;
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Select the next wallpaper in the rotation for a base directory.
+
+  The rotation visits the wallpapers below `base` in order of their random
+  shuffle key, starting at a random key and wrapping around once. Its
+  position is stored in the rotations table per base directory and
+  brightness, so successive invocations continue where the previous one left
+  off, and no wallpaper is repeated until all of them were selected. Each
+  step is a single index range lookup.
+
+  Wallpapers that are added during a rotation are selected in the same
+  rotation if their key was not passed yet, and removed wallpapers are simply
+  skipped, so scans and removals need no rebuild.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @return Returns the ID of the wallpaper on success, -1 if no wallpaper
+          matches or on error.
+ */
+int rotate_wallpaper(struct nextwall_ctx *ctx, const char *base, int brightness) {
+    int rc;
+    int id = -1;
+    int wrapped = 0;
+    int restarted = 0;
+    sqlite3_int64 start = -1, position = -1, key = -1;
+    struct path_range range;
+    sqlite3_stmt *stmt;
+
+    if (set_path_range(base, &range) == -1) {
+        return -1;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    // Get the position of the rotation
+    if (!(stmt = get_statement(ctx, STMT_GET_ROTATION))) {
+        goto Return;
+    }
+
+    sqlite3_bind_text(stmt, 1, range.dir, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, brightness);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        start = sqlite3_column_int64(stmt, 0);
+        position = sqlite3_column_int64(stmt, 1);
+        wrapped = sqlite3_column_int(stmt, 2);
+    }
+    else {
+        // Start a new rotation
+        restarted = 1;
+    }
+
+    sqlite3_reset(stmt);
+
+    // Find the wallpaper with the next key
+    if (!(stmt = get_statement(ctx, brightness != -1 ?
+                    STMT_NEXT_IN_ROTATION_BRIGHTNESS : STMT_NEXT_IN_ROTATION))) {
+        goto Return;
+    }
+
+    sqlite3_bind_text(stmt, 3, range.dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, range.lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, range.upper, -1, SQLITE_STATIC);
+    if (brightness != -1) {
+        sqlite3_bind_int(stmt, 6, brightness);
+    }
+
+    for (;;) {
+        if (restarted == 1) {
+            // Shuffle keys are non-negative 63-bit numbers.
+            start = random_below(INT64_MAX, &ctx->random_state);
+            position = start - 1;
+            wrapped = 0;
+            restarted = 2;
+        }
+
+        // Before wrapping, visit the keys from the start up; after it, the
+        // keys from zero up to the start.
+        sqlite3_bind_int64(stmt, 1, position);
+        sqlite3_bind_int64(stmt, 2, wrapped ? start : INT64_MAX);
+
+        if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            id = sqlite3_column_int(stmt, 0);
+            key = sqlite3_column_int64(stmt, 1);
+            break;
+        }
+
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+            break;
+        }
+
+        if (!wrapped) {
+            wrapped = 1;
+            position = -1;
+        }
+        else if (restarted == 0) {
+            // All wallpapers were selected; start a new rotation.
+            restarted = 1;
+        }
+        else {
+            // There are no wallpapers to select.
+            break;
+        }
+    }
+
+    sqlite3_reset(stmt);
+
+    if (id == -1) {
+        goto Return;
+    }
+
+    // Save the position of the rotation
+    if (!(stmt = get_statement(ctx, STMT_SAVE_ROTATION))) {
+        goto Return;
+    }
+
+    sqlite3_bind_text(stmt, 1, range.dir, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, brightness);
+    sqlite3_bind_int64(stmt, 3, start);
+    sqlite3_bind_int64(stmt, 4, key);
+    sqlite3_bind_int(stmt, 5, wrapped);
+
+    if (step_retry(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to save the rotation: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Draw a uniformly distributed random wallpaper ID.
+
+  Instead of sorting all matching wallpapers in random order, this first
+  tries a few random IDs between the lowest and highest wallpaper ID, and
+  accepts the first one that exists and matches. This takes a few index
+  lookups when most wallpapers match, such as for the whole library. When
+  all tries miss, a directory and brightness below `base` is picked with a
+  chance proportional to its number of wallpapers (from the wallpaper_counts
+  table), and then a random wallpaper within that group, which is an index
+  seek on its `group_rank`. That takes time in the number of directories
+  below `base`, but not in the number of wallpapers. Either way each
+  matching wallpaper has the same chance of being selected.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @return Returns the ID of the wallpaper on success, -1 if no wallpaper
+          matches or on error.
+ */
+int sample_wallpaper(struct nextwall_ctx *ctx, const char *base, int brightness) {
+    int id;
+    struct path_range range;
+
+    if (set_path_range(base, &range) == -1) {
+        return -1;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if ((id = sample_by_id(ctx, &range, brightness)) == -1) {
+        id = sample_by_count(ctx, &range, brightness);
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Try to draw a random wallpaper ID by rejection sampling.
+
+  @param[in] ctx The nextwall context.
+  @param[in] range The directories from which to select wallpapers.
+  @param[in] brightness The brightness value to match, or -1 for any.
+  @return Returns the ID of the wallpaper, or -1 if all tries missed.
+ */
+int sample_by_id(struct nextwall_ctx *ctx, struct path_range *range, int brightness) {
+    int i;
+    int rc;
+    int id = -1;
+    sqlite3_int64 min_id = 0, max_id = -1;
+    sqlite3_stmt *stmt;
+
+    if (!(stmt = get_statement(ctx, STMT_ID_RANGE))) {
+        return -1;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        min_id = sqlite3_column_int64(stmt, 0);
+        max_id = sqlite3_column_int64(stmt, 1);
+    }
+
+    sqlite3_reset(stmt);
+
+    if (max_id < min_id || !(stmt = get_statement(ctx, STMT_SAMPLE_ID))) {
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 2, range->dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, range->lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, range->upper, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 5, brightness);
+
+    for (i = 0; i < SAMPLE_TRIES && id == -1; i++) {
+        sqlite3_bind_int64(stmt, 1, min_id +
+                random_below(max_id - min_id + 1, &ctx->random_state));
+
+        if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            id = sqlite3_column_int(stmt, 0);
+        }
+        else if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+            i = SAMPLE_TRIES;
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    return id;
+}
+
+/**
+  Draw a random wallpaper ID using the wallpaper counts.
+
+  @param[in] ctx The nextwall context.
+  @param[in] range The directories from which to select wallpapers.
+  @param[in] brightness The brightness value to match, or -1 for any.
+  @return Returns the ID of the wallpaper on success, -1 if no wallpaper
+          matches or on error.
+ */
+int sample_by_count(struct nextwall_ctx *ctx, struct path_range *range, int brightness) {
+    int rc;
+    int dir_id = -1;
+    int dir_brightness = -1;
+    long long count, total = 0, rank = 0;
+    sqlite3_stmt *stmt;
+
+    if (!(stmt = get_statement(ctx, STMT_COUNTS))) {
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, range->dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, range->lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, range->upper, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, brightness);
+
+    // Pick a directory and brightness in a single pass: each one replaces
+    // the pick with a chance of its count over the running total.
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if ((count = sqlite3_column_int64(stmt, 2)) <= 0) {
+            continue;
+        }
+
+        total += count;
+
+        if (random_below(total, &ctx->random_state) < count) {
+            dir_id = sqlite3_column_int(stmt, 0);
+            dir_brightness = sqlite3_column_int(stmt, 1);
+            rank = random_below(count, &ctx->random_state);
+        }
+    }
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    if (dir_id == -1) {
+        return -1;
+    }
+
+    return get_id_by_rank(ctx, dir_id, dir_brightness, rank);
+}
+
+/**
+  Look up a wallpaper by its number within its directory and brightness.
+
+  @param[in] ctx The nextwall context.
+  @param[in] dir_id The ID of the directory.
+  @param[in] brightness The brightness value.
+  @param[in] rank The number of the wallpaper, from 0 to the number of
+             wallpapers in the group minus one; see group_rank_query.
+  @return Returns the ID of the wallpaper, or -1 if there is none or on
+          error.
+ */
+int get_id_by_rank(struct nextwall_ctx *ctx, int dir_id, int brightness,
+        long long rank) {
+    int rc;
+    int id = -1;
+    sqlite3_stmt *stmt;
+
+    if (!(stmt = get_statement(ctx, STMT_SAMPLE_RANK))) {
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, dir_id);
+    sqlite3_bind_int(stmt, 2, brightness);
+    sqlite3_bind_int64(stmt, 3, rank);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    return id;
+}
+
+/**
+  Draw a random wallpaper ID with a lightness near a target.
+
+  The target is a fraction of the lightness range of all wallpapers, from 0
+  for the darkest to 1 for the lightest. A random lightness is drawn from
+  the window of LIGHTNESS_TOLERANCE around the target, and the first
+  wallpaper below `base` at or above it in the window is taken, or else the
+  first one in the window below it. Both are seeks on the lightness index,
+  so this takes O(log n) time when most wallpapers are below `base`. A
+  wallpaper after a gap in lightness is more likely to be drawn than one in
+  a dense stretch. If the window has no wallpaper, it is widened until it
+  covers all of them.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] target The target lightness, from 0 to 1.
+  @return Returns the ID of the wallpaper on success, -1 if no wallpaper
+          matches or on error.
+ */
+int sample_lightness(struct nextwall_ctx *ctx, const char *base, double target) {
+    int id = -1;
+    double min = 0, max = -1;
+    double width, low, high, x;
+    struct path_range range;
+    sqlite3_stmt *stmt;
+
+    if (set_path_range(base, &range) == -1) {
+        return -1;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!(stmt = get_statement(ctx, STMT_LIGHTNESS_RANGE))) {
+        goto Return;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        min = sqlite3_column_double(stmt, 0);
+        max = sqlite3_column_double(stmt, 1);
+    }
+
+    sqlite3_reset(stmt);
+
+    if (max < min) {
+        goto Return;
+    }
+
+    target = min + target * (max - min);
+    width = LIGHTNESS_TOLERANCE * (max - min);
+
+    do {
+        low = target - width;
+        high = target + width;
+        x = low + (high - low) *
+            random_below(1LL << 53, &ctx->random_state) / (1LL << 53);
+
+        if ((id = seek_lightness(ctx, &range, x, high)) == -1) {
+            id = seek_lightness(ctx, &range, low, x);
+        }
+
+        width *= 2;
+    } while (id == -1 && (low > min || high < max));
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Find the darkest wallpaper in a range of lightness for sample_lightness().
+
+  @param[in] ctx The nextwall context.
+  @param[in] range The directories from which to select wallpapers.
+  @param[in] low The lowest lightness.
+  @param[in] high The highest lightness.
+  @return Returns the ID of the wallpaper, or -1 if there is none or on
+          error.
+ */
+int seek_lightness(struct nextwall_ctx *ctx, struct path_range *range,
+        double low, double high) {
+    int rc;
+    int id = -1;
+    sqlite3_stmt *stmt;
+
+    if (!(stmt = get_statement(ctx, STMT_SEEK_LIGHTNESS))) {
+        return -1;
+    }
+
+    sqlite3_bind_double(stmt, 1, low);
+    sqlite3_bind_double(stmt, 2, high);
+    sqlite3_bind_text(stmt, 3, range->dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, range->lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, range->upper, -1, SQLITE_STATIC);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    return id;
+}
+
+/**
+  Select the next wallpaper that exists and is not the current wallpaper.
+
+  If `id` is not -1, the wallpaper with that ID and `result_path` is the
+  first candidate. If it cannot be used, candidates are drawn in batches
+  that double in size up to CANDIDATE_BATCH. All candidates of a batch are
+  checked before any is used, and the wallpapers whose files are gone are
+  removed from the database in one transaction. The first usable candidate
+  is selected. Batches start small because the unused candidates are
+  skipped by the rotation.
+
+  Selecting stops without a wallpaper when a removal fails, or when
+  CANDIDATE_BATCH or more wallpapers were removed, so that a call returns
+  soon when the files of many wallpapers are gone, such as on an unmounted
+  drive. The next call continues with the remaining candidates.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @param[in] pool The pool to draw from with weighted_wallpaper(), or NULL
+             to select from the rotation.
+  @param[in] current The path of the current wallpaper.
+  @param[in,out] id Will be set to the ID of the selected wallpaper.
+  @param[in,out] result_path Will be set to the path of the selected
+                 wallpaper.
+  @return Returns the ID of the wallpaper on success, -1 if there is no
+          usable wallpaper or on error.
+ */
+int select_wallpaper(struct nextwall_ctx *ctx,
+                     const char *base,
+                     int brightness,
+                     struct weighted_pool *pool,
+                     const char *current,
+                     int *id,
+                     char *result_path) {
+    int i, j, n, draws;
+    int batch = 1;
+    int selected = -1;
+    int stale_count;
+    int stale_total = 0;
+    int removal = 0;
+    int stale[CANDIDATE_BATCH];
+    struct candidate *candidates = ctx->candidates;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    for (;;) {
+        n = 0;
+
+        // Use the wallpaper that was selected before as the first candidate
+        if (*id != -1) {
+            candidates[n].id = *id;
+            strlcpy(candidates[n].path, result_path, PATH_MAX);
+            n++;
+        }
+
+        // Draw distinct candidates. Allow for a few repeated draws, which
+        // happen when fewer wallpapers are left than the batch size.
+        for (draws = 0; n < batch && draws < 2 * batch; draws++) {
+            if ((*id = next_wallpaper(ctx, base, brightness, pool,
+                            candidates[n].path)) == -1) {
+                break;
+            }
+
+            for (j = 0; j < n && candidates[j].id != *id; j++);
+
+            if (j == n) {
+                candidates[n++].id = *id;
+            }
+        }
+
+        // Check all candidates before using any of them
+        for (i = 0, stale_count = 0; i < n; i++) {
+            if (strcmp(candidates[i].path, current) == 0) {
+                continue;
+            }
+
+            if (!is_regular_file(candidates[i].path)) {
+                stale[stale_count++] = candidates[i].id;
+            }
+            else if (selected == -1) {
+                selected = i;
+            }
+        }
+
+        if ((removal = remove_wallpapers(ctx, stale, stale_count)) == 0 &&
+                pool) {
+            for (i = 0; i < stale_count; i++) {
+                weighted_pool_update(pool, stale[i]);
+            }
+        }
+
+        stale_total += stale_count;
+
+        if (selected != -1) {
+            *id = candidates[selected].id;
+            strlcpy(result_path, candidates[selected].path, PATH_MAX);
+            break;
+        }
+
+        // The candidates are used up
+        *id = -1;
+
+        // With nextwall_use_location(), the current wallpaper may be the
+        // only one near the target lightness; keep it then
+        if (ctx->located && stale_count == 0 && batch == CANDIDATE_BATCH) {
+            for (i = 0; i < n && strcmp(candidates[i].path, current) != 0; i++);
+
+            if (i < n) {
+                *id = candidates[i].id;
+                strlcpy(result_path, candidates[i].path, PATH_MAX);
+                break;
+            }
+        }
+
+        // Stop when a full batch found neither a usable nor a removed
+        // wallpaper, or when the removals failed or add up to a full batch
+        if (n == 0 || removal == -1 ||
+                (stale_count == 0 && batch == CANDIDATE_BATCH)) {
+            break;
+        }
+
+        if (stale_total >= CANDIDATE_BATCH) {
+            fprintf(stderr, "Error: Removed %d wallpapers whose files are " \
+                    "gone without finding one that exists\n", stale_total);
+            break;
+        }
+
+        if (batch < CANDIDATE_BATCH) {
+            batch *= 2;
+        }
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return *id;
+}
+
+/**
+  Select a random wallpaper without writing to the database.
+
+  This works on a context from nextwall_open_readonly(). Unlike
+  select_wallpaper(), the rotation is not used, and wallpapers whose files
+  are gone are skipped rather than removed from the database. Without a
+  pool, the wallpaper is drawn from the snapshot if the context has one;
+  see nextwall_use_snapshot(). With nextwall_use_location(), it is drawn
+  with sample_lightness().
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @param[in] pool The pool to draw from with weighted_wallpaper(), or NULL
+             to sample uniformly.
+  @param[out] result_path Will be set to the path of the wallpaper.
+  @return Returns the ID of the wallpaper on success, -1 if no usable
+          wallpaper was found or on error.
+ */
+int peek_wallpaper(struct nextwall_ctx *ctx,
+                   const char *base,
+                   int brightness,
+                   struct weighted_pool *pool,
+                   char *result_path) {
+    int i;
+    int id = -1;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    for (i = 0; i < SAMPLE_TRIES; i++) {
+        if (!pool && ctx->snapshot && !ctx->located) {
+            // The snapshot has the path too, so no SQL runs at all
+            id = snapshot_pick(ctx->snapshot, base, brightness,
+                    &ctx->random_state, result_path);
+        }
+        else {
+            if (ctx->located) {
+                id = sample_lightness(ctx, base, get_target_lightness(ctx));
+            }
+            else {
+                id = pool ? weighted_wallpaper(pool) : sample_wallpaper(ctx, base, brightness);
+            }
+
+            if (id != -1 && set_path_from_id(ctx, id, result_path) == -1) {
+                result_path[0] = '\0';
+            }
+        }
+
+        if (id == -1 || is_regular_file(result_path)) {
+            break;
+        }
+
+        id = -1;
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Select several different random wallpapers without writing to the
+  database.
+
+  The wallpapers are drawn without replacement, so they are all different,
+  and all matching wallpapers are drawn before fewer than `count` are
+  returned. Wallpapers whose files are gone are skipped:
+
+  - Without a pool, each matching wallpaper has the same chance; see
+    peek_uniform().
+  - With a pool, by weight; see peek_weighted().
+  - With nextwall_use_location(), from the wallpapers with a lightness near
+    the target; see peek_lightness().
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @param[in] pool The pool to draw from with weighted_wallpaper(), or NULL
+             to sample uniformly.
+  @param[out] result Will be set to the wallpapers, and must have room for
+              `count` of them.
+  @param[in] count The number of wallpapers to select.
+  @return Returns the number of wallpapers selected, or -1 on error.
+ */
+int peek_wallpapers(struct nextwall_ctx *ctx,
+                    const char *base,
+                    int brightness,
+                    struct weighted_pool *pool,
+                    struct wallpaper_info *result,
+                    int count) {
+    int n;
+    struct path_range range;
+
+    if (set_path_range(base, &range) == -1) {
+        return -1;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (ctx->located) {
+        n = peek_lightness(ctx, &range, result, count);
+    }
+    else if (pool) {
+        n = peek_weighted(pool, result, count);
+    }
+    else {
+        n = peek_uniform(ctx, &range, brightness, result, count);
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return n;
+}
+
+/**
+  Draw different wallpapers with the same chance each for peek_wallpapers().
+
+  The matching wallpapers are numbered through the groups of the
+  wallpaper_counts table, and the numbers are shuffled with a Fisher-Yates
+  shuffle that stops after the wallpapers it needs. Only the positions that
+  were swapped are stored, and each number is looked up by its group and
+  `group_rank`, so this takes time in the number of directories below
+  `base` and the number of draws, but not in the number of wallpapers.
+
+  @param[in] ctx The nextwall context.
+  @param[in] range The directories from which to select wallpapers.
+  @param[in] brightness The brightness value to match, or -1 for any.
+  @param[out] result Will be set to the wallpapers.
+  @param[in] count The number of wallpapers to select.
+  @return Returns the number of wallpapers selected, or -1 on error.
+ */
+int peek_uniform(struct nextwall_ctx *ctx, struct path_range *range,
+        int brightness, struct wallpaper_info *result, int count) {
+    int rc;
+    int n = -1;
+    int id, total = 0;
+    int k, j, number, other, low, high, middle;
+    struct group group, *found;
+    sqlite3_stmt *stmt;
+    GArray *groups = g_array_new(FALSE, FALSE, sizeof (struct group));
+    GHashTable *swapped = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (!(stmt = get_statement(ctx, STMT_COUNTS))) {
+        goto Return;
+    }
+
+    sqlite3_bind_text(stmt, 1, range->dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, range->lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, range->upper, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, brightness);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if ((group.count = sqlite3_column_int(stmt, 2)) <= 0) {
+            continue;
+        }
+
+        group.dir_id = sqlite3_column_int(stmt, 0);
+        group.brightness = sqlite3_column_int(stmt, 1);
+        group.start = total;
+        total += group.count;
+        g_array_append_val(groups, group);
+    }
+
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+        goto Return;
+    }
+
+    // Position k takes the number at a random position j from k on, and
+    // position j takes the number of position k. A position that is not
+    // in `swapped` holds its own number; the others hold it plus one.
+    for (k = 0, n = 0; k < total && n < count; k++) {
+        j = k + random_below(total - k, &ctx->random_state);
+        number = GPOINTER_TO_INT(g_hash_table_lookup(swapped, GINT_TO_POINTER(j)));
+        other = GPOINTER_TO_INT(g_hash_table_lookup(swapped, GINT_TO_POINTER(k)));
+        g_hash_table_insert(swapped, GINT_TO_POINTER(j),
+                GINT_TO_POINTER(other ? other : k + 1));
+        number = number ? number - 1 : j;
+
+        // Find the last group that starts at or before the number
+        for (low = 0, high = groups->len - 1; low < high; ) {
+            middle = (low + high + 1) / 2;
+
+            if (g_array_index(groups, struct group, middle).start <= number) {
+                low = middle;
+            }
+            else {
+                high = middle - 1;
+            }
+        }
+
+        found = &g_array_index(groups, struct group, low);
+        id = get_id_by_rank(ctx, found->dir_id, found->brightness,
+                number - found->start);
+
+        if (id != -1 && get_wallpaper_info(ctx, id, &result[n]) == 0) {
+            n++;
+        }
+    }
+
+    goto Return;
+
+Return:
+    g_array_free(groups, TRUE);
+    g_hash_table_destroy(swapped);
+
+    return n;
+}
+
+/**
+  Draw different wallpapers by weight for peek_wallpapers().
+
+  Each drawn wallpaper gets a weight of 0 until all are drawn, so that it
+  is not drawn again, and then gets its weight back with
+  weighted_pool_update().
+
+  @param[in] pool The pool to draw from.
+  @param[out] result Will be set to the wallpapers.
+  @param[in] count The number of wallpapers to select.
+  @return Returns the number of wallpapers selected.
+ */
+int peek_weighted(struct weighted_pool *pool, struct wallpaper_info *result,
+        int count) {
+    int n = 0;
+    int id, index;
+    guint i;
+    GArray *drawn = g_array_new(FALSE, FALSE, sizeof (int));
+
+    while (n < count && (id = weighted_wallpaper(pool)) != -1) {
+        if ((index = find_pool_index(pool, id)) == -1) {
+            break;
+        }
+
+        g_array_append_val(drawn, id);
+        fenwick_add(pool->tree, index, -pool->weights[index]);
+        pool->weights[index] = 0;
+
+        if (get_wallpaper_info(pool->ctx, id, &result[n]) == 0) {
+            n++;
+        }
+    }
+
+    for (i = 0; i < drawn->len; i++) {
+        weighted_pool_update(pool, g_array_index(drawn, int, i));
+    }
+
+    g_array_free(drawn, TRUE);
+
+    return n;
+}
+
+/**
+  Draw different wallpapers with a lightness near the target for
+  peek_wallpapers().
+
+  Like sample_lightness(), this starts with the window of
+  LIGHTNESS_TOLERANCE around the target of nextwall_use_location(), and
+  widens it until it holds `count` wallpapers or covers all of them. The
+  wallpapers in the window are then drawn in random order, each with the
+  same chance.
+
+  @param[in] ctx The nextwall context.
+  @param[in] range The directories from which to select wallpapers.
+  @param[out] result Will be set to the wallpapers.
+  @param[in] count The number of wallpapers to select.
+  @return Returns the number of wallpapers selected, or -1 on error.
+ */
+int peek_lightness(struct nextwall_ctx *ctx, struct path_range *range,
+        struct wallpaper_info *result, int count) {
+    int rc;
+    int n = -1;
+    int id;
+    guint k, j;
+    double min = 0, max = -1;
+    double target, width, low, high;
+    sqlite3_stmt *stmt;
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof (int));
+
+    if (!(stmt = get_statement(ctx, STMT_LIGHTNESS_RANGE))) {
+        goto Return;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        min = sqlite3_column_double(stmt, 0);
+        max = sqlite3_column_double(stmt, 1);
+    }
+
+    sqlite3_reset(stmt);
+
+    if (max < min) {
+        n = 0;
+        goto Return;
+    }
+
+    if (!(stmt = get_statement(ctx, STMT_LIGHTNESS_IDS))) {
+        goto Return;
+    }
+
+    target = min + get_target_lightness(ctx) * (max - min);
+    width = LIGHTNESS_TOLERANCE * (max - min);
+
+    sqlite3_bind_text(stmt, 3, range->dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, range->lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, range->upper, -1, SQLITE_STATIC);
+
+    do {
+        low = target - width;
+        high = target + width;
+
+        sqlite3_bind_double(stmt, 1, low);
+        sqlite3_bind_double(stmt, 2, high);
+        g_array_set_size(ids, 0);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            id = sqlite3_column_int(stmt, 0);
+            g_array_append_val(ids, id);
+        }
+
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+            goto Return;
+        }
+
+        width *= 2;
+    } while (ids->len < (guint)count && (low > min || high < max));
+
+    // Shuffle the IDs only as far as they are used
+    for (k = 0, n = 0; k < ids->len && n < count; k++) {
+        j = k + random_below(ids->len - k, &ctx->random_state);
+        id = g_array_index(ids, int, j);
+        g_array_index(ids, int, j) = g_array_index(ids, int, k);
+
+        if (get_wallpaper_info(ctx, id, &result[n]) == 0) {
+            n++;
+        }
+    }
+
+    goto Return;
+
+Return:
+    g_array_free(ids, TRUE);
+
+    return n;
+}
+
+/**
+  Look up a wallpaper for peek_wallpapers().
+
+  @param[in] ctx The nextwall context.
+  @param[in] id The ID of the wallpaper.
+  @param[out] info Will be set to the wallpaper.
+  @return Returns 0 on success, -1 if the wallpaper or its file is gone or
+          on error.
+ */
+int get_wallpaper_info(struct nextwall_ctx *ctx, int id,
+        struct wallpaper_info *info) {
+    int rc = -1;
+    sqlite3_stmt *stmt;
+
+    info->id = id;
+
+    if (set_path_from_id(ctx, id, info->path) == -1 ||
+            !is_regular_file(info->path) ||
+            !(stmt = get_statement(ctx, STMT_WALLPAPER_INFO))) {
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        info->lightness = sqlite3_column_double(stmt, 0);
+        info->brightness = sqlite3_column_int(stmt, 1);
+        rc = 0;
+    }
+
+    sqlite3_reset(stmt);
+
+    return rc;
+}
+
+/**
+  Draw the next candidate for select_wallpaper().
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness The brightness value to match, or -1 for any.
+  @param[in] pool The pool to draw from, or NULL for the rotation. Neither
+             is used with nextwall_use_location().
+  @param[out] result_path Will be set to the path of the wallpaper.
+  @return Returns the ID of the wallpaper on success, -1 otherwise.
+ */
+int next_wallpaper(struct nextwall_ctx *ctx, const char *base,
+        int brightness, struct weighted_pool *pool, char *result_path) {
+    int id;
+    int tries;
+
+    if (ctx->located) {
+        if ((id = sample_lightness(ctx, base, get_target_lightness(ctx))) != -1 &&
+                set_path_from_id(ctx, id, result_path) == -1) {
+            id = -1;
+        }
+        return id;
+    }
+
+    if (!pool) {
+        return nextwall(ctx, base, brightness, result_path);
+    }
+
+    // Drop wallpapers that another process has removed from the pool
+    for (tries = 0; tries < SAMPLE_TRIES; tries++) {
+        if ((id = weighted_wallpaper(pool)) == -1 ||
+                set_path_from_id(ctx, id, result_path) == 0) {
+            break;
+        }
+        weighted_pool_update(pool, id);
+        id = -1;
+    }
+
+    return id;
+}
+
+/**
+  Set the directories below a base directory.
+
+  @param[in] base The base directory.
+  @param[out] range The range of directories below `base`.
+  @return Returns 0 on success, -1 on error.
+ */
+int set_path_range(const char *base, struct path_range *range) {
+    char real_base[PATH_MAX];
+
+    /* Make sure the base path is absolute, since only absolute paths are
+       stored in the database. */
+    if (realpath(base, real_base) == NULL) {
+        fprintf(stderr, "realpath() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Select the base directory and the directories below it with a range,
+    // so that the path index can be used.
+    if (get_path_range(real_base, range->lower, range->upper, PATH_MAX) == -1) {
+        fprintf(stderr, "Error: path truncation occurred.\n");
+        return -1;
+    }
+
+    strlcpy(range->dir, range->lower, sizeof range->dir);
+    range->dir[strlen(range->dir) - 1] = '\0';
+
+    return 0;
+}
+
+/**
+  Create a pool for weighted selection.
+
+  The weights of the wallpapers are loaded from the database on the first
+  call of weighted_wallpaper(). Call weighted_pool_update() when the rating
+  or the time shown of a wallpaper changes, or when it is removed. A pool is
+  used under the lock of its context.
+
+  @param[in] ctx The nextwall context.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @return Returns the pool, or NULL if memory allocation failed. Free it with
+          weighted_pool_free().
+ */
+struct weighted_pool *weighted_pool_new(struct nextwall_ctx *ctx, const char *base, int brightness) {
+    struct weighted_pool *pool;
+
+    if ( !(pool = calloc(1, sizeof *pool)) ) {
+        return NULL;
+    }
+
+    if ( !(pool->base = strdup(base)) ) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->ctx = ctx;
+    pool->brightness = brightness;
+
+    return pool;
+}
+
+/**
+  Free a pool for weighted selection.
+
+  @param[in] pool The pool to free, may be NULL.
+ */
+void weighted_pool_free(struct weighted_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    fenwick_free(pool->tree);
+    free(pool->ids);
+    free(pool->weights);
+    free(pool->base);
+    free(pool);
+}
+
+/**
+  Load the weights of the wallpapers of a pool from the database.
+
+  @param[in] pool The pool.
+  @return Returns 0 on success, -1 on error.
+ */
+int load_weights(struct weighted_pool *pool) {
+    int rc;
+    size_t capacity = 0;
+    time_t now = time(NULL);
+    struct path_range range;
+    sqlite3_stmt *stmt;
+
+    if (set_path_range(pool->base, &range) == -1) {
+        return -1;
+    }
+
+    if (!(stmt = get_statement(pool->ctx, STMT_LOAD_WEIGHTS))) {
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, range.dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, range.lower, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, range.upper, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, pool->brightness);
+
+    pool->size = 0;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (pool->size == capacity) {
+            int *ids;
+            double *weights;
+
+            capacity = capacity ? capacity * 2 : 1024;
+
+            if ( !(ids = realloc(pool->ids, capacity * sizeof *ids)) ) {
+                break;
+            }
+            pool->ids = ids;
+
+            if ( !(weights = realloc(pool->weights, capacity * sizeof *weights)) ) {
+                break;
+            }
+            pool->weights = weights;
+        }
+
+        pool->ids[pool->size] = sqlite3_column_int(stmt, 0);
+        pool->weights[pool->size] = get_weight(sqlite3_column_int(stmt, 1),
+                sqlite3_column_int64(stmt, 2), now);
+        pool->size++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        if (rc == SQLITE_ROW) {
+            fprintf(stderr, "Error: out of memory\n");
+        }
+        else {
+            fprintf(stderr, "SQL error while selecting: %s\n",
+                    sqlite3_errmsg(pool->ctx->db));
+        }
+        sqlite3_reset(stmt);
+        return -1;
+    }
+
+    sqlite3_reset(stmt);
+
+    if ( !(pool->tree = fenwick_new(pool->weights, pool->size)) ) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Return the index of a wallpaper in a pool.
+
+  @param[in] pool The pool.
+  @param[in] id The ID of the wallpaper.
+  @return Returns the index, or -1 if the wallpaper is not in the pool.
+ */
+int find_pool_index(struct weighted_pool *pool, int id) {
+    size_t low = 0, high = pool->size, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+
+        if (pool->ids[mid] < id) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    if (low < pool->size && pool->ids[low] == id) {
+        return low;
+    }
+
+    return -1;
+}
+
+/**
+  Return the weight of a wallpaper.
+
+  The weight doubles with each rating step, and drops to RECENCY_MIN when a
+  wallpaper is shown, from which it recovers exponentially over RECENCY_TIME.
+
+  @param[in] rating The rating of the wallpaper.
+  @param[in] shown_at The time the wallpaper was shown, or 0 if never.
+  @param[in] now The current time.
+ */
+double get_weight(int rating, sqlite3_int64 shown_at, time_t now) {
+    double recency = 1;
+
+    if (shown_at > 0) {
+        recency = 1 - exp(-(double)(now - shown_at) / RECENCY_TIME);
+
+        if (recency < RECENCY_MIN) {
+            recency = RECENCY_MIN;
+        }
+    }
+
+    return ldexp(recency, rating);
+}
+
+/**
+  Update the weight of a wallpaper in a pool from the database.
+
+  Sets the weight to 0 if the wallpaper no longer exists. Takes O(log n)
+  time, and does nothing if the weights were not loaded yet.
+
+  @param[in] pool The pool.
+  @param[in] id The ID of the wallpaper.
+  @return Returns 0 on success, -1 on error.
+ */
+int weighted_pool_update(struct weighted_pool *pool, int id) {
+    int rc = SQLITE_DONE;
+    int index;
+    double weight = 0;
+    sqlite3_stmt *stmt;
+
+    g_rec_mutex_lock(&pool->ctx->lock);
+
+    if (!pool->tree || (index = find_pool_index(pool, id)) == -1) {
+        goto Return;
+    }
+
+    if (!(stmt = get_statement(pool->ctx, STMT_GET_WEIGHT))) {
+        rc = SQLITE_ERROR;
+        goto Return;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        weight = get_weight(sqlite3_column_int(stmt, 0),
+                sqlite3_column_int64(stmt, 1), time(NULL));
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n",
+                sqlite3_errmsg(pool->ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) {
+        fenwick_add(pool->tree, index, weight - pool->weights[index]);
+        pool->weights[index] = weight;
+        rc = SQLITE_DONE;
+    }
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&pool->ctx->lock);
+
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+  Draw a random wallpaper ID with a chance proportional to its weight.
+
+  Highly rated wallpapers are selected more often, and wallpapers that were
+  shown recently less often, see get_weight(). The weights are loaded on the
+  first call; after that each draw takes O(log n) time.
+
+  @param[in] pool The pool from which to select the wallpaper.
+  @return Returns the ID of the wallpaper on success, -1 if no wallpaper
+          matches or on error.
+ */
+int weighted_wallpaper(struct weighted_pool *pool) {
+    int i;
+    int id = -1;
+    size_t index;
+    double total;
+    struct nextwall_ctx *ctx = pool->ctx;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!pool->tree && load_weights(pool) == -1) {
+        goto Return;
+    }
+
+    if ((total = fenwick_total(pool->tree)) <= 0) {
+        goto Return;
+    }
+
+    // Rounding errors in the sums may rarely find the end of the tree or a
+    // removed wallpaper; draw again if so.
+    for (i = 0; i < SAMPLE_TRIES && id == -1; i++) {
+        index = fenwick_find(pool->tree, total *
+                random_below(1LL << 53, &ctx->random_state) / (1LL << 53));
+
+        if (index < pool->size && pool->weights[index] > 0) {
+            id = pool->ids[index];
+        }
+    }
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Save the current time as the time a wallpaper was shown.
+
+  @param[in] ctx The nextwall context.
+  @param[in] id The ID of the wallpaper.
+  @return Returns 0 on success, -1 on error.
+ */
+int mark_wallpaper_shown(struct nextwall_ctx *ctx, int id) {
+    int rc = SQLITE_ERROR;
+    sqlite3_stmt *stmt;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if ((stmt = get_statement(ctx, STMT_MARK_SHOWN))) {
+        sqlite3_bind_int64(stmt, 1, time(NULL));
+        sqlite3_bind_int(stmt, 2, id);
+
+        if ((rc = step_retry(stmt)) != SQLITE_DONE) {
+            fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(ctx->db));
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+  Change the rating of a wallpaper.
+
+  The rating is kept between RATING_MIN and RATING_MAX.
+
+  @param[in] ctx The nextwall context.
+  @param[in] id The ID of the wallpaper.
+  @param[in] delta The amount to add to the rating.
+  @param[out] rating Will be set to the new rating.
+  @return Returns 0 on success, -1 on error.
+ */
+int rate_wallpaper(struct nextwall_ctx *ctx, int id, int delta, int *rating) {
+    int rc = SQLITE_ERROR;
+    sqlite3_stmt *stmt;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!(stmt = get_statement(ctx, STMT_RATE))) {
+        goto Return;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_int(stmt, 2, delta);
+    sqlite3_bind_int(stmt, 3, RATING_MIN);
+    sqlite3_bind_int(stmt, 4, RATING_MAX);
+
+    rc = step_retry(stmt);
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(ctx->db));
+        goto Return;
+    }
+
+    if (!(stmt = get_statement(ctx, STMT_GET_WEIGHT))) {
+        rc = SQLITE_ERROR;
+        goto Return;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        *rating = sqlite3_column_int(stmt, 0);
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc == SQLITE_ROW ? 0 : -1;
+}
+
+/**
+  Return the ID of a wallpaper.
+
+  @param[in] ctx The nextwall context.
+  @param[in] path Absolute path of the wallpaper.
+  @return Returns the ID of the wallpaper, or -1 if it is not in the
+          database or on error.
+ */
+int get_wallpaper_id(struct nextwall_ctx *ctx, const char *path) {
+    int id;
+
+    g_rec_mutex_lock(&ctx->lock);
+    id = find_wallpaper(ctx, path);
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+/**
+  Look up the ID of a wallpaper for get_wallpaper_id() and the scans.
+
+  @param[in] ctx The nextwall context.
+  @param[in] path Absolute path of the wallpaper.
+  @return Returns the ID of the wallpaper, or -1 if it is not in the
+          database or on error.
+ */
+int find_wallpaper(struct nextwall_ctx *ctx, const char *path) {
+    int rc;
+    int id = -1;
+    char dir[PATH_MAX];
+    const char *name;
+    sqlite3_stmt *stmt;
+
+    if (split_path(path, dir, sizeof dir, &name) == -1 ||
+            !(stmt = get_statement(ctx, STMT_WALLPAPER_ID))) {
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    return id;
+}
+
+/**
+  Set the wallpaper path from an ID.
+
+  @param[in] ctx The nextwall context.
+  @param[in] id The ID of the wallpaper.
+  @param[out] result_path Will be set to the path of the randomly selected wallpaper.
+  @return 0 on success, -1 otherwise.
+ */
+int set_path_from_id(struct nextwall_ctx *ctx, int id, char *result_path) {
+    int rc;
+    int status = -1;
+    sqlite3_stmt *stmt;
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!(stmt = get_statement(ctx, STMT_PATH_FROM_ID))) {
+        goto Return;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *found_path = sqlite3_column_text(stmt, 0);
+
+        if (strlcpy(result_path, (const char *)found_path, PATH_MAX) >= PATH_MAX) {
+            fprintf(stderr, "Error: path truncation occurred.\n");
+        }
+        else {
+            status = 0;
+        }
+    }
+    else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error while selecting: %s\n", sqlite3_errmsg(ctx->db));
+    }
+
+    sqlite3_reset(stmt);
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return status;
+}
+
+/**
+  Move wallpaper to trash and remove it from the nextwall database.
+
+  @param[in] ctx The nextwall context.
+  @param[in] path Absolute path of the wallpaper.
+  @param[in] trash_file If true, the file is moved to the trash.
+  @return Returns 0 on successful completion, and -1 on error.
+ */
+int remove_wallpaper(struct nextwall_ctx *ctx, char *path, bool trash_file) {
+    if (remove_paths(ctx, &path, 1) == -1) {
+        return -1;
+    }
+
+    if (trash_file && file_trash(path) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Remove wallpapers from the nextwall database by path.
+
+  The wallpapers are removed in a single transaction, which is much faster
+  than one transaction per wallpaper. Paths that are not in the database are
+  ignored. The files are left alone; see removal_queue_add() to move them to
+  the trash as well. The snapshot is left stale, see nextwall_sync_snapshot().
+
+  @param[in] ctx The nextwall context.
+  @param[in] paths The absolute paths of the wallpapers.
+  @param[in] count The number of paths.
+  @return Returns the number of wallpapers removed, or -1 on error.
+ */
+int remove_paths(struct nextwall_ctx *ctx, char **paths, int count) {
+    int i;
+    int removed = 0;
+    int rc = SQLITE_ERROR;
+    char dir[PATH_MAX];
+    const char *name;
+    sqlite3_stmt *stmt;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!(stmt = get_statement(ctx, STMT_REMOVE_PATH))) {
+        goto Return;
+    }
+
+    rc = begin_transaction(ctx);
+
+    for (i = 0; i < count && rc == SQLITE_OK; i++) {
+        if (split_path(paths[i], dir, sizeof dir, &name) == -1) {
+            fprintf(stderr, "Error: Invalid wallpaper path %s\n", paths[i]);
+            continue;
+        }
+
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, dir, -1, SQLITE_STATIC);
+
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            removed += sqlite3_changes(ctx->db);
+        }
+        else {
+            rc = SQLITE_ERROR;
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(ctx->db));
+        sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+        goto Return;
+    }
+
+    if ((rc = commit_transaction(ctx)) != SQLITE_OK) {
+        sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+        goto Return;
+    }
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc == SQLITE_OK ? removed : -1;
+}
+
+/**
+  Remove wallpapers from the nextwall database.
+
+  The wallpapers are removed in a single transaction. The files are left
+  alone, this is meant for wallpapers whose files no longer exist. The
+  snapshot is left stale, see nextwall_sync_snapshot().
+
+  @param[in] ctx The nextwall context.
+  @param[in] ids The IDs of the wallpapers.
+  @param[in] count The number of IDs.
+  @return Returns 0 on successful completion, and -1 on error.
+ */
+int remove_wallpapers(struct nextwall_ctx *ctx, const int *ids, int count) {
+    int i;
+    int rc = SQLITE_ERROR;
+    sqlite3_stmt *stmt;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    g_rec_mutex_lock(&ctx->lock);
+
+    if (!(stmt = get_statement(ctx, STMT_REMOVE_ID))) {
+        goto Return;
+    }
+
+    rc = begin_transaction(ctx);
+
+    for (i = 0; i < count && rc == SQLITE_OK; i++) {
+        sqlite3_bind_int(stmt, 1, ids[i]);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            rc = SQLITE_ERROR;
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(ctx->db));
+        sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+        goto Return;
+    }
+
+    if ((rc = commit_transaction(ctx)) != SQLITE_OK) {
+        sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+        goto Return;
+    }
+
+    goto Return;
+
+Return:
+    g_rec_mutex_unlock(&ctx->lock);
+
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * Return the current width of the terminal.
+ *
+ * @return The width in columns, or a fallback of 80 on error.
+ */
 int get_terminal_width() {
     struct winsize w;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
@@ -517,3 +3392,27 @@ int get_terminal_width() {
     }
     return 80;
 }
+
+/**
+  Collect statistics for subsequent scans.
+
+  When set, scan_dir() and scan_list() add the number of saved images and the
+  time spent in each phase of the scan to `stats`.
+
+  @param[in] ctx The nextwall context.
+  @param[in] stats The statistics to update, or NULL to stop collecting.
+ */
+void scan_set_stats(struct nextwall_ctx *ctx, struct scan_stats *stats) {
+    g_rec_mutex_lock(&ctx->lock);
+    ctx->scan_stats = stats;
+    g_rec_mutex_unlock(&ctx->lock);
+}
+
+/**
+  Return the value of the monotonic clock in seconds.
+ */
+double get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
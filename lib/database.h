@@ -21,21 +21,136 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <limits.h>     /* PATH_MAX */
 #include <stdbool.h>
+#include <stdio.h>
 #include <floatfann.h>
 #include <sqlite3.h>
 
+#include "fenwick.h"
+
 /* The nextwall database version */
-#define NEXTWALL_DB_VERSION 0.5
+#define NEXTWALL_DB_VERSION 1.1
+
+/* Versions that differ by less than this are the same; they are stored as
+   floating point numbers */
+#define VERSION_EPSILON 0.001
+
+/* The number of random IDs sample_wallpaper() tries before it falls back to
+   walking the wallpaper counts */
+#define SAMPLE_TRIES 16
+
+/* With nextwall_use_location(), the altitudes of the sun in degrees at which
+   the darkest and the lightest wallpapers are selected, and how far the
+   lightness of a wallpaper may be from the target, as a fraction of the
+   lightness range of the library */
+#define ELEVATION_DARK -12.0
+#define ELEVATION_LIGHT 30.0
+#define LIGHTNESS_TOLERANCE 0.1
+
+/* The range of wallpaper ratings. Each step up doubles the chance that a
+   wallpaper is selected with weighted_wallpaper(). */
+#define RATING_MIN -3
+#define RATING_MAX 3
+
+/* Seconds after which a shown wallpaper has regained about two thirds of its
+   weight, and the smallest fraction it drops to right after it was shown */
+#define RECENCY_TIME (7 * 24 * 3600)
+#define RECENCY_MIN 0.01
+
+/* Statistics collected while scanning, see scan_set_stats() */
+struct scan_stats {
+    unsigned images;    /* Number of images saved */
+    double sniff;       /* Seconds spent detecting the file type */
+    double decode;      /* Seconds spent reading the image lightness */
+    double classify;    /* Seconds spent running the ANN */
+    double insert;      /* Seconds spent inserting into the database */
+};
+
+/* Milliseconds a statement waits for another connection that holds a lock,
+   and the number of times a write that still finds the database busy is
+   retried */
+#define BUSY_TIMEOUT 5000
+#define BUSY_RETRIES 3
+
+/* A scan saves the images it has analyzed in one transaction when it has
+   SCAN_BATCH of them, or when the first one is SCAN_COMMIT_TIME seconds old */
+#define SCAN_BATCH 64
+#define SCAN_COMMIT_TIME 0.5
+
+/* Maximum number of candidates select_wallpaper() checks at once */
+#define CANDIDATE_BATCH 16
+
+/* A nextwall context, see nextwall_open() */
+struct nextwall_ctx;
+
+/* A wallpaper selected by peek_wallpapers() */
+struct wallpaper_info {
+    int id;
+    char path[PATH_MAX];
+    double lightness;
+    int brightness;
+};
 
-/* The maximum number of wallpapers in the wallpaper list */
-#define LIST_MAX 2000
+/* The weights of the wallpapers below a base directory, see
+   weighted_pool_new() */
+struct weighted_pool {
+    struct nextwall_ctx *ctx; /* The nextwall context */
+    char *base;             /* The base directory */
+    int brightness;         /* The brightness value to match, or -1 for any */
+    size_t size;            /* Number of wallpapers */
+    int *ids;               /* Wallpaper IDs in ascending order */
+    double *weights;        /* Weight of each wallpaper */
+    struct fenwick *tree;   /* Sums of the weights, NULL until loaded */
+};
 
+struct nextwall_ctx *nextwall_open(const char *db_path);
+struct nextwall_ctx *nextwall_open_readonly(const char *db_path);
+void nextwall_close(struct nextwall_ctx *ctx);
+int nextwall_load_ann(struct nextwall_ctx *ctx, const char *ann_path);
+void nextwall_seed(struct nextwall_ctx *ctx, unsigned long long seed);
+int nextwall_use_snapshot(struct nextwall_ctx *ctx, const char *path);
+int nextwall_sync_snapshot(struct nextwall_ctx *ctx);
+void nextwall_use_location(struct nextwall_ctx *ctx, double lat, double lon);
+int nextwall_maintain(struct nextwall_ctx *ctx, FILE *stream);
 int create_database(sqlite3 *db);
-int scan_dir(sqlite3 *db, const char *base, struct fann *ann, int recursive);
-int nextwall(sqlite3 *db, const char *base, int brightness, char *result_path);
-int set_path_from_id(sqlite3 *db, int id, char *result_path);
-int remove_wallpaper(sqlite3 *db, char *path, bool trash_file);
+int update_database(sqlite3 *db);
+int scan_dir(struct nextwall_ctx *ctx, const char *base, int recursive);
+int scan_list(struct nextwall_ctx *ctx, FILE *stream);
+void scan_set_stats(struct nextwall_ctx *ctx, struct scan_stats *stats);
+int nextwall(struct nextwall_ctx *ctx, const char *base, int brightness, char *result_path);
+int rotate_wallpaper(struct nextwall_ctx *ctx, const char *base, int brightness);
+int sample_wallpaper(struct nextwall_ctx *ctx, const char *base, int brightness);
+int sample_lightness(struct nextwall_ctx *ctx, const char *base, double target);
+int select_wallpaper(struct nextwall_ctx *ctx,
+                     const char *base,
+                     int brightness,
+                     struct weighted_pool *pool,
+                     const char *current,
+                     int *id,
+                     char *result_path);
+int peek_wallpaper(struct nextwall_ctx *ctx,
+                   const char *base,
+                   int brightness,
+                   struct weighted_pool *pool,
+                   char *result_path);
+int peek_wallpapers(struct nextwall_ctx *ctx,
+                    const char *base,
+                    int brightness,
+                    struct weighted_pool *pool,
+                    struct wallpaper_info *result,
+                    int count);
+struct weighted_pool *weighted_pool_new(struct nextwall_ctx *ctx, const char *base, int brightness);
+void weighted_pool_free(struct weighted_pool *pool);
+int weighted_pool_update(struct weighted_pool *pool, int id);
+int weighted_wallpaper(struct weighted_pool *pool);
+int mark_wallpaper_shown(struct nextwall_ctx *ctx, int id);
+int rate_wallpaper(struct nextwall_ctx *ctx, int id, int delta, int *rating);
+int get_wallpaper_id(struct nextwall_ctx *ctx, const char *path);
+int set_path_from_id(struct nextwall_ctx *ctx, int id, char *result_path);
+int remove_wallpaper(struct nextwall_ctx *ctx, char *path, bool trash_file);
+int remove_wallpapers(struct nextwall_ctx *ctx, const int *ids, int count);
+int remove_paths(struct nextwall_ctx *ctx, char **paths, int count);
 int get_terminal_width();
 
 #endif
@@ -0,0 +1,158 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "fenwick.h"
+
+/**
+  Create a Fenwick tree.
+
+  The tree is built in O(n) from the initial weights.
+
+  @param[in] weights The initial weights, or NULL for all zero.
+  @param[in] size The number of elements.
+  @return Returns the tree, or NULL if memory allocation failed. Free it with
+          fenwick_free().
+ */
+struct fenwick *fenwick_new(const double *weights, size_t size) {
+    size_t i, parent;
+    struct fenwick *tree;
+
+    if ( !(tree = malloc(sizeof *tree)) ) {
+        return NULL;
+    }
+
+    if ( !(tree->tree = calloc(size + 1, sizeof *tree->tree)) ) {
+        free(tree);
+        return NULL;
+    }
+
+    tree->size = size;
+
+    if (!weights) {
+        return tree;
+    }
+
+    // Each node adds its partial sum to the next node that covers it.
+    for (i = 1; i <= size; i++) {
+        tree->tree[i] += weights[i - 1];
+        parent = i + (i & -i);
+        if (parent <= size) {
+            tree->tree[parent] += tree->tree[i];
+        }
+    }
+
+    return tree;
+}
+
+/**
+  Free a Fenwick tree.
+
+  @param[in] tree The tree to free, may be NULL.
+ */
+void fenwick_free(struct fenwick *tree) {
+    if (tree) {
+        free(tree->tree);
+        free(tree);
+    }
+}
+
+/**
+  Add to the weight of an element.
+
+  @param[in] tree The tree.
+  @param[in] index The index of the element, from 0.
+  @param[in] delta The amount to add to its weight.
+ */
+void fenwick_add(struct fenwick *tree, size_t index, double delta) {
+    size_t i;
+
+    for (i = index + 1; i <= tree->size; i += i & -i) {
+        tree->tree[i] += delta;
+    }
+}
+
+/**
+  Return the sum of the weights of the first elements.
+
+  @param[in] tree The tree.
+  @param[in] count The number of elements to sum.
+ */
+static double prefix_sum(struct fenwick *tree, size_t count) {
+    double sum = 0;
+
+    for (; count > 0; count -= count & -count) {
+        sum += tree->tree[count];
+    }
+
+    return sum;
+}
+
+/**
+  Return the weight of an element.
+
+  @param[in] tree The tree.
+  @param[in] index The index of the element, from 0.
+ */
+double fenwick_get(struct fenwick *tree, size_t index) {
+    return prefix_sum(tree, index + 1) - prefix_sum(tree, index);
+}
+
+/**
+  Return the sum of all weights.
+
+  @param[in] tree The tree.
+ */
+double fenwick_total(struct fenwick *tree) {
+    return prefix_sum(tree, tree->size);
+}
+
+/**
+  Find the element at a cumulative weight.
+
+  Returns the first element for which the sum of the weights up to and
+  including it exceeds `value`. For a `value` drawn uniformly from
+  [0, fenwick_total()), each element is found with a chance proportional to
+  its weight, and elements with weight 0 are never found.
+
+  @param[in] tree The tree.
+  @param[in] value The cumulative weight.
+  @return Returns the index of the element, from 0. Returns the size of the
+          tree if `value` is not below the total weight.
+ */
+size_t fenwick_find(struct fenwick *tree, double value) {
+    size_t pos = 0, step = 1;
+
+    while (step <= tree->size / 2) {
+        step <<= 1;
+    }
+
+    // Descend from the largest power of two, skipping every node whose
+    // partial sum does not exceed the remaining value.
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= tree->size && tree->tree[pos + step] <= value) {
+            pos += step;
+            value -= tree->tree[pos];
+        }
+    }
+
+    return pos;
+}
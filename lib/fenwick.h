@@ -0,0 +1,40 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_FENWICK_H
+#define NEXTWALL_FENWICK_H
+
+#include <stddef.h>
+
+/* A Fenwick tree (binary indexed tree) over non-negative weights. It finds
+   the element at a cumulative weight and updates a weight in O(log n). */
+struct fenwick {
+    size_t size;    /* Number of elements */
+    double *tree;   /* Partial sums, indexed from 1 */
+};
+
+struct fenwick *fenwick_new(const double *weights, size_t size);
+void fenwick_free(struct fenwick *tree);
+void fenwick_add(struct fenwick *tree, size_t index, double delta);
+double fenwick_get(struct fenwick *tree, size_t index);
+double fenwick_total(struct fenwick *tree);
+size_t fenwick_find(struct fenwick *tree, double value);
+
+#endif
@@ -22,62 +22,268 @@
 #include <stdio.h>
 #include <bsd/string.h> /* strlcpy */
 
+#include "cache.h"      /* cache_source */
 #include "gnome.h"
 
+/* The key of the background in the desktop background schema */
+#define PICTURE_KEY "picture-uri-dark"
+
+/* Function prototypes */
+static int to_uri(const char *path, char *uri);
+static gboolean write_background(gpointer data);
+static void on_background_changed(GSettings *settings, gchar *key, gpointer data);
+
 /**
   Set the desktop background.
 
+  This waits until the background is written to disk, so use it when
+  nextwall exits right after. Otherwise request_background() does not
+  block.
+
   @param[in] settings GSettings object with desktop background schema.
   @param[in] path The wallpaper path to set.
   @return Returns 0 on success, -1 on failure.
  */
 int set_background_uri(GSettings *settings, const char *path) {
+    int rc = -1;
     char normalized_path[PATH_MAX];
-    static char picture_param[] = "picture-uri-dark";
+    char *value;
+
+    if (to_uri(path, normalized_path) == -1 ||
+            !g_settings_set(settings, PICTURE_KEY, "s", normalized_path)) {
+        return -1;
+    }
+
+    g_settings_sync(); // Make sure the changes are written to disk
+
+    value = g_settings_get_string(settings, PICTURE_KEY);
+
+    if (strcmp(value, normalized_path) == 0) {
+        rc = 0;
+    }
+
+    g_free(value);
+
+    return rc;
+}
+
+/**
+  Get the current desktop background.
+
+  If the background is a copy from the wallpaper cache, this is the path of
+  the wallpaper it was made from.
+
+  @param[in] settings GSettings object with desktop background schema.
+  @param[out] dest Is set to the URI of the current desktop background.
+ */
+int get_background_uri(GSettings *settings, char *dest) {
+    int rc = 0;
+    char *uri;
+
+    uri = g_settings_get_string(settings, PICTURE_KEY);
+
+    // Strip off the "file://" part of the URI.
+    if (strlen(uri) < 7 || strlcpy(dest, uri + 7, PATH_MAX) >= PATH_MAX) {
+        rc = -1;
+    }
+    else {
+        cache_source(dest, dest, PATH_MAX);
+    }
+
+    g_free(uri);
+
+    return rc;
+}
+
+/**
+  Create a writer that sets the desktop background without blocking.
+
+  The writer needs a running main loop; see request_background().
+
+  @param[in] settings GSettings object with desktop background schema. It
+             must outlive the writer.
+  @return Returns the writer. Free it with background_writer_free().
+ */
+struct background_writer *background_writer_new(GSettings *settings) {
+    struct background_writer *writer = g_new0(struct background_writer, 1);
+
+    writer->settings = settings;
+    writer->handler = g_signal_connect(settings, "changed::" PICTURE_KEY,
+            G_CALLBACK(on_background_changed), writer);
+
+    return writer;
+}
+
+/**
+  Free a background writer.
 
+  A background that was requested but not written yet is dropped; use
+  flush_background() first to keep it.
+
+  @param[in] writer The writer, may be NULL.
+ */
+void background_writer_free(struct background_writer *writer) {
+    if (!writer) {
+        return;
+    }
+
+    if (writer->source) {
+        g_source_remove(writer->source);
+    }
+
+    g_signal_handler_disconnect(writer->settings, writer->handler);
+    g_free(writer);
+}
+
+/**
+  Request to set the desktop background.
+
+  The background is written from the main loop once it is idle, so a burst
+  of requests, such as holding the key for the next wallpaper, only writes
+  the last one. While a write is not confirmed by the changed signal of the
+  settings, requests wait for it, for up to BACKGROUND_WRITE_TIMEOUT
+  milliseconds.
+
+  @param[in] writer The background writer.
+  @param[in] path The wallpaper path to set.
+  @return Returns 0 on success, -1 if the path is too long.
+ */
+int request_background(struct background_writer *writer, const char *path) {
+    if (to_uri(path, writer->requested) == -1) {
+        writer->requested[0] = '\0';
+        return -1;
+    }
+
+    if (!writer->source && !writer->written[0]) {
+        writer->source = g_idle_add(write_background, writer);
+    }
+
+    return 0;
+}
+
+/**
+  Get the desktop background, including one that was requested but not
+  written yet.
+
+  @param[in] writer The background writer.
+  @param[out] dest Is set to the path of the background, as with
+              get_background_uri().
+  @return Returns 0 on success, -1 on failure.
+ */
+int get_requested_background(struct background_writer *writer, char *dest) {
+    if (!writer->requested[0]) {
+        return get_background_uri(writer->settings, dest);
+    }
+
+    strlcpy(dest, writer->requested + 7, PATH_MAX);
+    cache_source(dest, dest, PATH_MAX);
+
+    return 0;
+}
+
+/**
+  Write the requested background now and wait until it is on disk.
+
+  @param[in] writer The background writer.
+  @return Returns 0 on success, -1 on failure.
+ */
+int flush_background(struct background_writer *writer) {
+    int rc = 0;
+
+    if (writer->source) {
+        g_source_remove(writer->source);
+        writer->source = 0;
+    }
+
+    if (writer->requested[0]) {
+        rc = set_background_uri(writer->settings, writer->requested);
+    }
+
+    writer->requested[0] = writer->written[0] = '\0';
+
+    return rc;
+}
+
+/**
+  Turn a path into a file URI.
+
+  @param[in] path The path, or a URI that is copied as is.
+  @param[out] uri Is set to the URI, and must be PATH_MAX bytes.
+  @return Returns 0 on success, -1 if the URI is too long.
+ */
+int to_uri(const char *path, char *uri) {
     if (strstr(path, "file://") == NULL) {
-        if (snprintf(normalized_path,
+        if (snprintf(uri,
                      PATH_MAX,
                      "file://%s", path) >= PATH_MAX) {
             return -1;
         }
     }
     else {
-        if (strlcpy(normalized_path,
+        if (strlcpy(uri,
                     path,
                     PATH_MAX) >= PATH_MAX) {
             return -1;
         }
     }
 
-    g_assert(g_settings_set(settings, picture_param, "s", normalized_path));
-    g_settings_sync(); // Make sure the changes are written to disk
+    return 0;
+}
+
+/* Write the requested background if it is not set already. This is also
+   the timeout for the confirmation of the previous write. */
+gboolean write_background(gpointer data) {
+    struct background_writer *writer = data;
+    char *value;
+
+    writer->source = 0;
+    writer->written[0] = '\0';
+
+    value = g_settings_get_string(writer->settings, PICTURE_KEY);
 
-    if (strcmp(g_settings_get_string(settings, picture_param), normalized_path) == 0) {
-        return 0;
+    if (strcmp(value, writer->requested) == 0) {
+        writer->requested[0] = '\0';
+    }
+    else if (writer->requested[0]) {
+        // The changed signal may be emitted from within g_settings_set()
+        strlcpy(writer->written, writer->requested, sizeof writer->written);
+        writer->source = g_timeout_add(BACKGROUND_WRITE_TIMEOUT,
+                write_background, writer);
+
+        if (!g_settings_set(writer->settings, PICTURE_KEY, "s", writer->requested)) {
+            fprintf(stderr, "Error: failed to set the background.\n");
+            writer->requested[0] = '\0';
+        }
     }
 
-    return -1;
+    g_free(value);
+
+    return G_SOURCE_REMOVE;
 }
 
-/**
-  Get the current desktop background.
+/* Confirm a write of the background, and write the background that was
+   requested in the meantime */
+void on_background_changed(GSettings *settings, gchar *key, gpointer data) {
+    struct background_writer *writer = data;
+    char *value = g_settings_get_string(settings, PICTURE_KEY);
 
-  @param[in] settings GSettings object with desktop background schema.
-  @param[out] dest Is set to the URI of the current desktop background.
- */
-int get_background_uri(GSettings *settings, char *dest) {
-    const char *uri;
-    static char picture_param[] = "picture-uri-dark";
+    if (writer->written[0] && strcmp(value, writer->written) == 0) {
+        writer->written[0] = '\0';
 
-    uri = g_variant_get_string(g_settings_get_value(settings, picture_param), NULL);
+        if (writer->source) {
+            g_source_remove(writer->source);
+            writer->source = 0;
+        }
 
-    // Strip off the "file://" part of the URI.
-    if (strlcpy(dest, uri + 7, PATH_MAX) >= PATH_MAX) {
-        return -1;
+        if (strcmp(value, writer->requested) == 0) {
+            writer->requested[0] = '\0';
+        }
+        else if (writer->requested[0]) {
+            writer->source = g_idle_add(write_background, writer);
+        }
     }
 
-    return 0;
+    g_free(value);
 }
 
 /**
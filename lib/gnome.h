@@ -22,10 +22,30 @@
 #define NEXTWALL_GNOME_H
 
 #include <gio/gio.h>
+#include <limits.h>     /* PATH_MAX */
+
+/* How long a background writer waits for a write to be confirmed before it
+   writes the next background anyway, in milliseconds */
+#define BACKGROUND_WRITE_TIMEOUT 1000
+
+/* Sets the desktop background from the main loop, see request_background() */
+struct background_writer {
+    GSettings *settings;
+    char requested[PATH_MAX];   /* The URI to set, or empty */
+    char written[PATH_MAX];     /* The URI of the write that is not
+                                   confirmed yet, or empty */
+    guint source;               /* The source of the next write, or 0 */
+    gulong handler;             /* The handler of the changed signal */
+};
 
 /* Function prototypes */
 int set_background_uri(GSettings *settings, const char *path);
 int get_background_uri(GSettings *settings, char *dest);
+struct background_writer *background_writer_new(GSettings *settings);
+void background_writer_free(struct background_writer *writer);
+int request_background(struct background_writer *writer, const char *path);
+int get_requested_background(struct background_writer *writer, char *dest);
+int flush_background(struct background_writer *writer);
 int open_image(char *path);
 int file_trash(char *path);
 
@@ -19,9 +19,18 @@
  */
 
 #include <MagickWand/MagickWand.h>
+#include <glib.h>       /* GMutex */
+#include <limits.h>     /* PATH_MAX */
+#include <stdio.h>      /* snprintf */
 
 #include "image.h"
 
+/* Held while ImageMagick is used. MagickWandTerminus() tears down what
+   other threads may still be using, so only one thread at a time can use
+   it, e.g. the scan and the preparation of the next wallpaper in the
+   daemon. */
+static GMutex magick_lock;
+
 /**
   Returns the lightness value for an image file.
 
@@ -30,11 +39,13 @@
   @return Retuns 0 on success, -1 on failure.
  */
 int get_image_info(const char *path, double *lightness) {
+    int rc = -1;
     MagickBooleanType status;
     MagickWand *magick_wand;
     PixelWand *pixel_wand;
     double hue, saturation;
 
+    g_mutex_lock(&magick_lock);
     MagickWandGenesis();
     magick_wand = NewMagickWand();
     pixel_wand = NewPixelWand();
@@ -42,7 +53,7 @@ int get_image_info(const char *path, double *lightness) {
     // Read the image
     status = MagickReadImage(magick_wand, path);
     if (status == MagickFalse)
-        return -1;
+        goto Return;
 
     // Resize the image to 1x1 pixel (results in average color)
     MagickResizeImage(magick_wand, 1, 1, LanczosFilter);
@@ -50,16 +61,98 @@ int get_image_info(const char *path, double *lightness) {
     // Get pixel color
     status = MagickGetImagePixelColor(magick_wand, 0, 0, pixel_wand);
     if (status == MagickFalse) {
-        return -1;
+        goto Return;
     }
 
     // Get the lightness value
     PixelGetHSL(pixel_wand, &hue, &saturation, lightness);
+    rc = 0;
+
+    goto Return;
 
+Return:
     pixel_wand = DestroyPixelWand(pixel_wand);
     magick_wand = DestroyMagickWand(magick_wand);
     MagickWandTerminus();
+    g_mutex_unlock(&magick_lock);
 
-    return 0;
+    return rc;
 }
 
+/**
+  Write a copy of an image file scaled to cover a screen.
+
+  The copy is scaled down, keeping its aspect ratio, until it is just large
+  enough to cover `width` x `height`, and written as a JPEG without any
+  metadata. Images that are not larger than that are not copied.
+
+  @param[in] path Absolute path of the image file.
+  @param[in] dest The path of the copy.
+  @param[in] width The width of the screen.
+  @param[in] height The height of the screen.
+  @return Retuns 1 if the copy was written, 0 if the image is small enough
+          already, or -1 on failure.
+ */
+int scale_image(const char *path, const char *dest, int width, int height) {
+    int rc = -1;
+    char size_hint[32];
+    char target[PATH_MAX + 8];
+    double scale;
+    size_t image_width, image_height;
+    MagickWand *magick_wand;
+
+    g_mutex_lock(&magick_lock);
+    MagickWandGenesis();
+    magick_wand = NewMagickWand();
+
+    // Only read the size first, which is cheap
+    if (MagickPingImage(magick_wand, path) == MagickFalse)
+        goto Return;
+
+    image_width = MagickGetImageWidth(magick_wand);
+    image_height = MagickGetImageHeight(magick_wand);
+    scale = (double)width / image_width > (double)height / image_height ?
+        (double)width / image_width : (double)height / image_height;
+
+    if (scale >= 1.0) {
+        rc = 0;
+        goto Return;
+    }
+
+    width = image_width * scale + 0.5;
+    height = image_height * scale + 0.5;
+
+    // Let the JPEG decoder skip the detail we don't need
+    ClearMagickWand(magick_wand);
+    snprintf(size_hint, sizeof size_hint, "%dx%d", width, height);
+    MagickSetOption(magick_wand, "jpeg:size", size_hint);
+
+    if (MagickReadImage(magick_wand, path) == MagickFalse)
+        goto Return;
+
+    MagickResetIterator(magick_wand);
+    MagickNextImage(magick_wand);
+
+    if (MagickResizeImage(magick_wand, width, height, LanczosFilter) == MagickFalse)
+        goto Return;
+
+    MagickSetImageAlphaChannel(magick_wand, RemoveAlphaChannel);
+    MagickStripImage(magick_wand);
+    MagickSetImageCompressionQuality(magick_wand, SCALE_QUALITY);
+
+    // Name the format, as the extension of `dest` may not tell it
+    if (snprintf(target, sizeof target, "JPEG:%s", dest) >= (int)sizeof target ||
+            MagickWriteImage(magick_wand, target) == MagickFalse)
+        goto Return;
+
+    rc = 1;
+
+    goto Return;
+
+Return:
+    magick_wand = DestroyMagickWand(magick_wand);
+    MagickWandTerminus();
+    g_mutex_unlock(&magick_lock);
+
+    return rc;
+}
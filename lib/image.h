@@ -21,7 +21,11 @@
 #ifndef NEXTWALL_IMAGE_H
 #define NEXTWALL_IMAGE_H
 
+/* The JPEG quality of the copies that scale_image() writes */
+#define SCALE_QUALITY 90
+
 /* Function prototypes */
 int get_image_info(const char *path, double *lightness);
+int scale_image(const char *path, const char *dest, int width, int height);
 
 #endif
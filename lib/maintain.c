@@ -0,0 +1,364 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>     /* strcmp */
+
+#include "maintain.h"
+
+/* Statements that remove rows that nothing refers to anymore: wallpapers in
+   unknown directories, directories without wallpapers, counts of nothing,
+   and rotations of base directories that no longer contain any directory.
+   Triggers keep the counts and the generation right. */
+static const char *orphan_queries[] = {
+    "DELETE FROM wallpapers " \
+        "WHERE dir_id NOT IN (SELECT id FROM directories);",
+    "DELETE FROM directories " \
+        "WHERE id NOT IN (SELECT dir_id FROM wallpapers);",
+    "DELETE FROM wallpaper_counts WHERE count <= 0 " \
+        "OR dir_id NOT IN (SELECT id FROM directories);",
+    "DELETE FROM rotations WHERE NOT EXISTS (" \
+        "SELECT 1 FROM directories d WHERE d.path = rotations.base OR " \
+        "(d.path >= rotations.base || '/' AND d.path < rotations.base || '0'));",
+    NULL
+};
+
+/* Function prototypes */
+static int check_integrity(sqlite3 *db);
+static int remove_orphans(sqlite3 *db);
+static int vacuum(sqlite3 *db);
+static sqlite3_int64 get_pragma(sqlite3 *db, const char *query);
+
+/**
+  Maintain a nextwall database.
+
+  Checks the integrity of the database, removes orphan rows, updates the
+  statistics of the query planner, and returns free pages to the file
+  system. A database that was created without incremental vacuum is
+  converted once with a full VACUUM. The progress is printed on stderr.
+
+  Each step is a short transaction that waits for other processes with the
+  busy timeout of the connection, so this is safe to run while nextwall is
+  in use. Nothing is changed if the integrity check fails.
+
+  @param[in] db The database handler.
+  @return Returns 0 on success, -1 on failure.
+ */
+int maintain_database(sqlite3 *db) {
+    int rc;
+
+    fprintf(stderr, "Checking integrity... ");
+    if (check_integrity(db) != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Removing orphans... ");
+    if ((rc = remove_orphans(db)) == -1) {
+        return -1;
+    }
+    fprintf(stderr, "%d removed\n", rc);
+
+    fprintf(stderr, "Analyzing... ");
+    if (sqlite3_exec(db, "ANALYZE; PRAGMA optimize;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    fprintf(stderr, "Done\n");
+
+    fprintf(stderr, "Vacuuming... ");
+    if ((rc = vacuum(db)) == -1) {
+        return -1;
+    }
+    fprintf(stderr, "%d pages freed\n", rc);
+
+    // Move the WAL into the database and truncate it. This does not wait for
+    // readers, so it may leave part of the WAL for a later checkpoint.
+    sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, NULL, NULL);
+
+    return 0;
+}
+
+/**
+  Check the integrity of a database and print the problems on stderr.
+
+  @param[in] db The database handler.
+  @return Returns 0 if the database is fine, -1 otherwise.
+ */
+int check_integrity(sqlite3 *db) {
+    int rc;
+    int errors = 0;
+    char query[64];
+    const char *message;
+    sqlite3_stmt *stmt;
+
+    snprintf(query, sizeof query, "PRAGMA integrity_check(%d);",
+            INTEGRITY_MAX_ERRORS);
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        message = (const char *)sqlite3_column_text(stmt, 0);
+
+        if (message && strcmp(message, "ok") == 0) {
+            continue;
+        }
+
+        if (errors++ == 0) {
+            fprintf(stderr, "Failed\n");
+        }
+        fprintf(stderr, "  %s\n", message ? message : "(unknown)");
+    }
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        errors++;
+    }
+    else if (errors == 0) {
+        fprintf(stderr, "OK\n");
+    }
+    else {
+        fprintf(stderr, "The database is damaged. Remove it and scan your " \
+                "wallpapers again.\n");
+    }
+
+    sqlite3_finalize(stmt);
+
+    return errors == 0 ? 0 : -1;
+}
+
+/**
+  Remove the orphan rows of a database in one transaction.
+
+  @param[in] db The database handler.
+  @return Returns the number of removed rows, or -1 on failure.
+ */
+int remove_orphans(sqlite3 *db) {
+    int i;
+    int removed = 0;
+    int rc;
+
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+
+    for (i = 0; orphan_queries[i] && rc == SQLITE_OK; i++) {
+        if ((rc = sqlite3_exec(db, orphan_queries[i], NULL, NULL, NULL)) == SQLITE_OK) {
+            removed += sqlite3_changes(db);
+        }
+    }
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+
+    return removed;
+}
+
+/**
+  Return the free pages of a database to the file system.
+
+  Uses incremental vacuum, which only moves the pages at the end of the
+  file. A database without it is switched to it with a full VACUUM, which
+  rewrites the whole database once.
+
+  @param[in] db The database handler.
+  @return Returns the number of pages freed, or -1 on failure.
+ */
+int vacuum(sqlite3 *db) {
+    int rc;
+    sqlite3_int64 free_pages;
+
+    free_pages = get_pragma(db, "PRAGMA freelist_count;");
+
+    // auto_vacuum is 2 for incremental
+    if (get_pragma(db, "PRAGMA auto_vacuum;") == 2) {
+        rc = sqlite3_exec(db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
+    }
+    else {
+        fprintf(stderr, "switching to incremental vacuum... ");
+        rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;",
+                NULL, NULL, NULL);
+    }
+
+    if (rc != SQLITE_OK || free_pages == -1) {
+        fprintf(stderr, "Failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    // Both leave no free pages, but the full VACUUM also adds the pages that
+    // incremental vacuum needs, so the page count says less.
+    return free_pages - get_pragma(db, "PRAGMA freelist_count;");
+}
+
+/**
+  Print statistics of a nextwall database.
+
+  Prints the number of wallpapers per brightness and per directory, the
+  number of pages and free pages, and the size of each table and index.
+  The sizes need the `dbstat` table of SQLite, and are left out if it is
+  not available.
+
+  @param[in] db The database handler.
+  @param[in] stream The stream to print to.
+  @return Returns 0 on success, -1 on failure.
+ */
+int print_database_stats(sqlite3 *db, FILE *stream) {
+    int rc;
+    int status = -1;
+    sqlite3_int64 page_size, total = 0;
+    sqlite3_stmt *stmt = NULL;
+    static const char *names[] = {"night", "twilight", "day"};
+
+    // Wallpapers per brightness
+    if (sqlite3_prepare_v2(db,
+                "SELECT brightness, SUM(count) FROM wallpaper_counts " \
+                "GROUP BY brightness ORDER BY brightness;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        goto Return;
+    }
+
+    fprintf(stream, "Wallpapers per brightness:\n");
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int brightness = sqlite3_column_int(stmt, 0);
+        sqlite3_int64 count = sqlite3_column_int64(stmt, 1);
+
+        fprintf(stream, "  %-10s %8lld\n",
+                brightness >= 0 && brightness <= 2 ? names[brightness] : "unknown",
+                (long long)count);
+        total += count;
+    }
+
+    fprintf(stream, "  %-10s %8lld\n\n", "total", (long long)total);
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (rc != SQLITE_DONE) {
+        goto Return;
+    }
+
+    // Wallpapers per directory and brightness
+    if (sqlite3_prepare_v2(db,
+                "SELECT d.path, " \
+                "SUM(CASE WHEN c.brightness = 0 THEN c.count ELSE 0 END), " \
+                "SUM(CASE WHEN c.brightness = 1 THEN c.count ELSE 0 END), " \
+                "SUM(CASE WHEN c.brightness = 2 THEN c.count ELSE 0 END) " \
+                "FROM directories d JOIN wallpaper_counts c ON c.dir_id = d.id " \
+                "GROUP BY d.id ORDER BY d.path;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        goto Return;
+    }
+
+    fprintf(stream, "Wallpapers per directory:\n");
+    fprintf(stream, "  %8s %8s %8s  %s\n", "night", "twilight", "day", "directory");
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        fprintf(stream, "  %8lld %8lld %8lld  %s\n",
+                (long long)sqlite3_column_int64(stmt, 1),
+                (long long)sqlite3_column_int64(stmt, 2),
+                (long long)sqlite3_column_int64(stmt, 3),
+                (const char *)sqlite3_column_text(stmt, 0));
+    }
+
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (rc != SQLITE_DONE) {
+        goto Return;
+    }
+
+    // Pages
+    page_size = get_pragma(db, "PRAGMA page_size;");
+
+    fprintf(stream, "\nPage size:  %8lld bytes\n", (long long)page_size);
+    fprintf(stream, "Pages:      %8lld\n",
+            (long long)get_pragma(db, "PRAGMA page_count;"));
+    fprintf(stream, "Free pages: %8lld\n",
+            (long long)get_pragma(db, "PRAGMA freelist_count;"));
+
+    // Tables and indexes
+    if (sqlite3_prepare_v2(db,
+                "SELECT s.name, m.type, COUNT(*), SUM(s.pgsize) " \
+                "FROM dbstat s JOIN sqlite_master m ON m.name = s.name " \
+                "GROUP BY s.name ORDER BY SUM(s.pgsize) DESC, s.name;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stream, "\nTable and index sizes are not available.\n");
+        status = 0;
+        goto Return;
+    }
+
+    fprintf(stream, "\n  %-40s %-6s %8s %10s\n", "name", "type", "pages", "bytes");
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        fprintf(stream, "  %-40s %-6s %8lld %10lld\n",
+                (const char *)sqlite3_column_text(stmt, 0),
+                (const char *)sqlite3_column_text(stmt, 1),
+                (long long)sqlite3_column_int64(stmt, 2),
+                (long long)sqlite3_column_int64(stmt, 3));
+    }
+
+    if (rc != SQLITE_DONE) {
+        goto Return;
+    }
+
+    status = 0;
+
+    goto Return;
+
+Return:
+    if (status == -1) {
+        fprintf(stderr, "Failed to read the statistics: %s\n", sqlite3_errmsg(db));
+    }
+
+    sqlite3_finalize(stmt);
+
+    return status;
+}
+
+/**
+  Return the integer result of a PRAGMA query.
+
+  @param[in] db The database handler.
+  @param[in] query The query.
+  @return Returns the value, or -1 on error.
+ */
+sqlite3_int64 get_pragma(sqlite3 *db, const char *query) {
+    sqlite3_int64 value = -1;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+
+    return value;
+}
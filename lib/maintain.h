@@ -0,0 +1,34 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NEXTWALL_MAINTAIN_H
+#define NEXTWALL_MAINTAIN_H
+
+#include <stdio.h>
+#include <sqlite3.h>
+
+/* Maximum number of problems the integrity check reports */
+#define INTEGRITY_MAX_ERRORS 100
+
+int maintain_database(sqlite3 *db);
+int print_database_stats(sqlite3 *db, FILE *stream);
+
+#endif
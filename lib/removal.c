@@ -0,0 +1,274 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     /* getdelim */
+
+#include <bsd/string.h> /* strlcpy */
+#include <errno.h>
+#include <gio/gio.h>
+#include <limits.h>     /* PATH_MAX */
+#include <stdlib.h>     /* realpath */
+#include <string.h>
+
+#include "removal.h"
+
+/* Function prototypes */
+static void start_trash(struct removal_queue *queue);
+static void on_trashed(GObject *source, GAsyncResult *result, gpointer data);
+
+/**
+  Create a removal queue.
+
+  @param[in] ctx The nextwall context.
+  @param[in] trash_files If true, the files of the removed wallpapers are
+             moved to the trash.
+  @return Returns the queue. Free it with removal_queue_free().
+ */
+struct removal_queue *removal_queue_new(struct nextwall_ctx *ctx,
+        bool trash_files) {
+    struct removal_queue *queue = g_new0(struct removal_queue, 1);
+
+    queue->ctx = ctx;
+    queue->trash_files = trash_files;
+    queue->batch = g_ptr_array_new_with_free_func(g_free);
+    queue->failures = g_ptr_array_new_with_free_func(g_free);
+    g_queue_init(&queue->trash);
+
+    return queue;
+}
+
+/**
+  Free a removal queue.
+
+  The paths that were added are removed first, and the files that are being
+  moved to the trash are waited for. Failures that were not reported yet are
+  dropped.
+
+  @param[in] queue The queue, may be NULL.
+ */
+void removal_queue_free(struct removal_queue *queue) {
+    if (!queue) {
+        return;
+    }
+
+    removal_queue_flush(queue);
+    removal_queue_wait(queue);
+
+    g_ptr_array_free(queue->batch, TRUE);
+    g_ptr_array_free(queue->failures, TRUE);
+    g_free(queue);
+}
+
+/**
+  Add a wallpaper to the removal queue.
+
+  The wallpaper is removed from the database with the next flush, which
+  happens when REMOVAL_BATCH paths were added or on removal_queue_flush().
+  After that, its file is moved to the trash in the background.
+
+  @param[in] queue The queue.
+  @param[in] path The absolute path of the wallpaper.
+  @return Returns 0 on success, -1 if a flush failed.
+ */
+int removal_queue_add(struct removal_queue *queue, const char *path) {
+    g_ptr_array_add(queue->batch, g_strdup(path));
+
+    if (queue->batch->len >= REMOVAL_BATCH) {
+        return removal_queue_flush(queue);
+    }
+
+    return 0;
+}
+
+/**
+  Remove the wallpapers that were added from the database.
+
+  The wallpapers are removed in one transaction; see remove_paths(). Then the
+  files are queued to be moved to the trash, which runs in the default main
+  context. The paths are dropped if the transaction fails, and their files
+  are left alone.
+
+  @param[in] queue The queue.
+  @return Returns 0 on success, -1 on error.
+ */
+int removal_queue_flush(struct removal_queue *queue) {
+    guint i;
+    int removed;
+
+    removed = remove_paths(queue->ctx, (char **)queue->batch->pdata,
+            queue->batch->len);
+
+    if (removed != -1) {
+        queue->removed += removed;
+
+        for (i = 0; i < queue->batch->len && queue->trash_files; i++) {
+            g_queue_push_tail(&queue->trash, g_strdup(queue->batch->pdata[i]));
+        }
+    }
+
+    g_ptr_array_set_size(queue->batch, 0);
+    start_trash(queue);
+
+    return removed == -1 ? -1 : 0;
+}
+
+/**
+  Wait until all queued files are moved to the trash.
+
+  Runs the default main context, so don't call this from a callback that is
+  dispatched by it.
+
+  @param[in] queue The queue.
+ */
+void removal_queue_wait(struct removal_queue *queue) {
+    while (queue->trashing > 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+/**
+  Report the files that could not be moved to the trash so far.
+
+  Each failure is reported once.
+
+  @param[in] queue The queue.
+  @param[in] stream The stream to print the failures to.
+  @return Returns the number of failures that were reported.
+ */
+int removal_queue_report(struct removal_queue *queue, FILE *stream) {
+    guint i;
+    int count = queue->failures->len;
+
+    for (i = 0; i < queue->failures->len; i++) {
+        fprintf(stream, "Error: %s\n", (char *)queue->failures->pdata[i]);
+    }
+
+    g_ptr_array_set_size(queue->failures, 0);
+
+    return count;
+}
+
+/**
+  Remove the wallpapers in a list of files.
+
+  Reads NUL-delimited file paths from `stream` (e.g. the output of
+  `find -print0`) and adds each one to the removal queue; see
+  removal_queue_add(). Paths are resolved with realpath(), which fails for
+  a file that is gone already or on a drive that is not mounted; such a
+  path is only made absolute, so that its wallpaper is still removed. The
+  queue is flushed at the end.
+
+  @param[in] queue The queue.
+  @param[in] stream The stream to read the NUL-delimited paths from.
+  @return Returns the number of paths that were added, or -1 on error.
+ */
+int remove_list(struct removal_queue *queue, FILE *stream) {
+    int count = 0;
+    int rc = 0;
+    bool fits;
+    char *entry = NULL;
+    char *absolute;
+    char path[PATH_MAX];
+    size_t entry_size = 0;
+
+    while (rc == 0 && getdelim(&entry, &entry_size, '\0', stream) != -1) {
+        // Ignore empty entries, such as a trailing delimiter.
+        if (*entry == '\0') {
+            continue;
+        }
+
+        if (realpath(entry, path) == NULL) {
+            absolute = g_canonicalize_filename(entry, NULL);
+            fits = strlcpy(path, absolute, sizeof path) < sizeof path;
+            g_free(absolute);
+
+            if (!fits) {
+                fprintf(stderr, "Error: %s: The path is too long\n", entry);
+                continue;
+            }
+        }
+
+        rc = removal_queue_add(queue, path);
+        count++;
+    }
+
+    if (ferror(stream)) {
+        fprintf(stderr, "Error: Failed to read the file list: %s\n",
+                strerror(errno));
+        rc = -1;
+    }
+
+    free(entry);
+
+    if (removal_queue_flush(queue) == -1) {
+        rc = -1;
+    }
+
+    return rc == 0 ? count : -1;
+}
+
+/**
+  Start moving queued files to the trash.
+
+  At most REMOVAL_TRASH_MAX files are moved at the same time, so that a long
+  list doesn't start thousands of operations at once.
+
+  @param[in] queue The queue.
+ */
+void start_trash(struct removal_queue *queue) {
+    char *path;
+    GFile *file;
+
+    while (queue->trashing < REMOVAL_TRASH_MAX &&
+            (path = g_queue_pop_head(&queue->trash))) {
+        file = g_file_new_for_path(path);
+        g_file_trash_async(file, G_PRIORITY_DEFAULT, NULL, on_trashed, queue);
+        queue->trashing++;
+
+        g_object_unref(file);
+        g_free(path);
+    }
+}
+
+/* Count a file that was moved to the trash, or keep the failure to report
+   it later, and start moving the next file */
+void on_trashed(GObject *source, GAsyncResult *result, gpointer data) {
+    struct removal_queue *queue = data;
+    GError *error = NULL;
+    char *path;
+
+    if (g_file_trash_finish(G_FILE(source), result, &error)) {
+        queue->trashed++;
+    }
+    else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        // The file was gone already, see remove_list()
+        g_error_free(error);
+    }
+    else {
+        path = g_file_get_path(G_FILE(source));
+        g_ptr_array_add(queue->failures,
+                g_strdup_printf("%s: %s", path, error->message));
+        g_free(path);
+        g_error_free(error);
+    }
+
+    queue->trashing--;
+    start_trash(queue);
+}
@@ -0,0 +1,59 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_REMOVAL_H
+#define NEXTWALL_REMOVAL_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "database.h"
+
+/* The number of wallpapers removed from the database in one transaction */
+#define REMOVAL_BATCH 256
+
+/* The number of files that are moved to the trash at the same time */
+#define REMOVAL_TRASH_MAX 8
+
+/* Removes wallpapers from the database in batches, and moves their files to
+   the trash in the background, see removal_queue_add() */
+struct removal_queue {
+    struct nextwall_ctx *ctx;
+    bool trash_files;       /* Whether the files are moved to the trash */
+    GPtrArray *batch;       /* The paths to remove with the next flush */
+    GQueue trash;           /* The paths to move to the trash */
+    guint trashing;         /* The number of files being moved */
+    GPtrArray *failures;    /* The messages of failed moves to report */
+    int removed;            /* The number of wallpapers removed */
+    int trashed;            /* The number of files moved to the trash */
+};
+
+/* Function prototypes */
+struct removal_queue *removal_queue_new(struct nextwall_ctx *ctx,
+        bool trash_files);
+void removal_queue_free(struct removal_queue *queue);
+int removal_queue_add(struct removal_queue *queue, const char *path);
+int removal_queue_flush(struct removal_queue *queue);
+void removal_queue_wait(struct removal_queue *queue);
+int removal_queue_report(struct removal_queue *queue, FILE *stream);
+int remove_list(struct removal_queue *queue, FILE *stream);
+
+#endif
@@ -0,0 +1,488 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     /* asprintf */
+
+#include <bsd/string.h> /* strlcpy */
+#include <fcntl.h>      /* open */
+#include <limits.h>     /* PATH_MAX */
+#include <stdio.h>
+#include <stdlib.h>     /* mkstemp realpath */
+#include <string.h>
+#include <sys/mman.h>   /* mmap */
+#include <sys/stat.h>   /* fstat */
+#include <unistd.h>     /* close unlink */
+
+#include "snapshot.h"
+#include "std.h"        /* get_path_range random_below */
+
+/* A growing buffer for snapshot_write() */
+struct buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Function prototypes */
+static int buffer_append(struct buffer *buffer, const void *data, size_t size);
+static const char *get_string(const struct snapshot *snapshot, uint32_t offset);
+static uint32_t find_dir(const struct snapshot *snapshot, const char *path);
+
+/**
+  Return the generation of a nextwall database.
+
+  The generation is increased by triggers whenever a wallpaper is added,
+  removed, or changes its path or brightness, so a snapshot with the same
+  generation holds the same wallpapers as the database.
+
+  @param[in] db The database handler.
+  @return Returns the generation, or -1 on error.
+ */
+int64_t snapshot_generation(sqlite3 *db) {
+    int64_t generation = -1;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db,
+                "SELECT value FROM info WHERE name = 'generation';",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        generation = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+
+    return generation;
+}
+
+/**
+  Write a snapshot of the wallpapers in a database.
+
+  The snapshot is written to a temporary file that is then renamed to
+  `path`, so readers see either the old or the new snapshot in full. Only
+  wallpapers with a brightness from 0 to SNAPSHOT_BRIGHTNESS_COUNT - 1 are
+  included.
+
+  @param[in] db The database handler.
+  @param[in] path The path of the snapshot file.
+  @param[out] generation Is set to the generation of the database that the
+              snapshot was made of.
+  @return Returns 0 on success, -1 on error.
+ */
+int snapshot_write(sqlite3 *db, const char *path, int64_t *generation) {
+    int rc = -1;
+    int fd;
+    int write_error;
+    int brightness = 0;
+    uint32_t d = 0;
+    uint32_t n = 0;
+    char *tmp_path = NULL;
+    FILE *stream = NULL;
+    sqlite3_stmt *stmt = NULL;
+    struct snapshot_dir dir = {0};
+    struct snapshot_dir *dirs;
+    struct snapshot_entry entry;
+    struct snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION
+    };
+    struct buffer dir_buffer = {0}, entry_buffer = {0}, strings = {0};
+
+    // Read the wallpapers and the generation consistently
+    sqlite3_exec(db, "SAVEPOINT snapshot", NULL, NULL, NULL);
+
+    if ((header.generation = snapshot_generation(db)) == -1) {
+        goto Return;
+    }
+
+    // Offset 0 is the empty path of the sentinel directory
+    if (buffer_append(&strings, "", 1) == -1) {
+        goto Return;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT path FROM directories ORDER BY path;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        goto Return;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        dir.path = strings.size;
+
+        if (buffer_append(&strings, sqlite3_column_text(stmt, 0),
+                    sqlite3_column_bytes(stmt, 0) + 1) == -1 ||
+                buffer_append(&dir_buffer, &dir, sizeof dir) == -1) {
+            goto Return;
+        }
+
+        header.dir_count++;
+    }
+
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    dir.path = 0;
+    if (buffer_append(&dir_buffer, &dir, sizeof dir) == -1) {
+        goto Return;
+    }
+
+    if (sqlite3_prepare_v2(db,
+                "SELECT w.id, w.brightness, d.path, d.path || '/' || w.name " \
+                "FROM wallpapers w JOIN directories d ON d.id = w.dir_id " \
+                "WHERE w.brightness >= 0 AND w.brightness < ? " \
+                "ORDER BY w.brightness, d.path;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        goto Return;
+    }
+
+    sqlite3_bind_int(stmt, 1, SNAPSHOT_BRIGHTNESS_COUNT);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *dir_path = (const char *)sqlite3_column_text(stmt, 2);
+        int entry_brightness = sqlite3_column_int(stmt, 1);
+
+        // Set where the entries of each directory start: the directories
+        // up to and including the one of this entry start here, unless they
+        // already had an entry. The data of the buffer may move, so take
+        // the pointer each time.
+        dirs = (struct snapshot_dir *)dir_buffer.data;
+
+        for (; brightness < entry_brightness; brightness++, d = 0) {
+            for (; d <= header.dir_count; d++) {
+                dirs[d].first[brightness] = n;
+            }
+        }
+
+        for (; d < header.dir_count &&
+                strcmp(strings.data + dirs[d].path, dir_path) <= 0; d++) {
+            dirs[d].first[brightness] = n;
+        }
+
+        entry.id = sqlite3_column_int(stmt, 0);
+        entry.path = strings.size;
+
+        if (buffer_append(&strings, sqlite3_column_text(stmt, 3),
+                    sqlite3_column_bytes(stmt, 3) + 1) == -1 ||
+                buffer_append(&entry_buffer, &entry, sizeof entry) == -1) {
+            goto Return;
+        }
+
+        n++;
+    }
+
+    dirs = (struct snapshot_dir *)dir_buffer.data;
+
+    for (; brightness < SNAPSHOT_BRIGHTNESS_COUNT; brightness++, d = 0) {
+        for (; d <= header.dir_count; d++) {
+            dirs[d].first[brightness] = n;
+        }
+    }
+
+    if (strings.size > UINT32_MAX) {
+        fprintf(stderr, "Error: too many wallpapers for a snapshot\n");
+        goto Return;
+    }
+
+    header.entry_count = n;
+    header.strings_size = strings.size;
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+        tmp_path = NULL;
+        goto Return;
+    }
+
+    if ((fd = mkstemp(tmp_path)) == -1 || !(stream = fdopen(fd, "w"))) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        goto Return;
+    }
+
+    fwrite(&header, sizeof header, 1, stream);
+    fwrite(dir_buffer.data, 1, dir_buffer.size, stream);
+    fwrite(entry_buffer.data, 1, entry_buffer.size, stream);
+    fwrite(strings.data, 1, strings.size, stream);
+
+    write_error = ferror(stream);
+
+    if (fclose(stream) != 0 || write_error || rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Error: Failed to write the snapshot %s\n", path);
+        unlink(tmp_path);
+        goto Return;
+    }
+
+    *generation = header.generation;
+    rc = 0;
+
+    goto Return;
+
+Return:
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "RELEASE snapshot", NULL, NULL, NULL);
+    free(tmp_path);
+    free(dir_buffer.data);
+    free(entry_buffer.data);
+    free(strings.data);
+
+    return rc;
+}
+
+/**
+  Map a snapshot file into memory.
+
+  The mapping stays valid when the file is replaced by a new snapshot.
+
+  @param[in] path The path of the snapshot file.
+  @return Returns the snapshot, or NULL if it does not exist, is not valid,
+          or on error. Close it with snapshot_close().
+ */
+struct snapshot *snapshot_open(const char *path) {
+    int fd;
+    size_t size;
+    void *map;
+    struct stat statbuf;
+    struct snapshot *snapshot;
+    const struct snapshot_header *header;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &statbuf) == -1 || statbuf.st_size < sizeof *header) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    header = map;
+    size = sizeof *header +
+        ((size_t)header->dir_count + 1) * sizeof (struct snapshot_dir) +
+        (size_t)header->entry_count * sizeof (struct snapshot_entry) +
+        header->strings_size;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0 ||
+            header->version != SNAPSHOT_VERSION ||
+            size != statbuf.st_size ||
+            header->strings_size == 0 ||
+            ((const char *)map)[size - 1] != '\0' ||
+            !(snapshot = malloc(sizeof *snapshot))) {
+        munmap(map, statbuf.st_size);
+        return NULL;
+    }
+
+    snapshot->map = map;
+    snapshot->size = size;
+    snapshot->header = header;
+    snapshot->dirs = (const struct snapshot_dir *)(header + 1);
+    snapshot->entries = (const struct snapshot_entry *)
+        (snapshot->dirs + header->dir_count + 1);
+    snapshot->strings = (const char *)
+        (snapshot->entries + header->entry_count);
+
+    return snapshot;
+}
+
+/**
+  Unmap a snapshot.
+
+  @param[in] snapshot The snapshot, may be NULL.
+ */
+void snapshot_close(struct snapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+
+    munmap(snapshot->map, snapshot->size);
+    free(snapshot);
+}
+
+/**
+  Select a random wallpaper from a snapshot.
+
+  The directories of the base directory are found with a binary search, and
+  the wallpapers are drawn uniformly. This neither allocates memory nor
+  checks whether the file exists.
+
+  @param[in] snapshot The snapshot.
+  @param[in] base The base directory from which to select wallpapers.
+  @param[in] brightness If set to 0, 1, or 2, only wallpapers matching this
+             brightness value are selected.
+  @param[in,out] random_state The state of the random number generator.
+  @param[out] result_path Will be set to the path of the wallpaper.
+  @return Returns the ID of the wallpaper, or -1 if no wallpaper matches or
+          on error.
+ */
+int snapshot_pick(const struct snapshot *snapshot, const char *base,
+        int brightness, uint64_t *random_state, char *result_path) {
+    int b, i;
+    int b_first = 0, b_last = SNAPSHOT_BRIGHTNESS_COUNT - 1;
+    uint32_t first, last;
+    uint32_t ranges[2][2];
+    long long count = 0;
+    long long r;
+    size_t len;
+    char real_base[PATH_MAX];
+    char lower[PATH_MAX];
+    char upper[PATH_MAX];
+    const struct snapshot_dir *dirs = snapshot->dirs;
+    const struct snapshot_entry *entry;
+
+    if (brightness >= 0) {
+        if (brightness > b_last) {
+            return -1;
+        }
+        b_first = b_last = brightness;
+    }
+
+    if (realpath(base, real_base) == NULL ||
+            get_path_range(real_base, lower, upper, PATH_MAX) == -1) {
+        return -1;
+    }
+
+    // The base directory itself, then the directories below it
+    len = strlen(lower);
+    lower[len - 1] = '\0';
+    ranges[0][0] = find_dir(snapshot, lower);
+    ranges[0][1] = ranges[0][0] + (ranges[0][0] < snapshot->header->dir_count &&
+            strcmp(get_string(snapshot, dirs[ranges[0][0]].path), lower) == 0);
+    lower[len - 1] = '/';
+    ranges[1][0] = find_dir(snapshot, lower);
+    ranges[1][1] = find_dir(snapshot, upper);
+
+    for (b = b_first; b <= b_last; b++) {
+        for (i = 0; i < 2; i++) {
+            first = dirs[ranges[i][0]].first[b];
+            last = dirs[ranges[i][1]].first[b];
+            count += last > first ? last - first : 0;
+        }
+    }
+
+    if (count == 0) {
+        return -1;
+    }
+
+    r = random_below(count, random_state);
+
+    for (b = b_first; b <= b_last; b++) {
+        for (i = 0; i < 2; i++) {
+            first = dirs[ranges[i][0]].first[b];
+            last = dirs[ranges[i][1]].first[b];
+
+            if (last <= first || r >= last - first) {
+                r -= last > first ? last - first : 0;
+                continue;
+            }
+
+            if (first + r >= snapshot->header->entry_count) {
+                return -1;
+            }
+
+            entry = &snapshot->entries[first + r];
+            strlcpy(result_path, get_string(snapshot, entry->path), PATH_MAX);
+
+            return entry->id;
+        }
+    }
+
+    return -1;
+}
+
+/**
+  Return the index of the first directory of a snapshot with a path that is
+  not less than `path`.
+
+  @param[in] snapshot The snapshot.
+  @param[in] path The path to look for.
+  @return Returns the index, which is the number of directories if all
+          paths are less.
+ */
+uint32_t find_dir(const struct snapshot *snapshot, const char *path) {
+    uint32_t low = 0;
+    uint32_t high = snapshot->header->dir_count;
+    uint32_t middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (strcmp(get_string(snapshot, snapshot->dirs[middle].path), path) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/**
+  Return a string from the string table of a snapshot.
+
+  @param[in] snapshot The snapshot.
+  @param[in] offset The offset of the string.
+  @return Returns the string, or "" if the offset is out of range.
+ */
+const char *get_string(const struct snapshot *snapshot, uint32_t offset) {
+    if (offset >= snapshot->header->strings_size) {
+        return "";
+    }
+
+    return snapshot->strings + offset;
+}
+
+/**
+  Append data to a buffer, growing it as needed.
+
+  @param[in] buffer The buffer.
+  @param[in] data The data to append.
+  @param[in] size The size of the data.
+  @return Returns 0 on success, -1 if memory allocation failed.
+ */
+int buffer_append(struct buffer *buffer, const void *data, size_t size) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    char *new_data;
+
+    while (capacity < buffer->size + size) {
+        capacity *= 2;
+    }
+
+    if (capacity != buffer->capacity) {
+        if ( !(new_data = realloc(buffer->data, capacity)) ) {
+            fprintf(stderr, "Error: out of memory\n");
+            return -1;
+        }
+
+        buffer->data = new_data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+
+    return 0;
+}
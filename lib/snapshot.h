@@ -0,0 +1,80 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NEXTWALL_SNAPSHOT_H
+#define NEXTWALL_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+
+/* The first bytes of a snapshot file, and its format version */
+#define SNAPSHOT_MAGIC "NWSNAP\0"
+#define SNAPSHOT_VERSION 1
+
+/* The brightness values a snapshot holds wallpapers for */
+#define SNAPSHOT_BRIGHTNESS_COUNT 3
+
+/* A snapshot file holds the header, dir_count + 1 directories, entry_count
+   entries, and a string table of strings_size bytes, in that order. The
+   numbers are in the byte order of the host. */
+struct snapshot_header {
+    char magic[8];          /* SNAPSHOT_MAGIC */
+    uint32_t version;       /* SNAPSHOT_VERSION */
+    uint32_t dir_count;     /* Number of directories */
+    uint32_t entry_count;   /* Number of wallpapers */
+    uint32_t strings_size;  /* Size of the string table in bytes */
+    int64_t generation;     /* See snapshot_generation() */
+};
+
+/* A directory. The directories are sorted by path, and the last one is a
+   sentinel without a path. */
+struct snapshot_dir {
+    uint32_t path;          /* Offset of the path in the string table */
+    uint32_t first[SNAPSHOT_BRIGHTNESS_COUNT]; /* Index of the first entry
+                               with each brightness in this directory or
+                               the ones after it */
+};
+
+/* A wallpaper. The entries are sorted by brightness, then directory. */
+struct snapshot_entry {
+    int32_t id;             /* ID of the wallpaper */
+    uint32_t path;          /* Offset of the full path in the string table */
+};
+
+/* A snapshot file mapped into memory, see snapshot_open() */
+struct snapshot {
+    void *map;
+    size_t size;
+    const struct snapshot_header *header;
+    const struct snapshot_dir *dirs;
+    const struct snapshot_entry *entries;
+    const char *strings;
+};
+
+int64_t snapshot_generation(sqlite3 *db);
+int snapshot_write(sqlite3 *db, const char *path, int64_t *generation);
+struct snapshot *snapshot_open(const char *path);
+void snapshot_close(struct snapshot *snapshot);
+int snapshot_pick(const struct snapshot *snapshot, const char *base,
+        int brightness, uint64_t *random_state, char *result_path);
+
+#endif
@@ -0,0 +1,354 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     /* asprintf timegm */
+
+#include <math.h>       /* asin cos sin */
+#include <stdio.h>
+#include <stdlib.h>     /* mkstemp */
+#include <string.h>
+#include <unistd.h>     /* close unlink */
+
+#include "solar.h"
+#include "sunriset.h"
+
+/* Function prototypes */
+static int is_above(const struct solar_table *table, int day,
+        enum solar_event event, time_t when);
+static time_t day_start(const struct solar_table *table, int day);
+
+/**
+  Compute the sun events of each day of a year at a location.
+
+  Each day takes a few microseconds, so the table for a year is computed in
+  well under a millisecond.
+
+  @param[out] table The table.
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+  @param[in] year The year.
+ */
+void solar_table_build(struct solar_table *table, double lat, double lon,
+        int year) {
+    int i;
+    double start, end;
+    struct solar_times *times;
+    struct tm date;
+
+    memset(table, 0, sizeof *table);
+    memcpy(table->magic, SOLAR_MAGIC, sizeof table->magic);
+    table->version = SOLAR_VERSION;
+    table->year = year;
+    table->latitude = lat;
+    table->longitude = lon;
+
+    for (i = 0; i < SOLAR_DAYS; i++) {
+        // Let timegm() turn the day of the year into a date; day 366 of a
+        // common year is January 1 of the next year, which is never used.
+        memset(&date, 0, sizeof date);
+        date.tm_year = year - 1900;
+        date.tm_mday = i + 1;
+        timegm(&date);
+
+        times = table->days[i];
+
+#define SOLAR_SET(event, function) do { \
+    times[event].status = function(date.tm_year + 1900, date.tm_mon + 1, \
+            date.tm_mday, lon, lat, &start, &end); \
+    times[event].start = start; \
+    times[event].end = end; \
+} while(0)
+
+        SOLAR_SET(SOLAR_SUN, sun_rise_set);
+        SOLAR_SET(SOLAR_CIVIL, civil_twilight);
+        SOLAR_SET(SOLAR_NAUTICAL, nautical_twilight);
+        SOLAR_SET(SOLAR_ASTRONOMICAL, astronomical_twilight);
+
+#undef SOLAR_SET
+    }
+}
+
+/**
+  Load the solar table of a year at a location.
+
+  The table is read from the file at `path` if it holds the table for the
+  same year and location. Otherwise the table is computed and saved there,
+  so that it is read from the file next time.
+
+  @param[out] table The table.
+  @param[in] path The path of the table file.
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+  @param[in] year The year.
+  @return Returns 0 on success, -1 if the computed table could not be saved.
+          The table can be used either way.
+ */
+int solar_table_load(struct solar_table *table, const char *path,
+        double lat, double lon, int year) {
+    int fd;
+    int write_error;
+    int found = 0;
+    char *tmp_path = NULL;
+    FILE *stream;
+
+    if ((stream = fopen(path, "r"))) {
+        found = fread(table, sizeof *table, 1, stream) == 1 &&
+            fgetc(stream) == EOF;
+        fclose(stream);
+    }
+
+    if (found &&
+            memcmp(table->magic, SOLAR_MAGIC, sizeof table->magic) == 0 &&
+            table->version == SOLAR_VERSION && table->year == year &&
+            table->latitude == lat && table->longitude == lon) {
+        return 0;
+    }
+
+    solar_table_build(table, lat, lon, year);
+
+    // Write to a temporary file first, so that a reader never sees half
+    // a table
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+        return -1;
+    }
+
+    if ((fd = mkstemp(tmp_path)) == -1 || !(stream = fdopen(fd, "w"))) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return -1;
+    }
+
+    fwrite(table, sizeof *table, 1, stream);
+    write_error = ferror(stream);
+
+    if (fclose(stream) != 0 || write_error || rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Error: Failed to write the solar table %s\n", path);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+
+    return 0;
+}
+
+/**
+  Look up the times the sun passes an altitude on the local day of a time.
+
+  @param[in] table The solar table.
+  @param[in] when The time.
+  @param[in] event The altitude of the sun.
+  @return Returns the times, or NULL if the table is for a different year.
+ */
+const struct solar_times *solar_times(const struct solar_table *table,
+        time_t when, enum solar_event event) {
+    struct tm local;
+
+    localtime_r(&when, &local);
+
+    if (local.tm_year + 1900 != table->year) {
+        return NULL;
+    }
+
+    return &table->days[local.tm_yday][event];
+}
+
+/**
+  Return the brightness value for a time.
+
+  @param[in] table The solar table.
+  @param[in] when The time.
+  @return Returns 2 while the sun is up, 1 during civil twilight, or 0 at
+          night. Returns -1 if the table is for a different year.
+ */
+int solar_brightness(const struct solar_table *table, time_t when) {
+    struct tm local;
+
+    localtime_r(&when, &local);
+
+    if (local.tm_year + 1900 != table->year) {
+        return -1;
+    }
+
+    if (is_above(table, local.tm_yday, SOLAR_SUN, when)) {
+        return 2;
+    }
+
+    if (is_above(table, local.tm_yday, SOLAR_CIVIL, when)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+  Return when the brightness value changes next.
+
+  This is the first sunrise, sunset, or start or end of civil twilight
+  after `when`. If there is none for the rest of the year, e.g. during the
+  polar night, this is the start of the next year, when the table for that
+  year should be loaded.
+
+  @param[in] table The solar table.
+  @param[in] when The time.
+  @return Returns the time of the change, rounded up to the next second,
+          or -1 if the table is for a different year.
+ */
+time_t solar_next_change(const struct solar_table *table, time_t when) {
+    int day, event;
+    double change, next = -1;
+    struct tm local;
+    const struct solar_times *times;
+
+    localtime_r(&when, &local);
+
+    if (local.tm_year + 1900 != table->year) {
+        return -1;
+    }
+
+    // Start a day before, because far from Greenwich the times of a day
+    // can reach into the next local day. A change that is found on one day
+    // may still come after one of the next day, but not after one of the
+    // day after.
+    for (day = local.tm_yday > 0 ? local.tm_yday - 1 : 0; day < SOLAR_DAYS;
+            day++) {
+        if (next != -1 && day > local.tm_yday + 1) {
+            break;
+        }
+
+        for (event = SOLAR_SUN; event <= SOLAR_CIVIL; event++) {
+            times = &table->days[day][event];
+
+            if (times->status != 0) {
+                continue;
+            }
+
+            change = day_start(table, day) + times->start * 3600.0;
+            if (change > when && (next == -1 || change < next)) {
+                next = change;
+            }
+
+            change = day_start(table, day) + times->end * 3600.0;
+            if (change > when && (next == -1 || change < next)) {
+                next = change;
+            }
+        }
+    }
+
+    if (next == -1) {
+        memset(&local, 0, sizeof local);
+        local.tm_year = table->year + 1 - 1900;
+        local.tm_mday = 1;
+        local.tm_isdst = -1;
+        return mktime(&local);
+    }
+
+    // The sun has passed the altitude one second later
+    return (time_t)next + 1;
+}
+
+/**
+  Compute the altitude of the sun above the horizon at a time.
+
+  The position of the sun is computed like __sunriset__() does, so the
+  altitude is -6 degrees when civil twilight starts or ends in a solar
+  table.
+
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+  @param[in] when The time.
+  @return Returns the altitude in degrees, from -90 to 90.
+ */
+double solar_elevation(double lat, double lon, time_t when) {
+    double d, hours, sidtime, ra, dec, r;
+    struct tm utc;
+
+    gmtime_r(&when, &utc);
+    hours = utc.tm_hour + utc.tm_min / 60.0 + utc.tm_sec / 3600.0;
+
+    // Days since 2000 Jan 0.0 UT, including the time of day
+    d = days_since_2000_Jan_0(utc.tm_year + 1900, utc.tm_mon + 1,
+            utc.tm_mday) + hours / 24.0;
+
+    sun_RA_dec(d, &ra, &dec, &r);
+
+    // The local sidereal time, and the hour angle of the sun from it
+    sidtime = revolution(GMST0(d) + 15.0 * hours + lon);
+
+    return asind(sind(lat) * sind(dec) +
+            cosd(lat) * cosd(dec) * cosd(sidtime - ra));
+}
+
+/**
+  Return midnight UT of a day of the year of a solar table.
+
+  @param[in] table The solar table.
+  @param[in] day The day of the year, starting from 0.
+  @return Returns the time.
+ */
+time_t day_start(const struct solar_table *table, int day) {
+    struct tm date = {0};
+
+    date.tm_year = table->year - 1900;
+    date.tm_mday = day + 1;
+
+    return timegm(&date);
+}
+
+/**
+  Check if the sun is above an altitude at a time.
+
+  The times of the days before and after are checked as well, because far
+  from Greenwich the times of a day can reach into the next or previous
+  local day.
+
+  @param[in] table The solar table.
+  @param[in] day The local day of `when`, starting from 0.
+  @param[in] event The altitude of the sun.
+  @param[in] when The time.
+  @return Returns 1 if the sun is above the altitude, 0 otherwise.
+ */
+int is_above(const struct solar_table *table, int day, enum solar_event event,
+        time_t when) {
+    int i;
+    time_t start;
+    const struct solar_times *times = &table->days[day][event];
+
+    // The sun stays above or below the altitude all day
+    if (times->status != 0) {
+        return times->status > 0;
+    }
+
+    for (i = day > 0 ? day - 1 : 0; i <= day + 1 && i < SOLAR_DAYS; i++) {
+        times = &table->days[i][event];
+        start = day_start(table, i);
+
+        if (times->status == 0 && start + times->start * 3600.0 < when &&
+                when < start + times->end * 3600.0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
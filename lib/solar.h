@@ -0,0 +1,76 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_SOLAR_H
+#define NEXTWALL_SOLAR_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* The first bytes of a solar table file, and its format version */
+#define SOLAR_MAGIC "NWSOLAR"
+#define SOLAR_VERSION 1
+
+/* The number of days in a solar table, enough for a leap year */
+#define SOLAR_DAYS 366
+
+/* The altitudes of the sun that a solar table has the times for */
+enum solar_event {
+    SOLAR_SUN,              /* Sunrise and sunset */
+    SOLAR_CIVIL,            /* Civil twilight */
+    SOLAR_NAUTICAL,         /* Nautical twilight */
+    SOLAR_ASTRONOMICAL,     /* Astronomical twilight */
+    SOLAR_EVENT_COUNT
+};
+
+/* The times the sun passes an altitude on one day, in hours UT after
+   midnight UT of that day; see __sunriset__(). The times can be below 0 or
+   above 24 far from Greenwich. */
+struct solar_times {
+    float start;            /* When the sun rises above the altitude */
+    float end;              /* When the sun sets below the altitude */
+    int32_t status;         /* 0, or +1 if the sun stays above the altitude
+                               all day, -1 if it stays below */
+};
+
+/* The sun events of each day of a year at a location, see
+   solar_table_load(). A solar table file holds this structure, in the byte
+   order of the host. */
+struct solar_table {
+    char magic[8];          /* SOLAR_MAGIC */
+    uint32_t version;       /* SOLAR_VERSION */
+    int32_t year;
+    double latitude;
+    double longitude;
+    struct solar_times days[SOLAR_DAYS][SOLAR_EVENT_COUNT];
+};
+
+/* Function prototypes */
+void solar_table_build(struct solar_table *table, double lat, double lon,
+        int year);
+int solar_table_load(struct solar_table *table, const char *path,
+        double lat, double lon, int year);
+const struct solar_times *solar_times(const struct solar_table *table,
+        time_t when, enum solar_event event);
+int solar_brightness(const struct solar_table *table, time_t when);
+time_t solar_next_change(const struct solar_table *table, time_t when);
+double solar_elevation(double lat, double lon, time_t when);
+
+#endif
@@ -18,9 +18,16 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE     /* statx readahead */
+
+#include <fcntl.h>      /* AT_FDCWD open readahead */
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <sys/stat.h>   /* statx */
+#include <unistd.h>     /* close */
 
 #include "std.h"
 
@@ -93,3 +100,160 @@ int get_brightness(struct fann *ann, double lightness) {
 
     return -1;
 }
+
+/**
+  Return the path range for the files below a directory.
+
+  The files below `base` are exactly the paths `p` for which
+  `lower <= p < upper` in binary order, where `lower` is `base` with a slash
+  appended and `upper` is `base` with the character following the slash
+  ('0') appended. Unlike a prefix match, this does not match sibling
+  directories that share a prefix with `base`, and it can be answered with an
+  index on the path.
+
+  @param[in] base The directory path, with or without a trailing slash.
+  @param[out] lower Is set to the inclusive lower bound.
+  @param[out] upper Is set to the exclusive upper bound.
+  @param[in] size The size of the `lower` and `upper` buffers.
+  @return Returns 0 on success, -1 if the bounds do not fit in `size`.
+ */
+int get_path_range(const char *base, char *lower, char *upper, size_t size) {
+    size_t len = strlen(base);
+
+    /* Strip the trailing slash, but keep the root directory as "" */
+    while (len > 0 && base[len - 1] == '/') {
+        len--;
+    }
+
+    if (snprintf(lower, size, "%.*s/", (int)len, base) >= size ||
+            snprintf(upper, size, "%.*s0", (int)len, base) >= size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Split a path into its directory and file name.
+
+  @param[in] path The path to split.
+  @param[out] dir Is set to the directory of `path`, without a trailing
+              slash. This is an empty string for files in the root directory.
+  @param[in] size The size of the `dir` buffer.
+  @param[out] name Is set to point to the file name in `path`.
+  @return Returns 0 on success, -1 if `path` has no directory or if the
+          directory does not fit in `size`.
+ */
+int split_path(const char *path, char *dir, size_t size, const char **name) {
+    const char *slash = strrchr(path, '/');
+
+    if (!slash || snprintf(dir, size, "%.*s", (int)(slash - path), path) >= size) {
+        return -1;
+    }
+
+    *name = slash + 1;
+
+    return 0;
+}
+
+/**
+  Return a random number in the range [0, n).
+
+  Uses the SplitMix64 generator, so each caller can keep its own state, and
+  draws again when the number falls in the incomplete last block, so the
+  result is not biased towards small numbers like rand() % n is.
+
+  @param[in] n The upper bound; must be greater than 0.
+  @param[in,out] state The state of the generator. Any value is a valid seed.
+  @return A uniformly distributed random number in the range [0, n).
+ */
+long long random_below(long long n, uint64_t *state) {
+    uint64_t r, limit;
+
+    limit = UINT64_MAX - UINT64_MAX % n;
+
+    do {
+        r = (*state += 0x9e3779b97f4a7c15ULL);
+        r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+        r ^= r >> 31;
+    } while (r >= limit);
+
+    return r % n;
+}
+
+/**
+  Check if a path is a regular file, following symbolic links.
+
+  Uses statx() with AT_STATX_DONT_SYNC and only requests the file type, so
+  that checking a file on a network file system is cheap.
+
+  @param[in] path The path to check.
+  @return Returns 1 if the path is a regular file, 0 otherwise.
+ */
+int is_regular_file(const char *path) {
+    struct statx stx;
+
+    if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, STATX_TYPE, &stx) == -1) {
+        return 0;
+    }
+
+    return S_ISREG(stx.stx_mode);
+}
+
+/**
+  Read a file into the page cache.
+
+  Reading the file later then does not have to wait for the disk, which may
+  have to spin up first.
+
+  @param[in] path The path of the file.
+  @return Returns 0 on success, -1 on failure.
+ */
+int prefetch_file(const char *path) {
+    int fd, rc = -1;
+    struct stat statbuf;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) == 0) {
+        // readahead() is not supported by all file systems
+        rc = readahead(fd, 0, statbuf.st_size) == 0 ||
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0 ? 0 : -1;
+    }
+
+    close(fd);
+
+    return rc;
+}
+
+/**
+  Print a string as a JSON string, in double quotes.
+
+  Quotes, backslashes and control characters are escaped. Other bytes are
+  printed as they are, so a path that is not valid UTF-8 stays so.
+
+  @param[in] stream The stream to print to.
+  @param[in] s The string.
+ */
+void print_json_string(FILE *stream, const char *s) {
+    const unsigned char *c;
+
+    fputc('"', stream);
+
+    for (c = (const unsigned char *)s; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(stream, "\\%c", *c);
+        }
+        else if (*c < 0x20) {
+            fprintf(stream, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, stream);
+        }
+    }
+
+    fputc('"', stream);
+}
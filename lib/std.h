@@ -22,10 +22,19 @@
 #define NEXTWALL_STD_H
 
 #include <floatfann.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /* Function prototypes */
 char *hours_to_hm(double hours, char *s);
 int floatcmp(const void *a, const void *b);
 int get_brightness(struct fann *ann, double lightness);
+int get_path_range(const char *base, char *lower, char *upper, size_t size);
+int split_path(const char *path, char *dir, size_t size, const char **name);
+long long random_below(long long n, uint64_t *state);
+int is_regular_file(const char *path);
+int prefetch_file(const char *path);
+void print_json_string(FILE *stream, const char *s);
 
 #endif
@@ -0,0 +1,986 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <bsd/string.h> /* strlcpy */
+#include <errno.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib.h>
+#include <glib-unix.h>  /* g_unix_signal_add */
+#include <limits.h>     /* PATH_MAX */
+#include <signal.h>     /* SIGINT SIGTERM */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>     /* realpath strtol */
+#include <string.h>
+#include <sys/socket.h> /* socket connect send */
+#include <sys/timerfd.h>
+#include <sys/un.h>     /* sockaddr_un */
+#include <unistd.h>     /* close unlink */
+
+#include "cache.h"      /* cache_get */
+#include "daemon.h"
+#include "gnome.h"
+#include "removal.h"
+#include "std.h"        /* prefetch_file */
+
+/* The state of a running daemon */
+struct daemon {
+    struct nextwall_ctx *ctx;
+    struct background_writer *writer;
+    struct arguments *arguments;
+    struct wallpaper_state *wallpaper; /* State for the base directory */
+    char base[PATH_MAX];            /* The real path of the base directory */
+    struct wallpaper_state other;   /* State for requests on other directories */
+    char other_dir[PATH_MAX];
+    char other_current[PATH_MAX];
+    char other_path[PATH_MAX];
+    char picked[PATH_MAX];          /* The directory of the last pick, if
+                                       the last request was a pick */
+    int picked_brightness;          /* The brightness of the last pick */
+    int staged_id;                  /* The next wallpaper for the base
+                                       directory, or -1; see stage_next() */
+    char staged_path[PATH_MAX];
+    int staged_brightness;          /* The brightness it was selected for */
+    GMainLoop *loop;
+    guint timer;                    /* The rotation timer, or 0 */
+    gint64 next_rotation;           /* Monotonic time of the next rotation */
+    int phase_fd;                   /* The timerfd for brightness changes
+                                       with --time, or -1 */
+    guint phase_source;             /* The source that watches it, or 0 */
+    int phase_brightness;           /* The brightness since the last change */
+    time_t next_phase;              /* The time of the next change */
+    guint snapshot_timer;           /* Writes a stale snapshot, or 0 */
+    struct removal_queue *removals; /* Moves deleted wallpapers to the trash */
+};
+
+/* A staged wallpaper for prefetch_thread() */
+struct prefetch {
+    char path[PATH_MAX];
+    struct wallpaper_cache *cache;
+};
+
+/* A connection on the control socket */
+struct client {
+    struct daemon *daemon;
+    GSocketConnection *connection;
+    GDataInputStream *input;
+    GOutputStream *output;
+};
+
+/* Function prototypes */
+static gboolean on_incoming(GSocketService *service,
+        GSocketConnection *connection, GObject *source, gpointer data);
+static void on_request(GObject *source, GAsyncResult *result, gpointer data);
+static gboolean on_rotation_timer(gpointer data);
+static gboolean on_quit_signal(gpointer data);
+static void handle_request(struct daemon *daemon, char *line, GString *reply);
+static void handle_pick(struct daemon *daemon, char *argument, bool print_only,
+        GString *reply);
+static void handle_delete(struct daemon *daemon, char *argument, GString *reply);
+static void handle_rate(struct daemon *daemon, char *argument, GString *reply);
+static void handle_status(struct daemon *daemon, GString *reply);
+static void handle_rescan(struct daemon *daemon, GString *reply);
+static struct wallpaper_state *get_state(struct daemon *daemon,
+        const char *dir, int brightness);
+static void reset_pool(struct daemon *daemon, int brightness);
+static int get_current(struct daemon *daemon, char *argument, char *path);
+static int get_default_brightness(struct daemon *daemon);
+static void restart_timer(struct daemon *daemon);
+static void start_phase_timer(struct daemon *daemon);
+static void arm_phase_timer(struct daemon *daemon);
+static gboolean on_phase_timer(gint fd, GIOCondition condition, gpointer data);
+static void sync_snapshot_later(struct daemon *daemon);
+static gboolean on_snapshot_timer(gpointer data);
+static void stage_next(struct daemon *daemon, int brightness);
+static void prefetch_staged(struct daemon *daemon);
+static void prefetch_thread(GTask *task, gpointer source, gpointer data,
+        GCancellable *cancellable);
+
+/**
+  Set the path of the control socket of the daemon.
+
+  The socket lives in the runtime directory of the user, which only the user
+  can access.
+
+  @param[out] path Is set to the path of the socket.
+  @param[in] size The size of `path`.
+  @return Returns 0 on success, -1 if the path does not fit.
+ */
+int get_socket_path(char *path, size_t size) {
+    if (snprintf(path, size, "%s/%s", g_get_user_runtime_dir(),
+                DAEMON_SOCKET_NAME) >= (int)size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+  Run nextwall as a daemon.
+
+  The daemon keeps the nextwall context, the background writer and the pool
+  for --weighted loaded, and listens on a unix socket for requests. Each
+  request is a single line, which is answered with a single line that starts
+  with "OK" or "ERR":
+
+      next [BRIGHTNESS [PATH]]  Set the next wallpaper; replies its path
+      pick [BRIGHTNESS [PATH]]  Select a wallpaper without setting it; a
+                                following next sets it
+      delete [FILE]             Trash FILE or the current wallpaper
+      rate DELTA [FILE]         Rate FILE or the current wallpaper
+      status                    Reply the state of the daemon
+      rescan                    Scan the base directory for new wallpapers
+
+  BRIGHTNESS is -1 for any brightness, and PATH defaults to the base
+  directory of the daemon. If --interval is set, the wallpaper is also
+  changed when it has not changed for that many minutes. The daemon runs
+  until it receives SIGINT or SIGTERM.
+
+  The next wallpaper for the base directory is selected and prepared ahead
+  of time, see stage_next(), so that changing the wallpaper does not wait
+  for the disk.
+
+  @param[in] ctx The nextwall context.
+  @param[in] writer The background writer.
+  @param[in] wallpaper The wallpaper state for the base directory.
+  @param[in] arguments The command line arguments.
+  @return Returns 0 when the daemon stopped, -1 if it could not start.
+ */
+int run_daemon(struct nextwall_ctx *ctx,
+               struct background_writer *writer,
+               struct wallpaper_state *wallpaper,
+               struct arguments *arguments) {
+    int rc = -1;
+    char socket_path[sizeof ((struct sockaddr_un *)0)->sun_path];
+    char reply[DAEMON_REQUEST_MAX];
+    GError *error = NULL;
+    GSocketAddress *address = NULL;
+    GSocketService *service = NULL;
+    struct daemon daemon = {
+        .ctx = ctx,
+        .writer = writer,
+        .arguments = arguments,
+        .wallpaper = wallpaper,
+        .staged_id = -1,
+        .phase_fd = -1
+    };
+
+    daemon.other.dir = daemon.other_dir;
+    daemon.other.current = daemon.other_current;
+    daemon.other.path = daemon.other_path;
+    daemon.other.id = -1;
+    daemon.other.cache = wallpaper->cache;
+
+    if (realpath(wallpaper->dir, daemon.base) == NULL) {
+        fprintf(stderr, "Cannot access directory %s\n", wallpaper->dir);
+        return -1;
+    }
+
+    if (get_socket_path(socket_path, sizeof socket_path) == -1) {
+        fprintf(stderr, "Error: The path of the socket is too long\n");
+        return -1;
+    }
+
+    // Don't take over the socket of a daemon that is still running; a socket
+    // that nobody listens on was left behind and can go.
+    if (send_request("status", reply, sizeof reply) != -1) {
+        fprintf(stderr, "Error: nextwall is already running as a daemon\n");
+        return -1;
+    }
+
+    unlink(socket_path);
+
+    service = g_socket_service_new();
+    address = g_unix_socket_address_new(socket_path);
+
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+                &error)) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path,
+                error->message);
+        g_error_free(error);
+        goto Return;
+    }
+
+    g_signal_connect(service, "incoming", G_CALLBACK(on_incoming), &daemon);
+
+    // The wallpaper that main() selected is the first to be set
+    if (wallpaper->id != -1) {
+        daemon.staged_id = wallpaper->id;
+        daemon.staged_brightness = get_default_brightness(&daemon);
+        strlcpy(daemon.staged_path, wallpaper->path, sizeof daemon.staged_path);
+        prefetch_staged(&daemon);
+    }
+
+    daemon.removals = removal_queue_new(ctx, true);
+    daemon.loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGINT, on_quit_signal, &daemon);
+    g_unix_signal_add(SIGTERM, on_quit_signal, &daemon);
+    restart_timer(&daemon);
+    start_phase_timer(&daemon);
+
+    eprintf("Listening on %s\n", socket_path);
+    g_main_loop_run(daemon.loop);
+
+    // Don't lose the last wallpaper that was set
+    flush_background(writer);
+
+    removal_queue_wait(daemon.removals);
+    removal_queue_report(daemon.removals, stderr);
+
+    g_socket_service_stop(service);
+    g_socket_listener_close(G_SOCKET_LISTENER(service));
+    unlink(socket_path);
+    rc = 0;
+
+    goto Return;
+
+Return:
+    if (daemon.timer) {
+        g_source_remove(daemon.timer);
+    }
+    if (daemon.phase_source) {
+        g_source_remove(daemon.phase_source);
+    }
+    if (daemon.phase_fd != -1) {
+        close(daemon.phase_fd);
+    }
+    if (daemon.snapshot_timer) {
+        g_source_remove(daemon.snapshot_timer);
+    }
+    removal_queue_free(daemon.removals);
+    if (daemon.loop) {
+        g_main_loop_unref(daemon.loop);
+    }
+    g_object_unref(address);
+    g_object_unref(service);
+
+    return rc;
+}
+
+/**
+  Send a request to a running daemon.
+
+  This deliberately uses plain sockets, so that a client does not pay for
+  setting up GIO.
+
+  @param[in] request The request line, without the newline.
+  @param[out] reply Is set to the reply of the daemon, without the "OK" or
+              "ERR" and the newline.
+  @param[in] size The size of `reply`.
+  @return Returns 0 if the request succeeded, 1 if the daemon reported an
+          error, or -1 if no daemon is running.
+ */
+int send_request(const char *request, char *reply, size_t size) {
+    int fd;
+    int rc = -1;
+    char line[DAEMON_REQUEST_MAX];
+    char *value;
+    FILE *stream;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+    if (get_socket_path(address.sun_path, sizeof address.sun_path) == -1) {
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof address) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Once connected, a failure is an error of the daemon rather than a
+    // reason to do the work locally.
+    rc = 1;
+    strlcpy(reply, "No reply from the daemon", size);
+
+    if (snprintf(line, sizeof line, "%s\n", request) >= (int)sizeof line ||
+            send(fd, line, strlen(line), MSG_NOSIGNAL) == -1 ||
+            shutdown(fd, SHUT_WR) == -1 ||
+            !(stream = fdopen(fd, "r"))) {
+        close(fd);
+        return rc;
+    }
+
+    if (fgets(line, sizeof line, stream)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "OK", 2) == 0) {
+            rc = 0;
+            value = line + 2;
+        }
+        else {
+            value = strncmp(line, "ERR", 3) == 0 ? line + 3 : line;
+        }
+
+        strlcpy(reply, value + strspn(value, " "), size);
+    }
+
+    fclose(stream);
+
+    return rc;
+}
+
+/* Start reading the requests of a new connection */
+gboolean on_incoming(GSocketService *service, GSocketConnection *connection,
+        GObject *source, gpointer data) {
+    struct client *client = g_new0(struct client, 1);
+
+    client->daemon = data;
+    client->connection = g_object_ref(connection);
+    client->input = g_data_input_stream_new(
+            g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    client->output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+    g_data_input_stream_read_line_async(client->input, G_PRIORITY_DEFAULT,
+            NULL, on_request, client);
+
+    return TRUE;
+}
+
+/* Answer a request line, and wait for the next one */
+void on_request(GObject *source, GAsyncResult *result, gpointer data) {
+    struct client *client = data;
+    char *line;
+    GString *reply;
+
+    line = g_data_input_stream_read_line_finish(client->input, result, NULL, NULL);
+
+    if (!line) {
+        // The client closed the connection, or it failed
+        g_io_stream_close(G_IO_STREAM(client->connection), NULL, NULL);
+        g_object_unref(client->input);
+        g_object_unref(client->connection);
+        g_free(client);
+        return;
+    }
+
+    reply = g_string_new(NULL);
+    handle_request(client->daemon, line, reply);
+
+    // Replies are a single short line, so this does not block for long
+    g_output_stream_write_all(client->output, reply->str, reply->len, NULL,
+            NULL, NULL);
+
+    g_string_free(reply, TRUE);
+    g_free(line);
+
+    g_data_input_stream_read_line_async(client->input, G_PRIORITY_DEFAULT,
+            NULL, on_request, client);
+}
+
+/* Change the wallpaper when it was shown for the whole interval */
+gboolean on_rotation_timer(gpointer data) {
+    struct daemon *daemon = data;
+    GString *reply = g_string_new(NULL);
+
+    // This source is done; handle_pick() starts the next interval.
+    daemon->timer = 0;
+
+    handle_pick(daemon, "", false, reply);
+    eprintf("Rotation: %s", reply->str);
+
+    if (!daemon->timer) {
+        restart_timer(daemon);
+    }
+
+    g_string_free(reply, TRUE);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Stop the daemon */
+gboolean on_quit_signal(gpointer data) {
+    struct daemon *daemon = data;
+
+    g_main_loop_quit(daemon->loop);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+  Handle a request line.
+
+  @param[in] daemon The daemon.
+  @param[in] line The request, without the newline. It is modified.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_request(struct daemon *daemon, char *line, GString *reply) {
+    char *argument;
+
+    if ((argument = strchr(line, ' '))) {
+        *argument++ = '\0';
+    }
+    else {
+        argument = "";
+    }
+
+    eprintf("Request: %s %s\n", line, argument);
+
+    // Files of deleted wallpapers that could not be moved to the trash
+    removal_queue_report(daemon->removals, stderr);
+
+    if (strcmp(line, "next") == 0) {
+        handle_pick(daemon, argument, false, reply);
+    }
+    else if (strcmp(line, "pick") == 0) {
+        handle_pick(daemon, argument, true, reply);
+    }
+    else if (strcmp(line, "delete") == 0) {
+        handle_delete(daemon, argument, reply);
+    }
+    else if (strcmp(line, "rate") == 0) {
+        handle_rate(daemon, argument, reply);
+    }
+    else if (strcmp(line, "status") == 0) {
+        handle_status(daemon, reply);
+    }
+    else if (strcmp(line, "rescan") == 0) {
+        handle_rescan(daemon, reply);
+    }
+    else {
+        g_string_append_printf(reply, "ERR Unknown command '%s'\n", line);
+    }
+
+}
+
+/**
+  Handle the next and pick requests.
+
+  @param[in] daemon The daemon.
+  @param[in] argument The optional brightness and directory.
+  @param[in] print_only If true, the wallpaper is not set.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_pick(struct daemon *daemon, char *argument, bool print_only,
+        GString *reply) {
+    int brightness;
+    char *dir;
+    const char *real_dir;
+    struct wallpaper_state *state;
+
+    brightness = strtol(argument, &dir, 10);
+
+    if (dir == argument) {
+        brightness = get_default_brightness(daemon);
+    }
+    else if (brightness < -1 || brightness > 2 || (*dir && *dir != ' ')) {
+        g_string_append(reply, "ERR Invalid brightness\n");
+        return;
+    }
+
+    dir += strspn(dir, " ");
+
+    if ( !(state = get_state(daemon, dir, brightness)) ) {
+        g_string_append_printf(reply, "ERR Cannot access directory %s\n", dir);
+        return;
+    }
+
+    real_dir = state == &daemon->other ? daemon->other_dir : daemon->base;
+
+    // Only next after a pick for the same directory and brightness sets the
+    // picked wallpaper. Otherwise a new wallpaper is drawn, like --print
+    // does for each pick.
+    if (print_only || brightness != daemon->picked_brightness ||
+            strcmp(real_dir, daemon->picked) != 0) {
+        state->id = -1;
+    }
+
+    // Otherwise next sets the staged wallpaper, if it is still wanted
+    if (!print_only && state->id == -1 && state == daemon->wallpaper &&
+            daemon->staged_id != -1 && brightness == daemon->staged_brightness) {
+        state->id = daemon->staged_id;
+        strlcpy(state->path, daemon->staged_path, PATH_MAX);
+    }
+
+    daemon->picked[0] = '\0';
+
+    // Selecting removes the wallpapers whose files are gone
+    sync_snapshot_later(daemon);
+
+    if (set_wallpaper(daemon->writer, daemon->ctx, brightness, state,
+                print_only) == -1) {
+        g_string_append(reply, "ERR No wallpaper found\n");
+        return;
+    }
+
+    if (print_only) {
+        strlcpy(daemon->picked, real_dir, sizeof daemon->picked);
+        daemon->picked_brightness = brightness;
+    }
+
+    if (!print_only) {
+        // Show the new wallpaper for a whole interval
+        restart_timer(daemon);
+
+        if (state == daemon->wallpaper) {
+            stage_next(daemon, brightness);
+        }
+    }
+
+    g_string_append_printf(reply, "OK %s\n", state->path);
+}
+
+/**
+  Handle the delete request.
+
+  The wallpaper is removed from the database, and its file is moved to the
+  trash in the background like the d command of the interactive mode does;
+  a failure is logged with the next request. If it is the current
+  wallpaper, the next wallpaper is set, and if it is the staged wallpaper,
+  another one is staged.
+
+  @param[in] daemon The daemon.
+  @param[in] argument The file to delete, or empty for the current wallpaper.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_delete(struct daemon *daemon, char *argument, GString *reply) {
+    int id;
+    char path[PATH_MAX];
+    char current[PATH_MAX];
+
+    if (get_current(daemon, argument, path) == -1 ||
+            get_requested_background(daemon->writer, current) != 0) {
+        g_string_append(reply, "ERR Failed to get the wallpaper\n");
+        return;
+    }
+
+    id = get_wallpaper_id(daemon->ctx, path);
+
+    removal_queue_add(daemon->removals, path);
+
+    if (removal_queue_flush(daemon->removals) == -1) {
+        g_string_append_printf(reply, "ERR Failed to delete %s\n", path);
+        return;
+    }
+
+    sync_snapshot_later(daemon);
+
+    if (id != -1 && daemon->wallpaper->pool) {
+        weighted_pool_update(daemon->wallpaper->pool, id);
+    }
+
+    // The file is still there until the trash is done, so next must not
+    // set it
+    if (daemon->staged_id != -1 && strcmp(path, daemon->staged_path) == 0) {
+        daemon->staged_id = -1;
+        daemon->staged_path[0] = '\0';
+
+        if (strcmp(path, current) != 0) {
+            stage_next(daemon, daemon->staged_brightness);
+        }
+    }
+
+    if (strcmp(path, current) == 0) {
+        handle_pick(daemon, "", false, reply);
+    }
+    else {
+        g_string_append(reply, "OK\n");
+    }
+}
+
+/**
+  Handle the rate request.
+
+  @param[in] daemon The daemon.
+  @param[in] argument The change of the rating, optionally followed by the
+             file to rate instead of the current wallpaper.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_rate(struct daemon *daemon, char *argument, GString *reply) {
+    int delta, id, rating;
+    char *file;
+    char path[PATH_MAX];
+
+    delta = strtol(argument, &file, 10);
+
+    if (file == argument || (*file && *file != ' ')) {
+        g_string_append(reply, "ERR Invalid rating change\n");
+        return;
+    }
+
+    if (get_current(daemon, file + strspn(file, " "), path) == -1) {
+        g_string_append(reply, "ERR Failed to get the wallpaper\n");
+        return;
+    }
+
+    if ((id = get_wallpaper_id(daemon->ctx, path)) == -1) {
+        g_string_append_printf(reply, "ERR %s is not in the database\n", path);
+        return;
+    }
+
+    if (rate_wallpaper(daemon->ctx, id, delta, &rating) == -1) {
+        g_string_append(reply, "ERR Failed to rate the wallpaper\n");
+        return;
+    }
+
+    if (daemon->wallpaper->pool) {
+        weighted_pool_update(daemon->wallpaper->pool, id);
+    }
+
+    g_string_append_printf(reply, "OK %d\n", rating);
+}
+
+/**
+  Handle the status request.
+
+  The reply consists of tab separated key=value fields.
+
+  @param[in] daemon The daemon.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_status(struct daemon *daemon, GString *reply) {
+    long long next_rotation = -1;
+    long long next_phase = -1;
+    char current[PATH_MAX] = "";
+
+    if (daemon->timer) {
+        next_rotation = (daemon->next_rotation - g_get_monotonic_time()) /
+            G_USEC_PER_SEC;
+    }
+
+    if (daemon->next_phase != -1 && daemon->phase_source) {
+        next_phase = daemon->next_phase - time(NULL);
+    }
+
+    get_requested_background(daemon->writer, current);
+
+    g_string_append_printf(reply,
+            "OK base=%s\tbrightness=%d\tweighted=%d\tcontinuous=%d\t" \
+            "interval=%u\tnext_rotation=%lld\tnext_phase=%lld\t" \
+            "current=%s\tstaged=%s\n",
+            daemon->base,
+            get_default_brightness(daemon),
+            daemon->wallpaper->pool != NULL,
+            daemon->arguments->continuous,
+            daemon->arguments->interval,
+            next_rotation,
+            next_phase,
+            current,
+            daemon->staged_id != -1 ? daemon->staged_path : "");
+}
+
+/**
+  Handle the rescan request.
+
+  The daemon does not answer other requests while it scans.
+
+  @param[in] daemon The daemon.
+  @param[out] reply The reply line is appended to this string.
+ */
+void handle_rescan(struct daemon *daemon, GString *reply) {
+    int found;
+
+    if ((found = scan_dir(daemon->ctx, daemon->base,
+                    daemon->arguments->recursion)) == -1) {
+        g_string_append(reply, "ERR The scan failed\n");
+        return;
+    }
+
+    // Load the weights of the new wallpapers too
+    if (daemon->wallpaper->pool) {
+        reset_pool(daemon, daemon->wallpaper->pool->brightness);
+    }
+
+    g_string_append_printf(reply, "OK %d\n", found);
+}
+
+/**
+  Return the wallpaper state for a request.
+
+  @param[in] daemon The daemon.
+  @param[in] dir The directory of the request, or empty for the base
+             directory of the daemon.
+  @param[in] brightness The brightness of the request.
+  @return Returns the wallpaper state, or NULL if `dir` is not accessible.
+ */
+struct wallpaper_state *get_state(struct daemon *daemon, const char *dir,
+        int brightness) {
+    char real_dir[PATH_MAX];
+    struct wallpaper_state *state = daemon->wallpaper;
+
+    if (*dir) {
+        if (realpath(dir, real_dir) == NULL) {
+            return NULL;
+        }
+
+        // Other directories use the rotation instead of a pool
+        if (strcmp(real_dir, daemon->base) != 0) {
+            strlcpy(daemon->other_dir, real_dir, sizeof daemon->other_dir);
+            return &daemon->other;
+        }
+    }
+
+    if (state->pool && state->pool->brightness != brightness) {
+        reset_pool(daemon, brightness);
+    }
+
+    return state;
+}
+
+/**
+  Replace the pool for --weighted, so that its weights are loaded again.
+
+  @param[in] daemon The daemon.
+  @param[in] brightness The brightness of the new pool.
+ */
+void reset_pool(struct daemon *daemon, int brightness) {
+    struct wallpaper_state *state = daemon->wallpaper;
+
+    weighted_pool_free(state->pool);
+
+    if ( !(state->pool = weighted_pool_new(daemon->ctx, state->dir, brightness)) ) {
+        fprintf(stderr, "Error: out of memory; using the rotation\n");
+    }
+}
+
+/**
+  Set the path of the wallpaper that a request is about.
+
+  @param[in] daemon The daemon.
+  @param[in] argument The path from the request, or empty for the current
+             wallpaper.
+  @param[out] path Is set to the path of the wallpaper.
+  @return Returns 0 on success, -1 on error.
+ */
+int get_current(struct daemon *daemon, char *argument, char *path) {
+    if (*argument) {
+        return realpath(argument, path) ? 0 : -1;
+    }
+
+    return get_requested_background(daemon->writer, path) == 0 ? 0 : -1;
+}
+
+/**
+  Return the brightness for requests that don't specify one.
+
+  With --time this follows the time of day, so it is determined again for
+  each request.
+
+  @param[in] daemon The daemon.
+  @return Returns the brightness value, or -1 for any brightness.
+ */
+int get_default_brightness(struct daemon *daemon) {
+    struct arguments *arguments = daemon->arguments;
+
+    if (!arguments->time) {
+        return -1;
+    }
+
+    if (arguments->brightness != -1) {
+        return arguments->brightness;
+    }
+
+    return get_local_brightness(arguments->latitude, arguments->longitude);
+}
+
+/**
+  Start the rotation timer for a whole interval.
+
+  @param[in] daemon The daemon.
+ */
+void restart_timer(struct daemon *daemon) {
+    guint seconds = daemon->arguments->interval * 60;
+
+    if (daemon->timer) {
+        g_source_remove(daemon->timer);
+        daemon->timer = 0;
+    }
+
+    if (seconds == 0) {
+        return;
+    }
+
+    daemon->timer = g_timeout_add_seconds(seconds, on_rotation_timer, daemon);
+    daemon->next_rotation = g_get_monotonic_time() +
+        (gint64)seconds * G_USEC_PER_SEC;
+}
+
+/**
+  Change the wallpaper when the brightness changes with --time.
+
+  A timerfd on the real time clock is armed for the next sunrise, sunset,
+  or start or end of civil twilight, so that the daemon sleeps until then.
+  Because the time is absolute, the timer also fires right after a resume
+  from suspend if the change was missed, and it is canceled when the clock
+  is set, after which the change is computed again. Nothing is done with a
+  fixed --brightness.
+
+  @param[in] daemon The daemon.
+ */
+void start_phase_timer(struct daemon *daemon) {
+    struct arguments *arguments = daemon->arguments;
+
+    if (!arguments->time || arguments->brightness != -1) {
+        return;
+    }
+
+    if ((daemon->phase_fd = timerfd_create(CLOCK_REALTIME,
+                    TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        perror("timerfd_create");
+        return;
+    }
+
+    daemon->phase_brightness = get_default_brightness(daemon);
+    daemon->phase_source = g_unix_fd_add(daemon->phase_fd, G_IO_IN,
+            on_phase_timer, daemon);
+    arm_phase_timer(daemon);
+}
+
+/**
+  Arm the timerfd of start_phase_timer() for the next brightness change.
+
+  @param[in] daemon The daemon.
+ */
+void arm_phase_timer(struct daemon *daemon) {
+    struct arguments *arguments = daemon->arguments;
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+
+    daemon->next_phase = get_next_brightness_change(arguments->latitude,
+            arguments->longitude, time(NULL));
+    spec.it_value.tv_sec = daemon->next_phase;
+
+    if (daemon->next_phase == -1 || timerfd_settime(daemon->phase_fd,
+                TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec,
+                NULL) == -1) {
+        fprintf(stderr, "Error: Cannot set the brightness timer\n");
+        daemon->next_phase = -1;
+    }
+}
+
+/* Set a wallpaper for the new brightness, and wait for the next change */
+gboolean on_phase_timer(gint fd, GIOCondition condition, gpointer data) {
+    struct daemon *daemon = data;
+    uint64_t expirations;
+    int brightness;
+    GString *reply;
+
+    // Fails with ECANCELED if the clock was set; check the brightness anyway
+    if (read(fd, &expirations, sizeof expirations) == -1 &&
+            errno != ECANCELED) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    brightness = get_default_brightness(daemon);
+
+    if (brightness != daemon->phase_brightness) {
+        daemon->phase_brightness = brightness;
+
+        reply = g_string_new(NULL);
+        handle_pick(daemon, "", false, reply);
+        eprintf("Brightness changed to %d: %s", brightness, reply->str);
+        g_string_free(reply, TRUE);
+    }
+
+    arm_phase_timer(daemon);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+  Write the snapshot DAEMON_SNAPSHOT_DELAY seconds from now if it is stale.
+
+  Removals leave the snapshot stale, see nextwall_sync_snapshot(). Writing
+  it takes a while for a large database, so this waits for a burst of
+  requests to end rather than writing it for each request.
+
+  @param[in] daemon The daemon.
+ */
+void sync_snapshot_later(struct daemon *daemon) {
+    if (!daemon->snapshot_timer) {
+        daemon->snapshot_timer = g_timeout_add_seconds(DAEMON_SNAPSHOT_DELAY,
+                on_snapshot_timer, daemon);
+    }
+}
+
+/* Write the snapshot if it is stale */
+gboolean on_snapshot_timer(gpointer data) {
+    struct daemon *daemon = data;
+
+    daemon->snapshot_timer = 0;
+    nextwall_sync_snapshot(daemon->ctx);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+  Select the next wallpaper for the base directory ahead of time.
+
+  The wallpaper is selected as usual, which checks that its file exists,
+  and then prepared in a worker thread, see prefetch_thread(). The next
+  request to set a wallpaper for the base directory sets it, unless the
+  brightness changed in the meantime.
+
+  @param[in] daemon The daemon.
+  @param[in] brightness The brightness of the next wallpaper.
+ */
+void stage_next(struct daemon *daemon, int brightness) {
+    int id = -1;
+    struct wallpaper_state *state = daemon->wallpaper;
+
+    daemon->staged_id = -1;
+
+    if (select_wallpaper(daemon->ctx, state->dir, brightness, state->pool,
+                state->path, &id, daemon->staged_path) == -1) {
+        return;
+    }
+
+    daemon->staged_id = id;
+    daemon->staged_brightness = brightness;
+    prefetch_staged(daemon);
+}
+
+/**
+  Start preparing the staged wallpaper in a worker thread.
+
+  @param[in] daemon The daemon.
+ */
+void prefetch_staged(struct daemon *daemon) {
+    GTask *task;
+    struct prefetch *prefetch = g_new(struct prefetch, 1);
+
+    strlcpy(prefetch->path, daemon->staged_path, sizeof prefetch->path);
+    prefetch->cache = daemon->wallpaper->cache;
+
+    task = g_task_new(NULL, NULL, NULL, NULL);
+    g_task_set_task_data(task, prefetch, g_free);
+    g_task_run_in_thread(task, prefetch_thread);
+    g_object_unref(task);
+}
+
+/* Make the copy of a staged wallpaper in the wallpaper cache, and read the
+   file that will be set into the page cache */
+void prefetch_thread(GTask *task, gpointer source, gpointer data,
+        GCancellable *cancellable) {
+    struct prefetch *prefetch = data;
+    char background[PATH_MAX];
+
+    if (!prefetch->cache ||
+            cache_get(prefetch->cache, prefetch->path, background) == -1) {
+        strlcpy(background, prefetch->path, sizeof background);
+    }
+
+    prefetch_file(background);
+}
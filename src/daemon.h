@@ -0,0 +1,51 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NEXTWALL_DAEMON_H
+#define NEXTWALL_DAEMON_H
+
+#include <gio/gio.h>
+#include <limits.h>     /* PATH_MAX */
+#include <stdio.h>
+
+#include "database.h"
+#include "gnome.h"
+#include "nextwall.h"
+#include "options.h"
+
+/* The name of the control socket in the user's runtime directory */
+#define DAEMON_SOCKET_NAME "nextwall.sock"
+
+/* The longest request line the daemon accepts */
+#define DAEMON_REQUEST_MAX (PATH_MAX + 64)
+
+/* Seconds after a request before a stale snapshot is written, so that a
+   burst of deletes writes it once */
+#define DAEMON_SNAPSHOT_DELAY 10
+
+int get_socket_path(char *path, size_t size);
+int run_daemon(struct nextwall_ctx *ctx,
+               struct background_writer *writer,
+               struct wallpaper_state *wallpaper,
+               struct arguments *arguments);
+int send_request(const char *request, char *reply, size_t size);
+
+#endif
@@ -0,0 +1,645 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <bsd/string.h> /* strlcpy */
+#include <config.h>
+#include <glib.h>
+#include <glib-unix.h>  /* g_unix_fd_add */
+#include <limits.h>     /* PATH_MAX */
+#include <readline/history.h>
+#include <readline/readline.h>
+#include <stdio.h>
+#include <stdlib.h>     /* free */
+#include <string.h>
+#include <unistd.h>     /* STDIN_FILENO */
+
+#include "interactive.h"
+#include "removal.h"
+#include "std.h"        /* is_regular_file prefetch_file */
+
+/* A wallpaper in the history or the look-ahead queue */
+struct entry {
+    int id;                         /* The ID, or -1 if not known */
+    char path[PATH_MAX];
+};
+
+/* The last wallpapers that were shown, see push_history() */
+struct history {
+    struct entry entries[HISTORY_SIZE];
+    int end;                        /* The index after the newest entry */
+    int count;                      /* The number of entries */
+    int back;                       /* The number of steps from the newest
+                                       entry to the one shown */
+};
+
+/* The next wallpapers to show, filled by lookahead_thread() */
+struct lookahead {
+    struct entry entries[LOOKAHEAD_SIZE];
+    int start;                      /* The index of the first entry */
+    int count;                      /* The number of entries */
+    char last[PATH_MAX];            /* The last wallpaper that was queued */
+    unsigned drops;                 /* The number of drop_next() calls */
+    bool stop;                      /* Set to end the thread */
+    GMutex lock;                    /* Held while the queue is used */
+    GCond cond;                     /* Signaled when an entry is taken or
+                                       dropped, or to stop */
+    GThread *thread;
+};
+
+/* The state of the interactive mode. Readline calls on_line() without any
+   user data, so there is only one. */
+static struct {
+    struct nextwall_ctx *ctx;
+    struct background_writer *writer;
+    struct wallpaper_state *wallpaper;
+    struct removal_queue *removals; /* Moves deleted wallpapers to the trash */
+    int brightness;
+    char trash[PATH_MAX];           /* The wallpaper to move to the trash
+                                       if the user confirms, or empty */
+    char prompt[PATH_MAX + 64];     /* The current prompt */
+    struct history history;
+    struct lookahead lookahead;
+    GMainLoop *loop;
+    int status;                     /* 0, or -1 after an error */
+} session;
+
+/* Function prototypes */
+static gboolean on_input(gint fd, GIOCondition condition, gpointer data);
+static void on_line(char *input);
+static void handle_command(const char *input);
+static void set_prompt(const char *prompt);
+static int show_next(void);
+static void step_history(int step);
+static void push_history(const struct entry *entry);
+static void show_entry(const struct entry *entry);
+static int take_next(struct entry *entry);
+static void drop_next(const char *path);
+static int prepare_entry(const char *current, struct entry *entry);
+static void get_background(const char *path, char *background);
+static gpointer lookahead_thread(gpointer data);
+static void quit(int status);
+
+/**
+  Run nextwall in interactive mode.
+
+  Commands are read with readline from a main loop, so the prompt comes back
+  right away while the background is written; see request_background().
+  The mode ends at the end of input, or with the q command.
+
+  A thread keeps the next LOOKAHEAD_SIZE wallpapers selected, with their
+  copies in the wallpaper cache made and read, so that the n command only
+  has to take the first one. The last HISTORY_SIZE wallpapers shown are
+  kept for the b and f commands.
+
+  @param[in] ctx The nextwall context.
+  @param[in] writer The background writer.
+  @param[in] wallpaper The wallpaper state.
+  @param[in] brightness The brightness of the wallpapers to select, or -1.
+  @return Returns 0 when the user quits, -1 on error.
+ */
+int run_interactive(struct nextwall_ctx *ctx,
+                    struct background_writer *writer,
+                    struct wallpaper_state *wallpaper,
+                    int brightness) {
+    guint source;
+
+    session.ctx = ctx;
+    session.writer = writer;
+    session.wallpaper = wallpaper;
+    session.removals = removal_queue_new(ctx, true);
+    session.brightness = brightness;
+    session.trash[0] = '\0';
+    session.status = 0;
+    memset(&session.history, 0, sizeof session.history);
+    memset(&session.lookahead, 0, sizeof session.lookahead);
+
+    // The current wallpaper is the first one to go back to
+    if (get_requested_background(writer, wallpaper->current) == 0) {
+        struct entry entry = { .id = -1 };
+
+        strlcpy(entry.path, wallpaper->current, sizeof entry.path);
+        push_history(&entry);
+        strlcpy(session.lookahead.last, entry.path,
+                sizeof session.lookahead.last);
+    }
+
+    g_mutex_init(&session.lookahead.lock);
+    g_cond_init(&session.lookahead.cond);
+    session.lookahead.thread = g_thread_new("lookahead", lookahead_thread,
+            &session.lookahead);
+
+    fprintf(stderr,
+            "Nextwall %s\n" \
+            "License: GNU GPL version 3 or later " \
+            "<http://gnu.org/licenses/gpl.html>\n" \
+            "Type 'help' for more information.\n",
+            PACKAGE_VERSION);
+
+    // Configure readline to auto-complete paths when the tab key is hit.
+    rl_bind_key('\t', rl_complete);
+
+    session.loop = g_main_loop_new(NULL, FALSE);
+    source = g_unix_fd_add(STDIN_FILENO, G_IO_IN | G_IO_HUP, on_input, NULL);
+    strlcpy(session.prompt, INTERACTIVE_PROMPT, sizeof session.prompt);
+    rl_callback_handler_install(session.prompt, on_line);
+
+    g_main_loop_run(session.loop);
+
+    g_source_remove(source);
+    g_main_loop_unref(session.loop);
+
+    g_mutex_lock(&session.lookahead.lock);
+    session.lookahead.stop = true;
+    g_cond_signal(&session.lookahead.cond);
+    g_mutex_unlock(&session.lookahead.lock);
+
+    g_thread_join(session.lookahead.thread);
+    g_cond_clear(&session.lookahead.cond);
+    g_mutex_clear(&session.lookahead.lock);
+
+    removal_queue_wait(session.removals);
+    removal_queue_report(session.removals, stderr);
+    removal_queue_free(session.removals);
+
+    // Don't lose the last wallpaper that was set
+    if (flush_background(writer) == -1) {
+        fprintf(stderr, "Error: failed to set the background.\n");
+    }
+
+    return session.status;
+}
+
+/* Let readline read the input that is available */
+gboolean on_input(gint fd, GIOCondition condition, gpointer data) {
+    rl_callback_read_char();
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Handle a line of input, or the end of input if `input` is NULL */
+void on_line(char *input) {
+    // Check for EOF.
+    if (!input) {
+        // \x1b[A     -> Move cursor UP 1 line
+        // \x1b[%ldC  -> Move cursor FORWARD (right) by 'offset' columns
+        long offset = strlen(session.prompt);
+        fprintf(stderr, "\x1b[A\x1b[%ldCq\n", offset);
+        quit(0);
+        return;
+    }
+
+    // If the line has any text in it, save it on the history.
+    if (*input) {
+        add_history(input);
+    }
+
+    handle_command(input);
+    free(input);
+}
+
+/**
+  Handle a command, or the answer to the question of the d command.
+
+  @param[in] input The line of input.
+ */
+void handle_command(const char *input) {
+    int rc;
+    struct wallpaper_state *wallpaper = session.wallpaper;
+
+    removal_queue_report(session.removals, stderr);
+
+    if (session.trash[0]) {
+        if (strcmp(input, "y") == 0) {
+            // The file is moved to the trash in the background, and a
+            // failure is reported with the next command. It is removed
+            // from the database before it is dropped from the queue; see
+            // lookahead_thread().
+            removal_queue_add(session.removals, session.trash);
+            rc = removal_queue_flush(session.removals);
+            drop_next(session.trash);
+
+            if (rc == 0) {
+                eprintf("Moving %s to the trash\n", session.trash);
+            }
+
+            if (rc == 0 && show_next() == -1) {
+                quit(0);
+            }
+        }
+
+        session.trash[0] = '\0';
+        set_prompt(INTERACTIVE_PROMPT);
+        return;
+    }
+
+    // Check if the directory still exists.
+    if ( !g_file_test(wallpaper->dir, G_FILE_TEST_IS_DIR) ) {
+        fprintf(stderr, "Cannot access directory %s\n", wallpaper->dir);
+        quit(-1);
+        return;
+    }
+
+    if (strcmp(input, "d") == 0) {
+        if (get_requested_background(session.writer, wallpaper->current) != 0) {
+            fprintf(stderr, "Error: failed to get the current wallpaper\n");
+            quit(-1);
+            return;
+        }
+
+        // The next line answers the question
+        strlcpy(session.trash, wallpaper->current, sizeof session.trash);
+        snprintf(session.prompt, sizeof session.prompt,
+                "Move wallpaper %s to trash? (y/N) ", wallpaper->current);
+        set_prompt(session.prompt);
+    }
+    else if (strcmp(input, "") == 0 || strcmp(input, "n") == 0) {
+        if (show_next() == -1) {
+            quit(0);
+        }
+    }
+    else if (strcmp(input, "b") == 0) {
+        step_history(1);
+    }
+    else if (strcmp(input, "f") == 0) {
+        // Forward from the newest wallpaper is the next one
+        if (session.history.back == 0) {
+            if (show_next() == -1) {
+                quit(0);
+            }
+        }
+        else {
+            step_history(-1);
+        }
+    }
+    else if (strcmp(input, "o") == 0) {
+        if (get_requested_background(session.writer, wallpaper->current) != 0) {
+            fprintf(stderr, "Error: failed to get the current wallpaper\n");
+            quit(-1);
+            return;
+        }
+
+        open_image(wallpaper->current);
+    }
+    else if (strcmp(input, "+") == 0 || strcmp(input, "-") == 0) {
+        int id, rating;
+
+        if (get_requested_background(session.writer, wallpaper->current) != 0) {
+            fprintf(stderr, "Error: failed to get the current wallpaper\n");
+            quit(-1);
+            return;
+        }
+
+        if ((id = get_wallpaper_id(session.ctx, wallpaper->current)) == -1) {
+            fprintf(stderr, "Wallpaper %s is not in the database\n",
+                    wallpaper->current);
+        }
+        else if (rate_wallpaper(session.ctx, id, *input == '+' ? 1 : -1, &rating) == 0) {
+            if (wallpaper->pool) {
+                weighted_pool_update(wallpaper->pool, id);
+            }
+            fprintf(stderr, "Rating of %s is now %d\n",
+                    wallpaper->current, rating);
+        }
+    }
+    else if (strcmp(input, "help") == 0) {
+        fprintf(stderr,
+            "Nextwall is now running in interactive mode. The " \
+            "following commands are available:\n" \
+            "'+'\tShow the current wallpaper more often\n" \
+            "'-'\tShow the current wallpaper less often\n" \
+            "'b'\tBack to the previous wallpaper\n" \
+            "'d'\tDelete the current wallpaper\n" \
+            "'f'\tForward to the wallpaper shown after this one\n" \
+            "'n'\tNext wallpaper (default)\n" \
+            "'o'\tOpen the current wallpaper\n" \
+            "'q'\tExit nextwall\n");
+    }
+    else if (strcmp(input, "q") == 0) {
+        quit(0);
+    }
+    else {
+        fprintf(stderr,
+                "Unknown command. Type 'help' to see the " \
+                "available commands.\n");
+    }
+}
+
+/**
+  Show the next wallpaper from the look-ahead queue.
+
+  The wallpaper becomes the newest entry of the history, and less likely to
+  be selected again soon with --weighted.
+
+  @return Returns 0 on success, -1 if there is no wallpaper to show.
+ */
+int show_next(void) {
+    struct entry entry;
+
+    if (take_next(&entry) == -1) {
+        fprintf(stderr,
+                "Not enough wallpapers found. Select a different " \
+                "directory or use the --scan option.\n");
+        return -1;
+    }
+
+    if (mark_wallpaper_shown(session.ctx, entry.id) == 0 &&
+            session.wallpaper->pool) {
+        weighted_pool_update(session.wallpaper->pool, entry.id);
+    }
+
+    push_history(&entry);
+    show_entry(&entry);
+
+    return 0;
+}
+
+/**
+  Show an earlier or later wallpaper from the history.
+
+  Wallpapers whose files are gone, e.g. after the d command, are skipped.
+
+  @param[in] step 1 to go back, -1 to go forward.
+ */
+void step_history(int step) {
+    struct history *history = &session.history;
+    struct entry *entry;
+    int back = history->back;
+
+    for (back += step; back >= 0 && back < history->count; back += step) {
+        entry = &history->entries[(history->end - 1 - back + HISTORY_SIZE) %
+            HISTORY_SIZE];
+
+        if (is_regular_file(entry->path)) {
+            history->back = back;
+            show_entry(entry);
+            return;
+        }
+    }
+
+    fprintf(stderr, "No %s wallpaper in the history\n",
+            step > 0 ? "earlier" : "later");
+}
+
+/**
+  Add a wallpaper to the history as the newest entry.
+
+  Like the history of a web browser, the entries after the one shown are
+  dropped first. The oldest entry is dropped when the history is full.
+
+  @param[in] entry The wallpaper.
+ */
+void push_history(const struct entry *entry) {
+    struct history *history = &session.history;
+
+    history->end = (history->end - history->back + HISTORY_SIZE) % HISTORY_SIZE;
+    history->count -= history->back;
+    history->back = 0;
+
+    history->entries[history->end] = *entry;
+    history->end = (history->end + 1) % HISTORY_SIZE;
+
+    if (history->count < HISTORY_SIZE) {
+        history->count++;
+    }
+}
+
+/**
+  Set a wallpaper as the background.
+
+  @param[in] entry The wallpaper.
+ */
+void show_entry(const struct entry *entry) {
+    char background[PATH_MAX];
+
+    eprintf("Setting wallpaper to %s\n", entry->path);
+
+    get_background(entry->path, background);
+
+    if (request_background(session.writer, background) == -1) {
+        fprintf(stderr, "Error: failed to set the background.\n");
+    }
+}
+
+/**
+  Take the next wallpaper from the look-ahead queue.
+
+  Wallpapers that were queued but whose files are gone by now are dropped.
+  If the queue is empty, e.g. while skipping faster than the thread can
+  fill it, the wallpaper is selected right away instead.
+
+  @param[out] entry Is set to the wallpaper.
+  @return Returns 0 on success, -1 if there is no wallpaper to show.
+ */
+int take_next(struct entry *entry) {
+    struct lookahead *queue = &session.lookahead;
+    bool found = false;
+
+    g_mutex_lock(&queue->lock);
+
+    while (!found && queue->count > 0) {
+        *entry = queue->entries[queue->start];
+        queue->start = (queue->start + 1) % LOOKAHEAD_SIZE;
+        queue->count--;
+
+        found = is_regular_file(entry->path);
+    }
+
+    // There is room for the thread to select another one
+    g_cond_signal(&queue->cond);
+    g_mutex_unlock(&queue->lock);
+
+    if (found) {
+        return 0;
+    }
+
+    if (get_requested_background(session.writer, session.wallpaper->current) != 0) {
+        fprintf(stderr, "Error: failed to get the current wallpaper\n");
+        return -1;
+    }
+
+    return prepare_entry(session.wallpaper->current, entry);
+}
+
+/**
+  Drop a wallpaper from the look-ahead queue.
+
+  Remove the wallpaper from the database first, so that the thread doesn't
+  queue it again if it is selecting it right now; see lookahead_thread().
+
+  @param[in] path The path of the wallpaper.
+ */
+void drop_next(const char *path) {
+    struct lookahead *queue = &session.lookahead;
+    struct entry *entry;
+    int i, count = 0;
+
+    g_mutex_lock(&queue->lock);
+
+    // Move the other entries to the front, keeping their order
+    for (i = 0; i < queue->count; i++) {
+        entry = &queue->entries[(queue->start + i) % LOOKAHEAD_SIZE];
+
+        if (strcmp(entry->path, path) == 0) {
+            continue;
+        }
+
+        if (count < i) {
+            queue->entries[(queue->start + count) % LOOKAHEAD_SIZE] = *entry;
+        }
+        count++;
+    }
+
+    queue->count = count;
+    queue->drops++;
+    g_cond_signal(&queue->cond);
+
+    g_mutex_unlock(&queue->lock);
+}
+
+/**
+  Select a wallpaper and prepare it to be shown.
+
+  Makes the copy of the wallpaper in the wallpaper cache, and reads the file
+  that will be set into the page cache, so that setting it is fast.
+
+  @param[in] current The path of the wallpaper not to select.
+  @param[out] entry Is set to the wallpaper.
+  @return Returns 0 on success, -1 if there is no usable wallpaper.
+ */
+int prepare_entry(const char *current, struct entry *entry) {
+    struct wallpaper_state *wallpaper = session.wallpaper;
+    char background[PATH_MAX];
+
+    entry->id = -1;
+
+    if (select_wallpaper(session.ctx, wallpaper->dir, session.brightness,
+                wallpaper->pool, current, &entry->id, entry->path) == -1) {
+        return -1;
+    }
+
+    get_background(entry->path, background);
+    prefetch_file(background);
+
+    return 0;
+}
+
+/**
+  Return the file to set as the background for a wallpaper.
+
+  This is its copy in the wallpaper cache, or the wallpaper itself if the
+  cache is not used.
+
+  @param[in] path The path of the wallpaper.
+  @param[out] background Is set to the path of the file, at most PATH_MAX
+              bytes.
+ */
+void get_background(const char *path, char *background) {
+    struct wallpaper_cache *cache = session.wallpaper->cache;
+
+    if (!cache || cache_get(cache, path, background) == -1) {
+        strlcpy(background, path, PATH_MAX);
+    }
+}
+
+/* Keep the look-ahead queue filled until it is stopped. When no wallpaper
+   can be selected, take_next() selects them itself, and the thread tries
+   again after the next command or LOOKAHEAD_RETRY seconds. */
+gpointer lookahead_thread(gpointer data) {
+    struct lookahead *queue = data;
+    struct entry entry;
+    char current[PATH_MAX];
+    unsigned drops;
+    bool deleted;
+    int rc;
+
+    g_mutex_lock(&queue->lock);
+
+    while (!queue->stop) {
+        if (queue->count == LOOKAHEAD_SIZE) {
+            g_cond_wait(&queue->cond, &queue->lock);
+            continue;
+        }
+
+        // Don't hold the lock while selecting, so that the n command
+        // can take the wallpapers that are ready
+        strlcpy(current, queue->last, sizeof current);
+        drops = queue->drops;
+        g_mutex_unlock(&queue->lock);
+
+        rc = prepare_entry(current, &entry);
+
+        g_mutex_lock(&queue->lock);
+
+        if (rc == -1) {
+            g_cond_wait_until(&queue->cond, &queue->lock,
+                    g_get_monotonic_time() + LOOKAHEAD_RETRY * G_TIME_SPAN_SECOND);
+            continue;
+        }
+
+        // The wallpaper may have been deleted and dropped from the queue
+        // while it was selected. It is gone from the database by then.
+        for (deleted = false; !deleted && drops != queue->drops; ) {
+            drops = queue->drops;
+            g_mutex_unlock(&queue->lock);
+
+            deleted = get_wallpaper_id(session.ctx, entry.path) == -1;
+
+            g_mutex_lock(&queue->lock);
+        }
+
+        if (deleted) {
+            continue;
+        }
+
+        queue->entries[(queue->start + queue->count) % LOOKAHEAD_SIZE] = entry;
+        queue->count++;
+        strlcpy(queue->last, entry.path, sizeof queue->last);
+    }
+
+    g_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+  Change the prompt for the next line of input.
+
+  @param[in] prompt The prompt.
+ */
+void set_prompt(const char *prompt) {
+    if (prompt != session.prompt) {
+        strlcpy(session.prompt, prompt, sizeof session.prompt);
+    }
+
+    rl_set_prompt(session.prompt);
+}
+
+/**
+  End the interactive mode after the current command.
+
+  @param[in] status 0, or -1 if the mode ends because of an error.
+ */
+void quit(int status) {
+    // This also keeps readline from showing the prompt again
+    rl_callback_handler_remove();
+
+    session.status = status;
+    g_main_loop_quit(session.loop);
+}
@@ -0,0 +1,46 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_INTERACTIVE_H
+#define NEXTWALL_INTERACTIVE_H
+
+#include "database.h"
+#include "gnome.h"
+#include "nextwall.h"
+
+/* The prompt of the interactive mode */
+#define INTERACTIVE_PROMPT "nextwall> "
+
+/* The number of wallpapers shown that the b command can go back to */
+#define HISTORY_SIZE 100
+
+/* The number of next wallpapers that are selected and prepared ahead */
+#define LOOKAHEAD_SIZE 8
+
+/* Seconds before the look-ahead thread tries again when no wallpaper could
+   be selected, unless a command wakes it up first */
+#define LOOKAHEAD_RETRY 5
+
+int run_interactive(struct nextwall_ctx *ctx,
+                    struct background_writer *writer,
+                    struct wallpaper_state *wallpaper,
+                    int brightness);
+
+#endif
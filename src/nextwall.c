@@ -24,14 +24,12 @@
 #include <bsd/string.h> /* strlcpy strlcat */
 #include <config.h>
 #include <errno.h>
-#include <fcntl.h>      /* open */
 #include <floatfann.h>
 #include <gio/gio.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <locale.h>
-#include <readline/history.h>
-#include <readline/readline.h>
+#include <math.h>       /* fmod */
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -42,11 +40,15 @@
 #include <unistd.h>
 
 #include "cfgpath.h"
+#include "daemon.h"
+#include "interactive.h"
 #include "nextwall.h"
 #include "database.h"
 #include "options.h"
+#include "removal.h"
 #include "gnome.h"
-#include "sunriset.h"
+#include "slideshow.h"
+#include "solar.h"
 #include "std.h"
 
 extern int errno;
@@ -54,31 +56,55 @@ extern int errno;
 /* Define the global variable for verbosity */
 int nextwall_verbose = 0;
 
+/* Function prototypes */
+static int print_wallpapers(struct nextwall_ctx *ctx,
+                            struct wallpaper_state *wallpaper,
+                            int brightness,
+                            struct arguments *arguments);
+
 int main(int argc, char **argv) {
-    int rc = -1;
     int local_brightness = -1;
     int exit_status = EXIT_SUCCESS;
-    unsigned seed;
     char *ann_path = NULL;
     char user_data_path[PATH_MAX];
     char current_wallpaper_path[PATH_MAX] = "\0";
     char db_path[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    char cache_dir[PATH_MAX];
     char wallpaper_path[PATH_MAX] = "\0";
     struct arguments arguments;
-    struct fann *ann = NULL;
+    struct wallpaper_cache cache;
     GSettings *settings = NULL;
-    sqlite3 *db = NULL;
+    struct background_writer *writer = NULL;
+    struct nextwall_ctx *ctx = NULL;
 
     /* Default argument values */
     arguments.brightness = -1;
+    arguments.cache_size = -1;
+    arguments.continuous = 0;
+    arguments.count = 0;
+    arguments.daemon = 0;
+    arguments.export_slideshow = NULL;
+    arguments.height = 0;
     arguments.interactive = 0;
+    arguments.interval = 0;
+    arguments.json = 0;
     arguments.latitude = -1;
     arguments.longitude = -1;
+    arguments.maintain = 0;
+    arguments.null = 0;
     arguments.print = false;
     arguments.recursion = 0;
+    arguments.remove_from = NULL;
     arguments.scan = 0;
+    arguments.scan_from = NULL;
     arguments.time = 0;
+    arguments.timing = 0;
     arguments.verbose = 0;
+    arguments.weighted = 0;
+    arguments.width = 0;
+
+    print_timing(false, NULL);
 
     /* Set the locale to something that works with FANN configuration files. */
     setlocale(LC_ALL, "C");
@@ -86,19 +112,101 @@ int main(int argc, char **argv) {
     /* Parse arguments; every option seen by parse_opt will be reflected
        in arguments. */
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    print_timing(arguments.timing, "arguments");
 
     /* Define the wallpaper state */
     struct wallpaper_state wallpaper = {
         arguments.args[0],
         current_wallpaper_path,
-        wallpaper_path
+        wallpaper_path,
+        -1,
+        NULL,
+        NULL
     };
 
-    if (!g_file_test(wallpaper.dir, G_FILE_TEST_IS_DIR)) {
+    /* Whether nextwall only selects one wallpaper and exits */
+    bool one_shot = !arguments.daemon && !arguments.export_slideshow &&
+        !arguments.interactive && !arguments.maintain &&
+        !arguments.remove_from && !arguments.scan && !arguments.scan_from;
+
+    if (!arguments.maintain && !arguments.remove_from && !arguments.scan_from &&
+            !g_file_test(wallpaper.dir, G_FILE_TEST_IS_DIR)) {
         fprintf(stderr, "Cannot access directory %s\n", wallpaper.dir);
         goto Return_failure;
     }
 
+    /* Get local brightness */
+    if (arguments.time && !arguments.maintain && !arguments.remove_from &&
+            !arguments.scan && !arguments.scan_from) {
+        if (arguments.brightness == -1)
+            local_brightness = get_local_brightness(arguments.latitude,
+                    arguments.longitude);
+        else
+            local_brightness = arguments.brightness;
+
+        switch (local_brightness) {
+            case 0:
+                eprintf("Selecting wallpaper for night.\n");
+                break;
+            case 1:
+                eprintf("Selecting wallpapers for twilight.\n");
+                break;
+            case 2:
+                eprintf("Selecting wallpaper for day.\n");
+                break;
+            default:
+                fprintf(stderr, "Error: Could not determine the local " \
+                        "brightness value.\n");
+
+                goto Return_failure;
+        }
+    }
+    else if (arguments.continuous && !arguments.maintain &&
+            !arguments.remove_from && !arguments.scan && !arguments.scan_from) {
+        eprintf("Selecting wallpapers for a sun altitude of %.1f degrees.\n",
+                solar_elevation(arguments.latitude, arguments.longitude,
+                    time(NULL)));
+    }
+
+    /* Let a running daemon select the wallpaper, which saves the work of
+       starting up. Requests cannot ask for --continuous, --weighted, a
+       cache size, a resolution, or several wallpapers, so a run with any of
+       those doesn't use the daemon, which has its own settings. */
+    if (one_shot && !arguments.continuous && !arguments.count &&
+            !arguments.weighted && arguments.cache_size == -1 &&
+            !arguments.width) {
+        char dir[PATH_MAX];
+        char request[DAEMON_REQUEST_MAX];
+        char reply[DAEMON_REQUEST_MAX];
+
+        if (realpath(wallpaper.dir, dir) == NULL ||
+                snprintf(request, sizeof request, "%s %d %s",
+                    arguments.print ? "pick" : "next",
+                    local_brightness, dir) >= (int)sizeof request) {
+            request[0] = '\0';
+        }
+
+        switch (request[0] ? send_request(request, reply, sizeof reply) : -1) {
+            case 0:
+                if (arguments.print) {
+                    fprintf(stdout, "%s", reply);
+                }
+                else {
+                    eprintf("Setting wallpaper to %s\n", reply);
+                }
+                goto Return;
+            case 1:
+                fprintf(stderr, "Error: %s\n", reply);
+                goto Return_failure;
+        }
+
+        print_timing(arguments.timing, "daemon");
+    }
+
+    if (arguments.cache_size == -1) {
+        arguments.cache_size = CACHE_SIZE_DEFAULT;
+    }
+
     /* Set the user specific data storage folder. The folder is automatically
        created if it doesn't already exist. */
     get_user_data_folder(user_data_path, sizeof user_data_path, "nextwall");
@@ -117,8 +225,110 @@ int main(int argc, char **argv) {
         goto Too_long;
     }
 
-    /* Find the location of the ANN file */
-    if (arguments.scan) {
+    /* Set the path of the snapshot for fast selection */
+    if (snprintf(snapshot_path, sizeof snapshot_path, "%snextwall.snap",
+                user_data_path) >= (int)sizeof snapshot_path) {
+        goto Too_long;
+    }
+
+    /* Print a wallpaper with as little work as possible: a read-only
+       database connection, and no GSettings. That leaves the rotation and
+       the time the wallpaper was shown alone, so the same wallpaper may be
+       printed again, or be the current background. With --weighted, the
+       times are what the selection is based on, so the normal path below
+       selects and records it. That path also creates or updates the
+       database first if needed. */
+    if (one_shot && arguments.print && !arguments.weighted &&
+            (ctx = nextwall_open_readonly(db_path))) {
+        nextwall_use_snapshot(ctx, snapshot_path);
+        print_timing(arguments.timing, "database");
+
+        if (arguments.continuous) {
+            nextwall_use_location(ctx, arguments.latitude, arguments.longitude);
+        }
+
+        if (arguments.count) {
+            if (print_wallpapers(ctx, &wallpaper, local_brightness,
+                        &arguments) <= 0) {
+                goto Return_failure;
+            }
+            print_timing(arguments.timing, "select");
+            goto Return;
+        }
+
+        if (peek_wallpaper(ctx, wallpaper.dir, local_brightness, wallpaper.pool,
+                    wallpaper.path) == -1) {
+            fprintf(stderr,
+                    "No wallpapers found for directory %s. Try the " \
+                    "--scan option or remove the --time option.\n",
+                    wallpaper.dir);
+            goto Return;
+        }
+
+        print_timing(arguments.timing, "select");
+        fprintf(stdout, "%s", wallpaper.path);
+        goto Return;
+    }
+
+    /* Open the nextwall context; this creates or updates the database */
+    if ( !g_file_test(db_path, G_FILE_TEST_IS_REGULAR) ) {
+        eprintf("Creating database...\n");
+    }
+
+    if ( !(ctx = nextwall_open(db_path)) ) {
+        goto Return_failure;
+    }
+
+    /* Keep the snapshot up to date for the next --print */
+    nextwall_use_snapshot(ctx, snapshot_path);
+
+    if (arguments.continuous) {
+        nextwall_use_location(ctx, arguments.latitude, arguments.longitude);
+    }
+
+    print_timing(arguments.timing, "database");
+
+    /* Maintain the database and print its statistics */
+    if (arguments.maintain) {
+        if (nextwall_maintain(ctx, stdout) == -1) {
+            goto Return_failure;
+        }
+        goto Return;
+    }
+
+    /* Remove the wallpapers listed in a file or on standard input */
+    if (arguments.remove_from) {
+        int listed, failed;
+        FILE *stream = stdin;
+        struct removal_queue *removals;
+
+        if (strcmp(arguments.remove_from, "-") != 0 &&
+                !(stream = fopen(arguments.remove_from, "r"))) {
+            fprintf(stderr, "Cannot open %s: %s\n", arguments.remove_from,
+                    strerror(errno));
+            goto Return_failure;
+        }
+
+        removals = removal_queue_new(ctx, true);
+        listed = remove_list(removals, stream);
+        if (stream != stdin) {
+            fclose(stream);
+        }
+
+        removal_queue_wait(removals);
+        failed = removal_queue_report(removals, stderr);
+        fprintf(stderr, "Removed %d wallpapers and moved %d files to the " \
+                "trash\n", removals->removed, removals->trashed);
+        removal_queue_free(removals);
+
+        if (listed == -1 || failed > 0) {
+            goto Return_failure;
+        }
+        goto Return;
+    }
+
+    /* Find the location of the ANN file; the daemon uses it to rescan */
+    if (arguments.scan || arguments.scan_from || arguments.daemon) {
         int i, ann_found;
         char *ann_paths[3];
 
@@ -137,7 +347,9 @@ int main(int argc, char **argv) {
                 eprintf("Using ANN %s\n", ann_paths[i]);
 
                 /* Initialize the ANN */
-                ann = fann_create_from_file(ann_paths[i]);
+                if (nextwall_load_ann(ctx, ann_paths[i]) == -1) {
+                    goto Return_failure;
+                }
 
                 break;
             }
@@ -146,81 +358,86 @@ int main(int argc, char **argv) {
         if (!ann_found) {
             fprintf(stderr, "Error: Could not find ANN file nextwall.net\n");
 
-            goto Return_failure;
+            if (!arguments.daemon) {
+                goto Return_failure;
+            }
         }
     }
 
-    /* Create the database if it doesn't exist */
-    if ( !g_file_test(db_path, G_FILE_TEST_IS_REGULAR) ) {
-        eprintf("Creating database... ");
-        if ( (rc = sqlite3_open(db_path, &db)) == SQLITE_OK && \
-                create_database(db) == 0 ) {
-            eprintf("Done\n");
-        }
-        else {
-            eprintf("Failed\n");
-            fprintf(stderr, "Error: Creating database failed.\n");
+    /* Search directory for wallpapers */
+    if (arguments.scan) {
+        int found;
 
+        fprintf(stderr, "Scanning for new wallpapers...\n");
+        if ((found = scan_dir(ctx, wallpaper.dir, arguments.recursion)) == -1) {
             goto Return_failure;
         }
+        fprintf(stderr, "\nFound %d new wallpapers\n", found);
+        goto Return;
     }
 
-    /* Open database connection */
-    if ( rc != SQLITE_OK ) {
-        if ( sqlite3_open(db_path, &db) != SQLITE_OK ) {
-            fprintf(stderr, "Error: Can't open database: %s\n",
-                    sqlite3_errmsg(db));
+    /* Scan the files listed in a file or on standard input */
+    if (arguments.scan_from) {
+        int found;
+        FILE *stream = stdin;
 
+        if (strcmp(arguments.scan_from, "-") != 0 &&
+                !(stream = fopen(arguments.scan_from, "r"))) {
+            fprintf(stderr, "Cannot open %s: %s\n", arguments.scan_from,
+                    strerror(errno));
             goto Return_failure;
         }
-    }
 
-    /* Search directory for wallpapers */
-    if (arguments.scan) {
-        int found;
-
-        fprintf(stderr, "Scanning for new wallpapers...\n");
-        found = scan_dir(db, wallpaper.dir, ann, arguments.recursion);
-        fann_destroy(ann);
+        fprintf(stderr, "Scanning listed files for new wallpapers...\n");
+        found = scan_list(ctx, stream);
+        if (stream != stdin) {
+            fclose(stream);
+        }
+        if (found == -1) {
+            goto Return_failure;
+        }
         fprintf(stderr, "\nFound %d new wallpapers\n", found);
         goto Return;
     }
 
-    /* Get local brightness */
-    if (arguments.time) {
-        if (arguments.brightness == -1)
-            local_brightness = get_local_brightness(arguments.latitude,
-                    arguments.longitude);
-        else
-            local_brightness = arguments.brightness;
+    /* Save a slideshow for today and let the desktop show it */
+    if (arguments.export_slideshow) {
+        char slideshow_path[PATH_MAX];
 
-        switch (local_brightness) {
-            case 0:
-                eprintf("Selecting wallpaper for night.\n");
-                break;
-            case 1:
-                eprintf("Selecting wallpapers for twilight.\n");
-                break;
-            case 2:
-                eprintf("Selecting wallpaper for day.\n");
-                break;
-            default:
-                fprintf(stderr, "Error: Could not determine the local " \
-                        "brightness value.\n");
+        if (export_slideshow(ctx, &wallpaper, &arguments,
+                    arguments.export_slideshow) == -1 ||
+                realpath(arguments.export_slideshow, slideshow_path) == NULL) {
+            goto Return_failure;
+        }
 
-                goto Return_failure;
+        settings = g_settings_new("org.gnome.desktop.background");
+
+        if (set_background_uri(settings, slideshow_path) == -1) {
+            fprintf(stderr, "Error: failed to set the background.\n");
+            goto Return_failure;
         }
+        goto Return;
     }
 
-    /* Set the seed for the random number generator */
-    if ( read(open("/dev/urandom", O_RDONLY), &seed, sizeof seed) == -1 ) {
+    if (arguments.weighted &&
+            !(wallpaper.pool = weighted_pool_new(ctx, wallpaper.dir, local_brightness))) {
+        fprintf(stderr, "Error: out of memory\n");
         goto Return_failure;
     }
 
-    srand(seed);
+    /* Print several wallpapers at once */
+    if (arguments.count) {
+        if (print_wallpapers(ctx, &wallpaper, local_brightness,
+                    &arguments) <= 0) {
+            goto Return_failure;
+        }
+        print_timing(arguments.timing, "select");
+        goto Return;
+    }
 
     /* Set the wallpaper path */
-    if ( (nextwall(db, wallpaper.dir, local_brightness, wallpaper.path)) == -1 ) {
+    if (select_wallpaper(ctx, wallpaper.dir, local_brightness, wallpaper.pool,
+                "", &wallpaper.id, wallpaper.path) == -1) {
         fprintf(stderr,
                 "No wallpapers found for directory %s. Try the " \
                 "--scan option or remove the --time option.\n",
@@ -228,105 +445,52 @@ int main(int argc, char **argv) {
         goto Return;
     }
 
-    /* Create a GSettings object for the desktop background */
-    settings = g_settings_new("org.gnome.desktop.background");
+    print_timing(arguments.timing, "select");
 
-    if (arguments.interactive) {
-        char *input;
-        char shell_prompt[100];
-        int rc;
+    /* Show copies of the wallpapers that are scaled to the screen, so that
+       the desktop doesn't have to scale them each time */
+    if (!arguments.print && arguments.cache_size > 0 &&
+            (arguments.width || get_display_resolution(&arguments.width,
+                                                       &arguments.height) == 0)) {
+        get_user_cache_folder(cache_dir, sizeof cache_dir, "nextwall");
 
-        fprintf(stderr,
-                "Nextwall %s\n" \
-                "License: GNU GPL version 3 or later " \
-                "<http://gnu.org/licenses/gpl.html>\n" \
-                "Type 'help' for more information.\n",
-                PACKAGE_VERSION);
-
-        // Configure readline to auto-complete paths when the tab key is hit.
-        rl_bind_key('\t', rl_complete);
-
-        // Set the prompt text.
-        snprintf(shell_prompt, sizeof(shell_prompt), "nextwall> ");
-
-        for(;;) {
-            // Display prompt and read input.
-            input = readline(shell_prompt);
-
-            // Check for EOF.
-            if (!input) {
-                // \x1b[A     -> Move cursor UP 1 line
-                // \x1b[%ldC  -> Move cursor FORWARD (right) by 'offset' columns
-                long offset = strlen(shell_prompt);
-                fprintf(stderr, "\x1b[A\x1b[%ldCq\n", offset);
-                break;
-            }
-
-            // If the line has any text in it, save it on the history.
-            if (input && *input) {
-                add_history(input);
-            }
-
-            // Check if the directory still exists.
-            if ( !g_file_test(wallpaper.dir, G_FILE_TEST_IS_DIR) ) {
-                fprintf(stderr, "Cannot access directory %s\n", wallpaper.dir);
-
-                goto Return_failure;
-            }
-
-            if (strcmp(input, "d") == 0) {
-                if (get_background_uri(settings, wallpaper.current) != 0) {
-                    fprintf(stderr, "Error: failed to get the current wallpaper\n");
-                    goto Return_failure;
-                }
-
-                fprintf(stderr, "Move wallpaper %s to trash? (y/N) ",
-                        wallpaper.current);
-
-                if ((input = readline("")) && strcmp(input, "y") == 0) {
-                    rc = remove_wallpaper(db, wallpaper.current, true);
-
-                    if (rc == 0 && set_wallpaper(settings, db, local_brightness, &wallpaper, false) == -1) {
-                        goto Return;
-                    }
-                }
-            }
-            else if (strcmp(input, "") == 0 || strcmp(input, "n") == 0) {
-                if (set_wallpaper(settings, db, local_brightness, &wallpaper, false) == -1) {
-                    goto Return;
-                }
-            }
-            else if (strcmp(input, "o") == 0) {
-                if (get_background_uri(settings, wallpaper.current) != 0) {
-                    fprintf(stderr, "Error: failed to get the current wallpaper\n");
-                    goto Return_failure;
-                }
+        if (cache_dir[0] == 0 ||
+                strlcat(cache_dir, "wallpapers/", sizeof cache_dir) >= sizeof cache_dir ||
+                cache_init(&cache, cache_dir, arguments.width, arguments.height,
+                    (off_t)arguments.cache_size << 20) == -1) {
+            fprintf(stderr, "Error: Unable to set up the wallpaper cache.\n");
+        }
+        else {
+            eprintf("Scaling wallpapers for %dx%d\n", arguments.width,
+                    arguments.height);
+            wallpaper.cache = &cache;
+        }
+    }
 
-                open_image(wallpaper.current);
-            }
-            else if (strcmp(input, "help") == 0) {
-                fprintf(stderr,
-                    "Nextwall is now running in interactive mode. The " \
-                    "following commands are available:\n" \
-                    "'d'\tDelete the current wallpaper\n" \
-                    "'n'\tNext wallpaper (default)\n" \
-                    "'o'\tOpen the current wallpaper\n" \
-                    "'q'\tExit nextwall\n");
-            }
-            else if (strcmp(input, "q") == 0) {
-                break;
-            }
-            else {
-                fprintf(stderr,
-                        "Unknown command. Type 'help' to see the " \
-                        "available commands.\n");
-            }
+    /* Create a GSettings object for the desktop background */
+    settings = g_settings_new("org.gnome.desktop.background");
+    writer = background_writer_new(settings);
+    print_timing(arguments.timing, "gsettings");
 
-            free(input);
+    if (arguments.daemon) {
+        if (run_daemon(ctx, writer, &wallpaper, &arguments) == -1) {
+            goto Return_failure;
         }
     }
-    else {
-        set_wallpaper(settings, db, local_brightness, &wallpaper, arguments.print);
+    else if (arguments.interactive) {
+        if (run_interactive(ctx, writer, &wallpaper, local_brightness) == -1) {
+            goto Return_failure;
+        }
+    }
+    else if (set_wallpaper(writer, ctx, local_brightness, &wallpaper,
+                arguments.print) == 0) {
+        if (arguments.print) {
+            /* Print wallpaper and exit */
+            fprintf(stdout, "%s", wallpaper.path);
+        }
+        else if (flush_background(writer) == -1) {
+            fprintf(stderr, "Error: failed to set the background.\n");
+        }
     }
 
     goto Return;
@@ -340,78 +504,224 @@ Return_failure:
     goto Return;
 
 Return:
+    print_timing(arguments.timing, "done");
+
     if (ann_path) {
         free(ann_path);
     }
+    background_writer_free(writer);
     if (settings) {
         g_object_unref(settings);
     }
-    if (db) {
-        sqlite3_close(db);
-    }
+    weighted_pool_free(wallpaper.pool);
+    nextwall_close(ctx);
 
     return exit_status;
 }
 
-/* Wrapper function for setting the wallpaper */
-int set_wallpaper(GSettings *settings,
-                  sqlite3 *db,
+/**
+  Print the time spent on a phase of the startup, for --timing.
+
+  @param[in] enabled Whether to print anything.
+  @param[in] phase The phase that just ended, or NULL to start the clock.
+ */
+void print_timing(bool enabled, const char *phase) {
+    static struct timespec start, last;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!phase) {
+        start = last = now;
+        return;
+    }
+
+    if (enabled) {
+        fprintf(stderr, "%-10s %8.3f ms  (%8.3f ms total)\n", phase,
+                (now.tv_sec - last.tv_sec) * 1e3 + (now.tv_nsec - last.tv_nsec) / 1e6,
+                (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6);
+    }
+
+    last = now;
+}
+
+/**
+  Print different wallpapers for --count.
+
+  The paths are printed one per line, or ended by a NUL character with
+  --null. With --json, the wallpapers are printed as a JSON array of
+  objects with their path, lightness and brightness instead. With
+  --weighted, the printed wallpapers are marked as shown, like
+  set_wallpaper() does.
+
+  @param[in] ctx The nextwall context.
+  @param[in] wallpaper The wallpaper state.
+  @param[in] brightness The brightness of the wallpapers, or -1 for any.
+  @param[in] arguments The command line arguments.
+  @return Returns the number of wallpapers printed, or -1 on error.
+ */
+static int print_wallpapers(struct nextwall_ctx *ctx,
+                            struct wallpaper_state *wallpaper,
+                            int brightness,
+                            struct arguments *arguments) {
+    int i, n;
+    struct wallpaper_info *wallpapers;
+
+    if ( !(wallpapers = malloc(arguments->count * sizeof *wallpapers)) ) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    n = peek_wallpapers(ctx, wallpaper->dir, brightness, wallpaper->pool,
+            wallpapers, arguments->count);
+
+    if (n == 0) {
+        fprintf(stderr,
+                "No wallpapers found for directory %s. Try the " \
+                "--scan option or remove the --time option.\n",
+                wallpaper->dir);
+    }
+    else if (n > 0 && n < arguments->count) {
+        eprintf("Found only %d different wallpapers\n", n);
+    }
+
+    if (arguments->json) {
+        fprintf(stdout, "[");
+        for (i = 0; i < n; i++) {
+            fprintf(stdout, "%s\n  {\"path\": ", i ? "," : "");
+            print_json_string(stdout, wallpapers[i].path);
+            fprintf(stdout, ", \"lightness\": %g, \"brightness\": %d}",
+                    wallpapers[i].lightness, wallpapers[i].brightness);
+        }
+        fprintf(stdout, "%s]\n", n > 0 ? "\n" : "");
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            fprintf(stdout, "%s%c", wallpapers[i].path,
+                    arguments->null ? '\0' : '\n');
+        }
+    }
+
+    /* The wallpapers are less likely to be printed again soon */
+    for (i = 0; wallpaper->pool && i < n; i++) {
+        if (mark_wallpaper_shown(ctx, wallpapers[i].id) == 0) {
+            weighted_pool_update(wallpaper->pool, wallpapers[i].id);
+        }
+    }
+
+    free(wallpapers);
+
+    return n;
+}
+
+/**
+  Select the next wallpaper and request to set it as the background.
+
+  The background is written by `writer` from the main loop, or by
+  flush_background().
+
+  @param[in] writer The background writer.
+  @param[in] ctx The nextwall context.
+  @param[in] brightness The brightness of the wallpaper, or -1 for any.
+  @param[in,out] wallpaper The wallpaper state.
+  @param[in] print_only If true, the wallpaper is only selected.
+  @return Returns 0 on success, -1 if no wallpaper was found or on error.
+ */
+int set_wallpaper(struct background_writer *writer,
+                  struct nextwall_ctx *ctx,
                   int brightness,
                   struct wallpaper_state *wallpaper,
                   bool print_only) {
-    int i;
-    int file_exists;
+    char background[PATH_MAX];
 
     /* Get the path of the current wallpaper */
-    if (get_background_uri(settings, wallpaper->current) != 0) {
+    if (get_requested_background(writer, wallpaper->current) != 0) {
         fprintf(stderr, "Error: failed to get the current wallpaper\n");
         return -1;
     }
 
     /* Make sure we select a different wallpaper and that the file exists */
-    for (i = 0; !(file_exists = g_file_test(wallpaper->path, G_FILE_TEST_IS_REGULAR)) ||
-                strcmp(wallpaper->path, wallpaper->current) == 0; i++) {
-        if (i == 5) {
-            // Give up after 5 tries.
-            fprintf(stderr,
-                    "Not enough wallpapers found. Select a different " \
-                    "directory or use the --scan option.\n");
-            return -1;
-        }
-
-        if (!file_exists) {
-            eprintf("Wallpaper '%s' no longer exists. Removing from database.\n",
-                    wallpaper->path);
-            remove_wallpaper(db, wallpaper->path, false);
-
-            /* Don't increment if the file was moved/deleted. */
-            --i;
-        }
+    if (select_wallpaper(ctx, wallpaper->dir, brightness, wallpaper->pool,
+                wallpaper->current, &wallpaper->id, wallpaper->path) == -1) {
+        fprintf(stderr,
+                "Not enough wallpapers found. Select a different " \
+                "directory or use the --scan option.\n");
+        return -1;
+    }
 
-        nextwall(db, wallpaper->dir, brightness, wallpaper->path);
+    /* The wallpaper is less likely to be selected again soon with --weighted */
+    if (mark_wallpaper_shown(ctx, wallpaper->id) == 0 && wallpaper->pool) {
+        weighted_pool_update(wallpaper->pool, wallpaper->id);
     }
 
     if (print_only) {
-        /* Print wallpaper and exit */
-        fprintf(stdout, "%s", wallpaper->path);
         return 0;
     }
 
     eprintf("Setting wallpaper to %s\n", wallpaper->path);
 
-    /* Set the new wallpaper */
-    if (set_background_uri(settings, wallpaper->path) == -1) {
+    /* Set the new wallpaper, or its copy in the cache */
+    if (!wallpaper->cache ||
+            cache_get(wallpaper->cache, wallpaper->path, background) == -1) {
+        strlcpy(background, wallpaper->path, sizeof background);
+    }
+
+    if (request_background(writer, background) == -1) {
         fprintf(stderr, "Error: failed to set the background.\n");
     }
 
     return 0;
 }
 
+/**
+  Convert a time from a solar table to local time in the format hh:mm.
+
+  @param[in] hours The time in hours UT, see struct solar_times.
+  @param[in] gmt_offset The GMT offset of the local time zone in hours.
+  @param[out] dest The local time in the format hh:mm.
+  @return Pointer to the local time.
+ */
+static char *local_hm(double hours, double gmt_offset, char *dest) {
+    return hours_to_hm(fmod(hours + gmt_offset + 48.0, 24.0), dest);
+}
+
+/**
+  Return the solar table for a location and year.
+
+  The table is kept in the user data folder, so it is only computed once a
+  year; see solar_table_load(). The last table is kept in memory.
+
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+  @param[in] year The year.
+  @return Returns the table.
+ */
+static const struct solar_table *get_solar_table(double lat, double lon,
+        int year) {
+    static struct solar_table table;
+    char path[PATH_MAX];
+
+    if (table.year == year && table.latitude == lat && table.longitude == lon) {
+        return &table;
+    }
+
+    get_user_data_folder(path, sizeof path, "nextwall");
+
+    if (path[0] == 0 || strlcat(path, "solar.tbl", sizeof path) >= sizeof path) {
+        solar_table_build(&table, lat, lon, year);
+    }
+    else {
+        solar_table_load(&table, path, lat, lon, year);
+    }
+
+    return &table;
+}
+
 /**
   Return the local brightness value.
 
-  This function uses sunriset.h to calculate sunrise, sunset, and civil
-  twilight times.
+  The sunrise, sunset, and civil twilight times are looked up in the solar
+  table for the location, see get_solar_table().
 
   @param[in] lat The latitude of the current location.
   @param[in] lon The longitude of the current location.
@@ -419,80 +729,89 @@ int set_wallpaper(GSettings *settings,
           local time. Returns -1 if brightness could not be determined.
  */
 int get_local_brightness(double lat, double lon) {
+    const struct solar_table *table;
+    const struct solar_times *times;
     struct tm ltime;
     time_t now;
-    double htime, sunrise, sunset, civ_start, civ_end;
-    int year, month, day, gmt_offset_h, rs, civ;
-    char sunrise_str[6], sunset_str[6], civ_start_str[6], civ_end_str[6];
+    double gmt_offset;
+    char start_str[6], end_str[6];
 
     time(&now);
     localtime_r(&now, &ltime);
-    year = ltime.tm_year + 1900;
-    month = ltime.tm_mon + 1;
-    day = ltime.tm_mday;
-
-    /* GMT offset in hours with local time zone */
-    gmt_offset_h = ltime.tm_gmtoff / 3600;
+    table = get_solar_table(lat, lon, ltime.tm_year + 1900);
 
-    /* Current time in hours */
-    htime = (double)ltime.tm_hour + (double)ltime.tm_min / 60.0;
+    if (!(times = solar_times(table, now, SOLAR_SUN))) {
+        return -1;
+    }
 
-    /* Set local sunrise, sunset, and civil twilight times */
-    rs = sun_rise_set(year, month, day, lon, lat, &sunrise, &sunset);
-    civ  = civil_twilight(year, month, day, lon, lat, &civ_start, &civ_end);
+    /* GMT offset in hours with local time zone, which need not be whole */
+    gmt_offset = ltime.tm_gmtoff / 3600.0;
 
-    switch (rs) {
+    switch (times[SOLAR_SUN].status) {
         case 0:
-            sunrise += gmt_offset_h;
-            sunset += gmt_offset_h;
             eprintf("Sun rises %s, sets %s %s\n",
-                    hours_to_hm(sunrise, sunrise_str),
-                    hours_to_hm(sunset, sunset_str),
+                    local_hm(times[SOLAR_SUN].start, gmt_offset, start_str),
+                    local_hm(times[SOLAR_SUN].end, gmt_offset, end_str),
                     ltime.tm_zone);
             break;
-
         case +1:
             eprintf("Sun above horizon\n");
-            return 2;
             break;
-
         case -1:
             eprintf("Sun below horizon\n");
-            return 0;
             break;
     }
 
-    switch (civ) {
+    switch (times[SOLAR_CIVIL].status) {
         case 0:
-            civ_start += gmt_offset_h;
-            civ_end += gmt_offset_h;
             eprintf("Civil twilight starts %s, ends %s %s\n",
-                    hours_to_hm(civ_start, civ_start_str),
-                    hours_to_hm(civ_end, civ_end_str),
+                    local_hm(times[SOLAR_CIVIL].start, gmt_offset, start_str),
+                    local_hm(times[SOLAR_CIVIL].end, gmt_offset, end_str),
                     ltime.tm_zone);
             break;
-
         case +1:
             eprintf("Never darker than civil twilight\n");
             break;
-
         case -1:
             eprintf("Never as bright as civil twilight\n");
             break;
     }
 
-    if (rs == 0 && civ == 0) {
-        if (sunrise < htime && htime < sunset) {
-            return 2;
-        }
-        else if (htime < civ_start || htime > civ_end) {
-            return 0;
-        }
-        else {
-            return 1;
-        }
-    }
-    else {
-        return -1;
-    }
+    return solar_brightness(table, now);
+}
+
+/**
+  Return the brightness value at a location at some time.
+
+  Unlike get_local_brightness(), this does not print the sun events.
+
+  @param[in] lat The latitude of the location.
+  @param[in] lon The longitude of the location.
+  @param[in] when The time.
+  @return Returns the brightness value, see solar_brightness().
+ */
+int get_brightness_at(double lat, double lon, time_t when) {
+    struct tm ltime;
+
+    localtime_r(&when, &ltime);
+
+    return solar_brightness(get_solar_table(lat, lon, ltime.tm_year + 1900),
+            when);
+}
+
+/**
+  Return when the local brightness value changes next.
+
+  @param[in] lat The latitude of the current location.
+  @param[in] lon The longitude of the current location.
+  @param[in] when The time to start from, usually now.
+  @return Returns the time of the change, see solar_next_change().
+ */
+time_t get_next_brightness_change(double lat, double lon, time_t when) {
+    struct tm ltime;
+
+    localtime_r(&when, &ltime);
+
+    return solar_next_change(get_solar_table(lat, lon, ltime.tm_year + 1900),
+            when);
 }
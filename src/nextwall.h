@@ -24,6 +24,11 @@
 #include <stdbool.h>
 #include <gio/gio.h>
 #include <sqlite3.h>
+#include <time.h>
+
+#include "cache.h"
+#include "database.h"
+#include "gnome.h"
 
 /* Default wallpaper directory */
 #define DEFAULT_WALLPAPER_DIR "/usr/share/backgrounds/"
@@ -38,11 +43,17 @@ struct wallpaper_state {
     char *dir;      /* Wallpaper base directory */
     char *current;  /* Current wallpaper */
     char *path;     /* Path for next wallpaper */
+    int id;         /* ID of the next wallpaper */
+    struct weighted_pool *pool; /* Weights for --weighted, or NULL */
+    struct wallpaper_cache *cache; /* Scaled copies to show, or NULL */
 };
 
 int get_local_brightness(double lat, double lon);
-int set_wallpaper(GSettings *settings,
-                  sqlite3 *db,
+int get_brightness_at(double lat, double lon, time_t when);
+time_t get_next_brightness_change(double lat, double lon, time_t when);
+void print_timing(bool enabled, const char *phase);
+int set_wallpaper(struct background_writer *writer,
+                  struct nextwall_ctx *ctx,
                   int brightness,
                   struct wallpaper_state *state,
                   bool print_only);
@@ -19,7 +19,10 @@
  */
 
 #include <argp.h>
+#include <ctype.h>      /* isdigit */
+#include <limits.h>     /* INT_MAX UINT_MAX */
 #include <stdbool.h>
+#include <stdio.h>      /* sscanf */
 #include <stdlib.h>
 #include <string.h>
 
@@ -27,6 +30,22 @@
 #include "config.h"
 #include "options.h"
 
+/* Keys for options without a short option */
+enum {
+    OPT_SCAN_FROM = 256,
+    OPT_DAEMON,
+    OPT_INTERVAL,
+    OPT_TIMING,
+    OPT_MAINTAIN,
+    OPT_RESOLUTION,
+    OPT_CACHE_SIZE,
+    OPT_REMOVE_FROM,
+    OPT_CONTINUOUS,
+    OPT_EXPORT_SLIDESHOW,
+    OPT_COUNT,
+    OPT_JSON
+};
+
 /* Set up the arguments parser */
 const char *argp_program_version = PACKAGE_VERSION;
 const char *argp_program_bug_address = PACKAGE_BUGREPORT;
@@ -42,16 +61,53 @@ static char args_doc[] = "PATH";
 static struct argp_option options[] = {
     {"brightness", 'b', "N", 0, "Select wallpapers for night (0), twilight " \
         "(1), or day (2)"},
+    {"cache-size", OPT_CACHE_SIZE, "MIB", 0, "Keep up to MIB MiB of " \
+        "wallpapers scaled to the screen, which are faster to show. Set to " \
+        "0 to show the wallpapers themselves (default: 256)"},
+    {"continuous", OPT_CONTINUOUS, 0, 0, "Select wallpapers as light as " \
+        "the sky, which gets darker gradually in the evening. Must be used " \
+        "in combination with --location"},
+    {"count", OPT_COUNT, "N", 0, "Print N different wallpaper paths, one " \
+        "per line, and exit"},
+    {"daemon", OPT_DAEMON, 0, 0, "Keep running and change the wallpaper on " \
+        "request. While the daemon runs, other nextwall commands let it " \
+        "select the wallpaper"},
+    {"export-slideshow", OPT_EXPORT_SLIDESHOW, "FILE", 0, "Save a " \
+        "slideshow of wallpapers for today to FILE and set it as the " \
+        "background, so that the desktop changes the wallpaper by itself. " \
+        "Use --time to fit the wallpapers to the time of day"},
     {"interactive", 'i', 0, 0, "Run in interactive mode"},
+    {"interval", OPT_INTERVAL, "MINUTES", 0, "Change the wallpaper every " \
+        "MINUTES minutes with --daemon or --export-slideshow (default for " \
+        "--export-slideshow: 30)"},
+    {"json", OPT_JSON, 0, 0, "Print the wallpapers as a JSON array of " \
+        "objects with their path, lightness and brightness, and exit"},
     {"location", 'l', "LAT:LON", 0, "Specify latitude and longitude of your " \
         "current location"},
-    {"print", 'p', 0, 0, "Print random wallpaper path and exit"},
+    {"maintain", OPT_MAINTAIN, 0, 0, "Check, clean up and optimize the " \
+        "database, print its statistics and exit"},
+    {"null", '0', 0, 0, "End the paths printed by --count with a NUL " \
+        "character instead of a newline"},
+    {"print", 'p', 0, 0, "Print random wallpaper path and exit. Unless " \
+        "--weighted is given, the rotation is not used, so the path may " \
+        "repeat"},
     {"recursion", 'r', 0, 0, "Causes --scan to look in subdirectories"},
+    {"remove-from", OPT_REMOVE_FROM, "FILE", 0, "Remove the wallpapers in " \
+        "the NUL-separated list of files in FILE, or standard input if FILE " \
+        "is -, from the database and move them to the trash"},
+    {"resolution", OPT_RESOLUTION, "WxH", 0, "Scale wallpapers for a " \
+        "screen of W by H pixels instead of the largest connected screen"},
     {"scan", 's', 0, 0, "Scan for images files in PATH. Also see the " \
         "--recursion option"},
+    {"scan-from", OPT_SCAN_FROM, "FILE", 0, "Scan the NUL-separated list of " \
+        "image files in FILE, or standard input if FILE is -"},
     {"time", 't', 0, 0, "Find wallpapers that fit the time of day. Must be " \
         "used in combination with --location"},
+    {"timing", OPT_TIMING, 0, 0, "Show how long each phase of the startup " \
+        "takes"},
     {"verbose", 'v', 0, 0, "Increase verbosity"},
+    {"weighted", 'w', 0, 0, "Select favourite and less recently shown " \
+        "wallpapers more often"},
     { 0 }
 };
 
@@ -62,11 +118,22 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
 
     char tmp[80];
-    char *lat, *lon;
+    char *lat, *lon, *end;
     int b;
+    unsigned long interval, cache_size, count;
 
     switch (key)
     {
+        case OPT_CACHE_SIZE:
+            if (!isdigit(*arg) || (cache_size = strtoul(arg, &end, 10)) > \
+                    INT_MAX || *end != '\0') {
+                fprintf(stderr, "Incorrect cache size\n");
+                argp_usage(state);
+                break;
+            }
+
+            arguments->cache_size = cache_size;
+            break;
         case 'b':
             if (!isdigit(*arg)) {
                 fprintf(stderr, "Incorrect brightness value\n");
@@ -84,9 +151,41 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->brightness = b;
             arguments->time = 1;
             break;
+        case OPT_CONTINUOUS:
+            arguments->continuous = 1;
+            break;
+        case OPT_COUNT:
+            if (!isdigit(*arg) || (count = strtoul(arg, &end, 10)) == 0 ||
+                    count > COUNT_MAX || *end != '\0') {
+                fprintf(stderr, "Incorrect count\n");
+                argp_usage(state);
+                break;
+            }
+
+            arguments->count = count;
+            break;
+        case OPT_DAEMON:
+            arguments->daemon = 1;
+            break;
+        case OPT_EXPORT_SLIDESHOW:
+            arguments->export_slideshow = arg;
+            break;
         case 'i':
             arguments->interactive = 1;
             break;
+        case OPT_JSON:
+            arguments->json = 1;
+            break;
+        case OPT_INTERVAL:
+            if (!isdigit(*arg) || (interval = strtoul(arg, &end, 10)) > \
+                    UINT_MAX / 60 || *end != '\0') {
+                fprintf(stderr, "Incorrect interval value\n");
+                argp_usage(state);
+                break;
+            }
+
+            arguments->interval = interval;
+            break;
         case 'l':
             arguments->location = arg;
 
@@ -107,21 +206,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 argp_usage(state);
             }
             break;
+        case OPT_MAINTAIN:
+            arguments->maintain = 1;
+            break;
+        case '0':
+            arguments->null = 1;
+            break;
         case 'p':
             arguments->print = true;
             break;
         case 'r':
             arguments->recursion = 1;
             break;
+        case OPT_REMOVE_FROM:
+            arguments->remove_from = arg;
+            break;
+        case OPT_RESOLUTION:
+            if (sscanf(arg, "%dx%d%c", &arguments->width, &arguments->height,
+                        tmp) != 2 || arguments->width <= 0 ||
+                    arguments->height <= 0) {
+                fprintf(stderr, "Incorrect resolution\n");
+                argp_usage(state);
+            }
+            break;
         case 's':
             arguments->scan = 1;
             break;
+        case OPT_SCAN_FROM:
+            arguments->scan_from = arg;
+            break;
         case 't':
             arguments->time = 1;
             break;
+        case OPT_TIMING:
+            arguments->timing = 1;
+            break;
         case 'v':
             arguments->verbose = nextwall_verbose = 1;
             break;
+        case 'w':
+            arguments->weighted = 1;
+            break;
 
         case ARGP_KEY_ARG:
             if (state->arg_num >= 1) {
@@ -142,6 +267,31 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                          "when using --time\n");
                  argp_usage(state);
             }
+            if (arguments->continuous && arguments->latitude == -1) {
+                 fprintf(stderr, "Your location must be set with --location " \
+                         "when using --continuous\n");
+                 argp_usage(state);
+            }
+            if (arguments->continuous && (arguments->time ||
+                        arguments->weighted || arguments->export_slideshow)) {
+                 fprintf(stderr, "The --continuous option cannot be used " \
+                         "with --brightness, --time, --weighted or " \
+                         "--export-slideshow\n");
+                 argp_usage(state);
+            }
+            // --json and --null print one wallpaper by default
+            if ((arguments->json || arguments->null) && !arguments->count) {
+                arguments->count = 1;
+            }
+            if (arguments->count) {
+                arguments->print = true;
+            }
+            if (arguments->interval && !arguments->daemon &&
+                    !arguments->export_slideshow) {
+                 fprintf(stderr, "The --interval option can only be used " \
+                         "with --daemon or --export-slideshow\n");
+                 argp_usage(state);
+            }
             break;
 
         default:
@@ -21,11 +21,24 @@
 #ifndef NEXTWALL_OPTIONS_H
 #define NEXTWALL_OPTIONS_H
 
+/* The most wallpapers that --count prints at once */
+#define COUNT_MAX 1000
+
 /* Used by main to communicate with parse_opt */
 struct arguments {
     char *args[1]; /* PATH argument */
+    char *export_slideshow;
     char *location;
-    int brightness, interactive, print, recursion, scan, time, verbose;
+    char *remove_from;
+    char *scan_from;
+    int brightness, continuous, daemon, interactive, json, maintain, null,
+        print, recursion, scan, time, timing, verbose, weighted;
+    int count;         /* Number of wallpapers to print, or 0 */
+    unsigned interval; /* Minutes between rotations with --daemon or
+                          --export-slideshow */
+    int cache_size;    /* Size of the wallpaper cache in MiB, or -1 for
+                          the default */
+    int width, height; /* Resolution to scale wallpapers for, or 0 */
     double latitude, longitude;
 };
 
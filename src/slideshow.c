@@ -0,0 +1,293 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     /* asprintf */
+
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h> /* g_rename g_unlink */
+#include <limits.h>     /* PATH_MAX */
+#include <math.h>       /* fmin lround */
+#include <stdio.h>
+#include <stdlib.h>     /* mkstemp */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>     /* close */
+
+#include "slideshow.h"
+
+/* A wallpaper of the slideshow and how long it is shown */
+struct slide {
+    char path[PATH_MAX];
+    double duration;                /* Seconds, including the transition
+                                       to the next slide */
+};
+
+/* Function prototypes */
+static int add_slides(struct nextwall_ctx *ctx, struct wallpaper_state *wallpaper,
+        struct weighted_pool **pools, int brightness, double duration,
+        unsigned interval, GArray *slides);
+static int write_slideshow(FILE *stream, time_t start, GArray *slides);
+
+/**
+  Export a slideshow for the desktop for the current day.
+
+  The desktop shows the wallpapers of the slideshow by itself, one after
+  the other, so that no nextwall process needs to run. The slideshow starts
+  at midnight and covers one day, after which the desktop starts it over.
+  With --time, the day is split at sunrise, sunset and the start and end of
+  civil twilight, and each part gets wallpapers that fit its brightness.
+  Since these times move a little every day, export the slideshow again
+  every day.
+
+  The file is replaced at once, so that the desktop never reads a partial
+  slideshow.
+
+  @param[in] ctx The nextwall context.
+  @param[in] wallpaper The wallpaper state, for the base directory.
+  @param[in] arguments The command line arguments.
+  @param[in] path The path of the slideshow file.
+  @return Returns 0 on success, -1 on error.
+ */
+int export_slideshow(struct nextwall_ctx *ctx,
+                     struct wallpaper_state *wallpaper,
+                     struct arguments *arguments,
+                     const char *path) {
+    int i, fd;
+    int rc = -1;
+    int closed;
+    int brightness;
+    unsigned interval;
+    char *tmp_path = NULL;
+    time_t start, end, from, to;
+    struct tm date;
+    struct weighted_pool *pools[4] = {NULL};
+    GArray *slides = g_array_new(FALSE, FALSE, sizeof(struct slide));
+    FILE *stream = NULL;
+
+    interval = (arguments->interval ? arguments->interval : SLIDESHOW_INTERVAL) * 60;
+
+    // Today from midnight to midnight, which need not be 24 hours apart
+    time(&start);
+    localtime_r(&start, &date);
+    date.tm_hour = date.tm_min = date.tm_sec = 0;
+    date.tm_isdst = -1;
+    start = mktime(&date);
+    date.tm_mday++;
+    date.tm_isdst = -1;
+    end = mktime(&date);
+
+    for (from = start; from < end; from = to) {
+        to = end;
+        brightness = arguments->brightness;
+
+        if (arguments->time && brightness == -1) {
+            brightness = get_brightness_at(arguments->latitude,
+                    arguments->longitude, from);
+            to = get_next_brightness_change(arguments->latitude,
+                    arguments->longitude, from);
+
+            if (brightness == -1 || to == -1) {
+                fprintf(stderr, "Error: Could not determine the local " \
+                        "brightness value.\n");
+                goto Return;
+            }
+
+            if (to > end) {
+                to = end;
+            }
+        }
+
+        if (add_slides(ctx, wallpaper, arguments->weighted ? pools : NULL,
+                    brightness, to - from, interval, slides) == -1) {
+            goto Return;
+        }
+    }
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+        tmp_path = NULL;
+        fprintf(stderr, "Error: out of memory\n");
+        goto Return;
+    }
+
+    if ((fd = mkstemp(tmp_path)) == -1 || !(stream = fdopen(fd, "w"))) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            g_unlink(tmp_path);
+        }
+        goto Return;
+    }
+
+    if (write_slideshow(stream, start, slides) == -1) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        goto Return;
+    }
+
+    closed = fclose(stream);
+    stream = NULL;
+
+    if (closed != 0 || g_rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        g_unlink(tmp_path);
+        goto Return;
+    }
+
+    eprintf("Exported a slideshow of %u wallpapers to %s\n", slides->len, path);
+    rc = 0;
+
+    goto Return;
+
+Return:
+    if (stream) {
+        fclose(stream);
+        g_unlink(tmp_path);
+    }
+    for (i = 0; i < 4; i++) {
+        weighted_pool_free(pools[i]);
+    }
+    g_array_free(slides, TRUE);
+    free(tmp_path);
+
+    return rc;
+}
+
+/**
+  Add the slides for a part of the day with the same brightness.
+
+  The part is divided evenly into slides of about `interval` seconds, with
+  a different wallpaper for each.
+
+  @param[in] ctx The nextwall context.
+  @param[in] wallpaper The wallpaper state, for the base directory.
+  @param[in,out] pools The pool for each brightness value and -1, which
+                 are created when first needed, or NULL to select from the
+                 rotation.
+  @param[in] brightness The brightness value, or -1 for any.
+  @param[in] duration The seconds of the part.
+  @param[in] interval The seconds each wallpaper is shown.
+  @param[in,out] slides The slides to add to.
+  @return Returns 0 on success, -1 if no wallpaper was found or on error.
+ */
+int add_slides(struct nextwall_ctx *ctx, struct wallpaper_state *wallpaper,
+        struct weighted_pool **pools, int brightness, double duration,
+        unsigned interval, GArray *slides) {
+    int i, n, id;
+    struct slide slide;
+    struct weighted_pool *pool = NULL;
+    const char *previous = "";
+
+    if (pools && !(pool = pools[brightness + 1]) &&
+            !(pool = pools[brightness + 1] = weighted_pool_new(ctx,
+                    wallpaper->dir, brightness))) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    if ((n = lround(duration / interval)) < 1) {
+        n = 1;
+    }
+
+    slide.duration = duration / n;
+
+    for (i = 0; i < n; i++) {
+        if (slides->len > 0) {
+            previous = g_array_index(slides, struct slide, slides->len - 1).path;
+        }
+
+        // Show the previous wallpaper again if it is the only one
+        id = -1;
+        if (select_wallpaper(ctx, wallpaper->dir, brightness, pool, previous,
+                    &id, slide.path) == -1 &&
+                select_wallpaper(ctx, wallpaper->dir, brightness, pool, "",
+                    &id, slide.path) == -1) {
+            fprintf(stderr, "No wallpapers found for directory %s and " \
+                    "brightness %d.\n", wallpaper->dir, brightness);
+            return -1;
+        }
+
+        g_array_append_val(slides, slide);
+    }
+
+    return 0;
+}
+
+/**
+  Write a slideshow in the XML format of the GNOME desktop.
+
+  Each slide is shown for its duration, the last SLIDESHOW_TRANSITION
+  seconds of which it fades to the next slide. The last slide fades to the
+  first one.
+
+  @param[in] stream The stream to write to.
+  @param[in] start The local time at which the first slide starts.
+  @param[in] slides The slides.
+  @return Returns 0 on success, -1 on error.
+ */
+int write_slideshow(FILE *stream, time_t start, GArray *slides) {
+    guint i;
+    double transition;
+    struct tm date;
+    struct slide *slide, *next;
+    char *path, *next_path;
+
+    localtime_r(&start, &date);
+
+    fprintf(stream, "<background>\n" \
+            "  <starttime>\n" \
+            "    <year>%d</year>\n" \
+            "    <month>%02d</month>\n" \
+            "    <day>%02d</day>\n" \
+            "    <hour>%02d</hour>\n" \
+            "    <minute>%02d</minute>\n" \
+            "    <second>%02d</second>\n" \
+            "  </starttime>\n",
+            date.tm_year + 1900, date.tm_mon + 1, date.tm_mday,
+            date.tm_hour, date.tm_min, date.tm_sec);
+
+    for (i = 0; i < slides->len; i++) {
+        slide = &g_array_index(slides, struct slide, i);
+        next = &g_array_index(slides, struct slide, (i + 1) % slides->len);
+
+        // A short slide spends at most half of its time fading
+        transition = fmin(SLIDESHOW_TRANSITION, slide->duration / 2);
+        path = g_markup_escape_text(slide->path, -1);
+        next_path = g_markup_escape_text(next->path, -1);
+
+        fprintf(stream, "  <static>\n" \
+                "    <duration>%.1f</duration>\n" \
+                "    <file>%s</file>\n" \
+                "  </static>\n" \
+                "  <transition>\n" \
+                "    <duration>%.1f</duration>\n" \
+                "    <from>%s</from>\n" \
+                "    <to>%s</to>\n" \
+                "  </transition>\n",
+                slide->duration - transition, path, transition, path,
+                next_path);
+
+        g_free(path);
+        g_free(next_path);
+    }
+
+    fprintf(stream, "</background>\n");
+
+    return ferror(stream) ? -1 : 0;
+}
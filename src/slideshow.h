@@ -0,0 +1,41 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NEXTWALL_SLIDESHOW_H
+#define NEXTWALL_SLIDESHOW_H
+
+#include "database.h"
+#include "nextwall.h"
+#include "options.h"
+
+/* Minutes each wallpaper of an exported slideshow is shown, unless
+   --interval is given */
+#define SLIDESHOW_INTERVAL 30
+
+/* Seconds the desktop takes to fade from one wallpaper of an exported
+   slideshow to the next */
+#define SLIDESHOW_TRANSITION 5.0
+
+int export_slideshow(struct nextwall_ctx *ctx,
+                     struct wallpaper_state *wallpaper,
+                     struct arguments *arguments,
+                     const char *path);
+
+#endif
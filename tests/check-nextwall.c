@@ -13,7 +13,23 @@
  */
 
 #include <check.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cache.h"
+#include "database.h"
+#include "fenwick.h"
+#include "maintain.h"
+#include "snapshot.h"
+#include "solar.h"
 #include "std.h"
 
 START_TEST(test_floatcmp) {
@@ -32,15 +48,489 @@ START_TEST(test_floatcmp) {
 }
 END_TEST
 
+START_TEST(test_get_path_range) {
+    char lower[16];
+    char upper[16];
+
+    ck_assert( get_path_range("/walls", lower, upper, sizeof lower) == 0 );
+    ck_assert_str_eq( lower, "/walls/" );
+    ck_assert_str_eq( upper, "/walls0" );
+
+    /* Sibling directories sharing the prefix are outside the range */
+    ck_assert( strcmp("/walls2/a.jpg", upper) >= 0 );
+    ck_assert( strcmp("/walls/2/a.jpg", lower) >= 0 );
+    ck_assert( strcmp("/walls/2/a.jpg", upper) < 0 );
+
+    ck_assert( get_path_range("/walls/", lower, upper, sizeof lower) == 0 );
+    ck_assert_str_eq( lower, "/walls/" );
+
+    ck_assert( get_path_range("/", lower, upper, sizeof lower) == 0 );
+    ck_assert_str_eq( lower, "/" );
+    ck_assert_str_eq( upper, "0" );
+
+    ck_assert( get_path_range("/a/very/long/path", lower, upper,
+                sizeof lower) == -1 );
+}
+END_TEST
+
+START_TEST(test_split_path) {
+    char dir[16];
+    const char *name;
+
+    ck_assert( split_path("/walls/a.jpg", dir, sizeof dir, &name) == 0 );
+    ck_assert_str_eq( dir, "/walls" );
+    ck_assert_str_eq( name, "a.jpg" );
+
+    ck_assert( split_path("/a.jpg", dir, sizeof dir, &name) == 0 );
+    ck_assert_str_eq( dir, "" );
+    ck_assert_str_eq( name, "a.jpg" );
+
+    ck_assert( split_path("a.jpg", dir, sizeof dir, &name) == -1 );
+    ck_assert( split_path("/a/very/long/path/a.jpg", dir, sizeof dir,
+                &name) == -1 );
+}
+END_TEST
+
+START_TEST(test_print_json_string) {
+    char *s;
+    size_t size;
+    FILE *stream;
+
+    ck_assert( (stream = open_memstream(&s, &size)) != NULL );
+    print_json_string(stream, "/a \"b\"\\c\nd");
+    fclose(stream);
+    ck_assert_str_eq( s, "\"/a \\\"b\\\"\\\\c\\u000ad\"" );
+    free(s);
+}
+END_TEST
+
+START_TEST(test_random_below) {
+    int i;
+    int seen[3] = {0};
+    uint64_t state = 1;
+
+    for (i = 0; i < 300; i++) {
+        long long r = random_below(3, &state);
+        ck_assert( r >= 0 && r < 3 );
+        seen[r]++;
+    }
+
+    ck_assert( seen[0] > 0 && seen[1] > 0 && seen[2] > 0 );
+    ck_assert( random_below(1, &state) == 0 );
+    ck_assert( random_below(INT64_MAX, &state) >= 0 );
+}
+END_TEST
+
+START_TEST(test_fenwick) {
+    double weights[] = {1, 0, 2, 0.5, 0};
+    struct fenwick *tree = fenwick_new(weights, 5);
+
+    ck_assert( tree != NULL );
+    ck_assert( fenwick_total(tree) == 3.5 );
+    ck_assert( fenwick_get(tree, 2) == 2 );
+
+    ck_assert( fenwick_find(tree, 0) == 0 );
+    ck_assert( fenwick_find(tree, 0.99) == 0 );
+    ck_assert( fenwick_find(tree, 1) == 2 );
+    ck_assert( fenwick_find(tree, 2.99) == 2 );
+    ck_assert( fenwick_find(tree, 3) == 3 );
+    ck_assert( fenwick_find(tree, 3.5) == 5 );
+
+    fenwick_add(tree, 4, 4);
+    fenwick_add(tree, 0, -1);
+
+    ck_assert( fenwick_total(tree) == 6.5 );
+    ck_assert( fenwick_find(tree, 0) == 2 );
+    ck_assert( fenwick_find(tree, 2.5) == 4 );
+    ck_assert( fenwick_find(tree, 6.49) == 4 );
+
+    fenwick_free(tree);
+}
+END_TEST
+
+START_TEST(test_snapshot) {
+    int i, id;
+    int seen[4] = {0};
+    int64_t generation;
+    uint64_t state = 1;
+    char root[] = "/tmp/nextwall-check-XXXXXX";
+    char path[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    char result_path[PATH_MAX];
+    char query[4 * PATH_MAX];
+    const char *dirs[] = {"a", "a-b", "a/sub"};
+    sqlite3 *db;
+    struct snapshot *snapshot;
+
+    ck_assert( mkdtemp(root) != NULL );
+
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof path, "%s/%s", root, dirs[i]);
+        ck_assert( mkdir(path, 0700) == 0 );
+    }
+
+    // "a-b" sorts between "a" and "a/sub", but is not below "a"
+    snprintf(query, sizeof query,
+        "CREATE TABLE info (id INTEGER PRIMARY KEY, name VARCHAR, value VARCHAR);"
+        "INSERT INTO info VALUES (null, 'generation', 7);"
+        "CREATE TABLE directories (id INTEGER PRIMARY KEY, path TEXT);"
+        "INSERT INTO directories VALUES (1, '%1$s/a'), (2, '%1$s/a-b'), "
+        "(3, '%1$s/a/sub');"
+        "CREATE TABLE wallpapers (id INTEGER PRIMARY KEY, dir_id INTEGER, "
+        "name TEXT, brightness INTEGER);"
+        "INSERT INTO wallpapers VALUES (1, 1, 'x', 2), (2, 2, 'y', 2), "
+        "(3, 3, 'z', 0), (4, 1, 'w', NULL);", root);
+
+    ck_assert( sqlite3_open(":memory:", &db) == SQLITE_OK );
+    ck_assert( sqlite3_exec(db, query, NULL, NULL, NULL) == SQLITE_OK );
+
+    snprintf(snapshot_path, sizeof snapshot_path, "%s/nextwall.snap", root);
+    ck_assert( snapshot_write(db, snapshot_path, &generation) == 0 );
+    ck_assert( generation == 7 );
+    sqlite3_close(db);
+
+    ck_assert( (snapshot = snapshot_open(snapshot_path)) != NULL );
+    ck_assert( snapshot->header->dir_count == 3 );
+    ck_assert( snapshot->header->entry_count == 3 );
+
+    snprintf(path, sizeof path, "%s/a", root);
+    for (i = 0; i < 100; i++) {
+        id = snapshot_pick(snapshot, path, -1, &state, result_path);
+        ck_assert( id == 1 || id == 3 );
+        seen[id]++;
+    }
+    ck_assert( seen[1] > 0 && seen[3] > 0 );
+
+    ck_assert( snapshot_pick(snapshot, path, 2, &state, result_path) == 1 );
+    snprintf(path, sizeof path, "%s/a/x", root);
+    ck_assert_str_eq( result_path, path );
+
+    snprintf(path, sizeof path, "%s/a-b", root);
+    ck_assert( snapshot_pick(snapshot, path, 0, &state, result_path) == -1 );
+    ck_assert( snapshot_pick(snapshot, path, -1, &state, result_path) == 2 );
+    ck_assert( snapshot_pick(snapshot, root, 1, &state, result_path) == -1 );
+
+    snapshot_close(snapshot);
+
+    unlink(snapshot_path);
+    for (i = 2; i >= 0; i--) {
+        snprintf(path, sizeof path, "%s/%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+END_TEST
+
+static int count_rows(sqlite3 *db, const char *table) {
+    int count = -1;
+    char query[64];
+    sqlite3_stmt *stmt;
+
+    snprintf(query, sizeof query, "SELECT COUNT(*) FROM %s;", table);
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    return count;
+}
+
+START_TEST(test_maintain) {
+    sqlite3 *db;
+    FILE *stream;
+
+    // Directory 2 is empty, wallpaper 2 is in a directory that is gone, and
+    // nothing is left below the base of the second rotation.
+    const char *query =
+        "CREATE TABLE directories (id INTEGER PRIMARY KEY, path TEXT);"
+        "INSERT INTO directories VALUES (1, '/w/a/sub'), (2, '/w/b');"
+        "CREATE TABLE wallpapers (id INTEGER PRIMARY KEY, dir_id INTEGER, "
+        "name TEXT, brightness INTEGER);"
+        "INSERT INTO wallpapers VALUES (1, 1, 'x', 2), (2, 3, 'y', 0);"
+        "CREATE TABLE wallpaper_counts (dir_id INTEGER, brightness INTEGER, "
+        "count INTEGER, PRIMARY KEY (dir_id, brightness));"
+        "INSERT INTO wallpaper_counts VALUES (1, 2, 1), (2, 1, 0), (3, 0, 1);"
+        "CREATE TABLE rotations (id INTEGER PRIMARY KEY, base TEXT, "
+        "brightness INTEGER, start INTEGER, position INTEGER, "
+        "wrapped INTEGER);"
+        "INSERT INTO rotations VALUES (1, '/w/a', -1, 0, 0, 0), "
+        "(2, '/w/b', -1, 0, 0, 0);";
+
+    ck_assert( sqlite3_open(":memory:", &db) == SQLITE_OK );
+    ck_assert( sqlite3_exec(db, query, NULL, NULL, NULL) == SQLITE_OK );
+
+    ck_assert( maintain_database(db) == 0 );
+    ck_assert( count_rows(db, "directories") == 1 );
+    ck_assert( count_rows(db, "wallpapers") == 1 );
+    ck_assert( count_rows(db, "wallpaper_counts") == 1 );
+    ck_assert( count_rows(db, "rotations") == 1 );
+
+    ck_assert( (stream = fopen("/dev/null", "w")) != NULL );
+    ck_assert( print_database_stats(db, stream) == 0 );
+    fclose(stream);
+
+    sqlite3_close(db);
+}
+END_TEST
+
+static void add_wallpapers(sqlite3 *db, const char *dir, const char *prefix,
+        int count) {
+    int i;
+    char name[64];
+    sqlite3_stmt *stmt;
+
+    ck_assert( sqlite3_prepare_v2(db, "INSERT INTO wallpaper_paths "
+            "(dir, name, lightness, brightness) VALUES (?, ?, 0.5, 1);",
+            -1, &stmt, NULL) == SQLITE_OK );
+
+    for (i = 0; i < count; i++) {
+        snprintf(name, sizeof name, "%s%d.png", prefix, i);
+        sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+        ck_assert( sqlite3_step(stmt) == SQLITE_DONE );
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+START_TEST(test_select_wallpaper) {
+    int i, id, rows;
+    char root[] = "/tmp/nextwall-check-XXXXXX";
+    char db_path[PATH_MAX];
+    char wallpaper[PATH_MAX];
+    char path[PATH_MAX];
+    const char *suffixes[] = {"-wal", "-shm", ""};
+    sqlite3 *db;
+    struct nextwall_ctx *ctx, *readonly;
+    FILE *file;
+
+    ck_assert( mkdtemp(root) != NULL );
+    snprintf(db_path, sizeof db_path, "%s/nextwall.db", root);
+    ck_assert( (ctx = nextwall_open(db_path)) != NULL );
+    ck_assert( sqlite3_open(db_path, &db) == SQLITE_OK );
+
+    // Wallpapers whose files are gone are removed while selecting
+    add_wallpapers(db, root, "gone", 5);
+    id = -1;
+    ck_assert( select_wallpaper(ctx, root, -1, NULL, "", &id, path) == -1 );
+    ck_assert( count_rows(db, "wallpapers") == 0 );
+
+    // One call stops after removing a full batch of them
+    add_wallpapers(db, root, "gone", 4 * CANDIDATE_BATCH);
+    id = -1;
+    ck_assert( select_wallpaper(ctx, root, -1, NULL, "", &id, path) == -1 );
+    rows = count_rows(db, "wallpapers");
+    ck_assert( rows > 2 * CANDIDATE_BATCH && rows <= 3 * CANDIDATE_BATCH );
+
+    // It also stops when they cannot be removed
+    ck_assert( (readonly = nextwall_open_readonly(db_path)) != NULL );
+    id = -1;
+    ck_assert( select_wallpaper(readonly, root, -1, NULL, "", &id, path) == -1 );
+    ck_assert( count_rows(db, "wallpapers") == rows );
+    nextwall_close(readonly);
+
+    // The wallpaper that exists is found in the end
+    snprintf(wallpaper, sizeof wallpaper, "%s/here0.png", root);
+    ck_assert( (file = fopen(wallpaper, "w")) != NULL );
+    fclose(file);
+    add_wallpapers(db, root, "here", 1);
+
+    id = -1;
+    for (i = 0; i < 4 && id == -1; i++) {
+        select_wallpaper(ctx, root, -1, NULL, "", &id, path);
+    }
+    ck_assert( id != -1 );
+    ck_assert_str_eq( path, wallpaper );
+
+    sqlite3_close(db);
+    nextwall_close(ctx);
+
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof path, "%s%s", db_path, suffixes[i]);
+        unlink(path);
+    }
+    unlink(wallpaper);
+    rmdir(root);
+}
+END_TEST
+
+START_TEST(test_solar) {
+    char root[] = "/tmp/nextwall-check-XXXXXX";
+    char path[PATH_MAX];
+    struct solar_table table, loaded;
+    const struct solar_times *times;
+    struct tm date = { .tm_year = 2024 - 1900, .tm_mon = 5, .tm_mday = 21 };
+    time_t noon, change;
+
+    // Amsterdam in the middle of summer
+    setenv("TZ", "Europe/Amsterdam", 1);
+    tzset();
+    solar_table_build(&table, 52.37, 4.9, 2024);
+    date.tm_hour = 12;
+    noon = mktime(&date);
+
+    ck_assert( (times = solar_times(&table, noon, SOLAR_SUN)) != NULL );
+    ck_assert( times[SOLAR_SUN].status == 0 );
+    ck_assert( times[SOLAR_SUN].start < times[SOLAR_SUN].end );
+    ck_assert( times[SOLAR_CIVIL].start < times[SOLAR_SUN].start );
+    ck_assert( times[SOLAR_ASTRONOMICAL].status == 1 );
+
+    ck_assert( solar_brightness(&table, noon) == 2 );
+    ck_assert( solar_brightness(&table, noon + 12 * 3600) == 0 );
+    ck_assert( solar_brightness(&table, noon + 365 * 86400) == -1 );
+
+    // After noon the sun sets, then civil twilight ends
+    change = solar_next_change(&table, noon);
+    ck_assert( solar_brightness(&table, change - 2) == 2 );
+    ck_assert( solar_brightness(&table, change) == 1 );
+    change = solar_next_change(&table, change);
+    ck_assert( solar_brightness(&table, change - 2) == 1 );
+    ck_assert( solar_brightness(&table, change) == 0 );
+
+    // The sun is as high as it gets at noon on the longest day, and at
+    // civil twilight 6 degrees below the horizon
+    ck_assert( fabs(solar_elevation(52.37, 4.9, noon + 1800) - 61.1) < 0.5 );
+    ck_assert( fabs(solar_elevation(52.37, 4.9, change) + 6) < 0.1 );
+
+    // The times don't depend on the time zone, not even a half hour one
+    setenv("TZ", "Asia/Kolkata", 1);
+    tzset();
+    ck_assert( solar_brightness(&table, noon) == 2 );
+    ck_assert( solar_brightness(&table, noon + 12 * 3600) == 0 );
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    // The table is saved, and read back for the same location and year
+    ck_assert( mkdtemp(root) != NULL );
+    snprintf(path, sizeof path, "%s/solar.tbl", root);
+    ck_assert( solar_table_load(&loaded, path, 52.37, 4.9, 2024) == 0 );
+    ck_assert( memcmp(&loaded, &table, sizeof table) == 0 );
+    ck_assert( solar_table_load(&loaded, path, 52.37, 4.9, 2024) == 0 );
+    ck_assert( memcmp(&loaded, &table, sizeof table) == 0 );
+    ck_assert( solar_table_load(&loaded, path, 52.37, 4.9, 2025) == 0 );
+    ck_assert( loaded.year == 2025 );
+
+    unlink(path);
+    rmdir(root);
+}
+END_TEST
+
+static void write_file(const char *path, size_t size, time_t mtime) {
+    FILE *file;
+    struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+
+    ck_assert( (file = fopen(path, "w")) != NULL );
+    while (size--) {
+        fputc('x', file);
+    }
+    fclose(file);
+    ck_assert( utimensat(AT_FDCWD, path, times, 0) == 0 );
+}
+
+START_TEST(test_cache) {
+    int i;
+    char root[] = "/tmp/nextwall-check-XXXXXX";
+    char wallpaper[PATH_MAX];
+    char copies[3][PATH_MAX];
+    char path[PATH_MAX + 4];
+    char source[PATH_MAX];
+    struct wallpaper_cache cache;
+    struct stat statbuf;
+
+    ck_assert( mkdtemp(root) != NULL );
+    snprintf(path, sizeof path, "%s/cache", root);
+    ck_assert( cache_init(&cache, path, 1920, 1080, 250) == 0 );
+
+    // The copy changes with the wallpaper and the resolution
+    snprintf(wallpaper, sizeof wallpaper, "%s/wallpaper.png", root);
+    write_file(wallpaper, 10, 1000);
+    ck_assert( cache_path(&cache, wallpaper, copies[0], PATH_MAX) == 0 );
+    ck_assert( strncmp(copies[0], cache.dir, strlen(cache.dir)) == 0 );
+    write_file(wallpaper, 11, 1000);
+    ck_assert( cache_path(&cache, wallpaper, copies[1], PATH_MAX) == 0 );
+    ck_assert_str_ne( copies[0], copies[1] );
+    cache.width = 1280;
+    ck_assert( cache_path(&cache, wallpaper, copies[2], PATH_MAX) == 0 );
+    ck_assert_str_ne( copies[1], copies[2] );
+
+    // A copy leads back to its wallpaper
+    ck_assert( cache_source(wallpaper, source, sizeof source) == -1 );
+    snprintf(path, sizeof path, "%s.src", copies[0]);
+    ck_assert( symlink(wallpaper, path) == 0 );
+    ck_assert( cache_source(copies[0], source, sizeof source) == 0 );
+    ck_assert_str_eq( source, wallpaper );
+
+    // The least recently used copies go first, but never the one to keep
+    for (i = 0; i < 3; i++) {
+        write_file(copies[i], 100, 2000 + i);
+    }
+    ck_assert( cache_prune(&cache, copies[0]) == 100 );
+    ck_assert( access(copies[0], F_OK) == 0 );
+    ck_assert( access(path, F_OK) == 0 );
+    ck_assert( access(copies[1], F_OK) == -1 );
+    ck_assert( access(copies[2], F_OK) == 0 );
+    cache.size = 0;
+    ck_assert( cache_prune(&cache, NULL) == 200 );
+    ck_assert( access(copies[0], F_OK) == -1 );
+    ck_assert( lstat(path, &statbuf) == -1 );
+
+    unlink(wallpaper);
+    rmdir(cache.dir);
+    rmdir(root);
+}
+END_TEST
+
 Suite *nextwall_suite(void) {
     Suite *suite = suite_create("nextwall");
 
     /* Test case: std */
     TCase *test_case_std = tcase_create("std");
     tcase_add_test(test_case_std, test_floatcmp);
+    tcase_add_test(test_case_std, test_get_path_range);
+    tcase_add_test(test_case_std, test_split_path);
+    tcase_add_test(test_case_std, test_random_below);
+    tcase_add_test(test_case_std, test_print_json_string);
 
     suite_add_tcase(suite, test_case_std);
 
+    /* Test case: fenwick */
+    TCase *test_case_fenwick = tcase_create("fenwick");
+    tcase_add_test(test_case_fenwick, test_fenwick);
+
+    suite_add_tcase(suite, test_case_fenwick);
+
+    /* Test case: snapshot */
+    TCase *test_case_snapshot = tcase_create("snapshot");
+    tcase_add_test(test_case_snapshot, test_snapshot);
+
+    suite_add_tcase(suite, test_case_snapshot);
+
+    /* Test case: maintain */
+    TCase *test_case_maintain = tcase_create("maintain");
+    tcase_add_test(test_case_maintain, test_maintain);
+
+    suite_add_tcase(suite, test_case_maintain);
+
+    /* Test case: database */
+    TCase *test_case_database = tcase_create("database");
+    tcase_add_test(test_case_database, test_select_wallpaper);
+
+    suite_add_tcase(suite, test_case_database);
+
+    /* Test case: cache */
+    TCase *test_case_cache = tcase_create("cache");
+    tcase_add_test(test_case_cache, test_cache);
+
+    suite_add_tcase(suite, test_case_cache);
+
+    /* Test case: solar */
+    TCase *test_case_solar = tcase_create("solar");
+    tcase_add_test(test_case_solar, test_solar);
+
+    suite_add_tcase(suite, test_case_solar);
+
     return suite;
 }
 
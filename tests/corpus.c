@@ -0,0 +1,180 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+   Image corpus for the benchmarks.
+
+   Generates a reproducible set of JPEG, PNG and WebP images at mixed
+   resolutions and directory depths.
+ */
+
+#define _XOPEN_SOURCE 500 /* nftw */
+
+#include <ftw.h>
+#include <limits.h>
+#include <MagickWand/MagickWand.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <bsd/string.h> /* strlcpy */
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "corpus.h"
+
+/* Maximum directory depth in the corpus */
+#define MAX_DEPTH 3
+
+/* Seed that is used instead of zero */
+#define FALLBACK_SEED 2718
+
+static const char *formats[] = {"JPEG", "PNG", "WEBP"};
+static const char *extensions[] = {"jpg", "png", "webp"};
+static const unsigned resolutions[][2] = {
+    {640, 480}, {1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160}
+};
+
+/* Function prototypes */
+static uint32_t next_random(uint32_t *state);
+static int write_image(const char *path, unsigned width, unsigned height,
+                       const char *format, uint32_t *state);
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+                        struct FTW *ftwbuf);
+
+/**
+  Return the next number from a xorshift32 generator.
+
+  A private generator keeps the corpus identical across C libraries.
+
+  @param[in,out] state The generator state; must not be zero.
+  @return The next pseudo-random number.
+ */
+uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/**
+  Generate the image corpus.
+
+  Each image gets a random format, resolution and directory depth. The images
+  are filled with a random colour and noise, so that they compress and decode
+  like photos rather than flat colour.
+
+  @param[in] dir The directory to create the corpus in.
+  @param[in] count The number of images to generate.
+  @param[in] seed The seed for the generator.
+  @return Returns 0 on success, -1 on failure.
+ */
+int generate_corpus(const char *dir, unsigned count, uint32_t seed) {
+    unsigned i, d, depth, format, resolution;
+    uint32_t state = seed ? seed : FALLBACK_SEED;
+    char path[PATH_MAX];
+    int rc = 0;
+
+    MagickWandGenesis();
+
+    for (i = 0; i < count && rc == 0; i++) {
+        depth = next_random(&state) % (MAX_DEPTH + 1);
+        format = next_random(&state) % 3;
+        resolution = next_random(&state) % 5;
+
+        strlcpy(path, dir, sizeof path);
+        mkdir(path, 0755);
+
+        for (d = 0; d < depth; d++) {
+            size_t len = strlen(path);
+            snprintf(path + len, sizeof path - len, "/d%u",
+                    next_random(&state) % 4);
+            mkdir(path, 0755);
+        }
+
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof path - len, "/img%05u.%s", i,
+                extensions[format]);
+
+        rc = write_image(path, resolutions[resolution][0],
+                resolutions[resolution][1], formats[format], &state);
+    }
+
+    MagickWandTerminus();
+
+    return rc;
+}
+
+/**
+  Write a single image of the corpus.
+
+  @param[in] path The path of the image file.
+  @param[in] width The width of the image.
+  @param[in] height The height of the image.
+  @param[in] format The ImageMagick format name.
+  @param[in,out] state The generator state.
+  @return Returns 0 on success, -1 on failure.
+ */
+int write_image(const char *path, unsigned width, unsigned height,
+                const char *format, uint32_t *state) {
+    int rc = -1;
+    char color[32];
+    MagickWand *wand = NewMagickWand();
+    PixelWand *background = NewPixelWand();
+
+    snprintf(color, sizeof color, "rgb(%u,%u,%u)",
+            next_random(state) % 256,
+            next_random(state) % 256,
+            next_random(state) % 256);
+    PixelSetColor(background, color);
+
+    if (MagickNewImage(wand, width, height, background) == MagickTrue &&
+            MagickAddNoiseImage(wand, GaussianNoise, 1.0) == MagickTrue &&
+            MagickSetImageFormat(wand, format) == MagickTrue &&
+            MagickWriteImage(wand, path) == MagickTrue) {
+        rc = 0;
+    }
+    else {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+    }
+
+    background = DestroyPixelWand(background);
+    wand = DestroyMagickWand(wand);
+
+    return rc;
+}
+
+/**
+  Remove a directory tree, such as a corpus.
+
+  @param[in] path The directory to remove.
+  @return Returns 0 on success, -1 on failure.
+ */
+int remove_tree(const char *path) {
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+  nftw() callback that removes a file or an empty directory.
+ */
+int remove_entry(const char *path, const struct stat *sb, int flag,
+                 struct FTW *ftwbuf) {
+    return remove(path);
+}
@@ -0,0 +1,401 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+   Concurrent access load test.
+
+   Generates an image corpus like the scan benchmark and scans it into a
+   fresh database. Then one writer process keeps removing half of the
+   wallpapers and scanning them in again, while several reader processes
+   select wallpapers as fast as they can. The latency of the selections is
+   printed as JSON.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "database.h"
+
+/* Default number of images in the corpus */
+#define DEFAULT_COUNT 48
+
+/* Default seed for the corpus generator */
+#define DEFAULT_SEED 2718
+
+/* Default number of reader processes and seconds to run */
+#define DEFAULT_READERS 4
+#define DEFAULT_SECONDS 10
+
+/* Maximum number of selections that are recorded per reader */
+#define MAX_SAMPLES 65536
+
+/* The results of a reader, in memory shared with the parent */
+struct reader_results {
+    unsigned count;                 /* Number of recorded selections */
+    unsigned failures;              /* Number of failed selections */
+    double latency[MAX_SAMPLES];    /* Seconds per selection */
+};
+
+/* The results of the writer, in memory shared with the parent */
+struct writer_results {
+    unsigned scans;                 /* Number of completed scans */
+    unsigned failures;              /* Number of failed scans */
+};
+
+/* Function prototypes */
+static void run_writer(const char *db_path, const char *ann_file,
+                       const char *corpus, double deadline,
+                       struct writer_results *results);
+static void run_reader(const char *db_path, const char *corpus,
+                       unsigned long long seed, double deadline,
+                       struct reader_results *results);
+static int compare_doubles(const void *a, const void *b);
+static double percentile(const double *sorted, size_t count, double p);
+static double get_seconds(void);
+
+int main(int argc, char **argv) {
+    int opt;
+    int status;
+    int exit_status = EXIT_FAILURE;
+    unsigned i;
+    unsigned count = DEFAULT_COUNT;
+    unsigned readers = DEFAULT_READERS;
+    unsigned seconds = DEFAULT_SECONDS;
+    unsigned failures = 0;
+    uint32_t seed = DEFAULT_SEED;
+    size_t samples = 0, shared_size;
+    double deadline;
+    double *latency = NULL;
+    char *ann_file = NULL;
+    char base[] = "/tmp/nextwall-load-XXXXXX";
+    char corpus[PATH_MAX];
+    char db_path[PATH_MAX];
+    pid_t pid;
+    void *shared = MAP_FAILED;
+    struct writer_results *writer;
+    struct reader_results *reader;
+    struct nextwall_ctx *ctx = NULL;
+
+    while ((opt = getopt(argc, argv, "a:n:r:s:t:")) != -1) {
+        switch (opt) {
+            case 'a':
+                ann_file = optarg;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                readers = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                ann_file = NULL;
+                break;
+        }
+    }
+
+    if (!ann_file || count == 0 || readers == 0 || seconds == 0) {
+        fprintf(stderr, "Usage: %s -a ANN [-n COUNT] [-r READERS] "
+                "[-t SECONDS] [-s SEED]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Set the locale to something that works with FANN configuration files. */
+    setlocale(LC_ALL, "C");
+
+    if (!mkdtemp(base)) {
+        fprintf(stderr, "mkdtemp() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    snprintf(corpus, sizeof corpus, "%s/corpus", base);
+    snprintf(db_path, sizeof db_path, "%s/nextwall.db", base);
+
+    fprintf(stderr, "Generating %u images in %s...\n", count, corpus);
+
+    if ((pid = fork()) == 0) {
+        _exit(generate_corpus(corpus, count, seed) == 0 ?
+                EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: Failed to generate the corpus\n");
+        goto Return;
+    }
+
+    /* The first scan is not measured; it gives the readers something to
+       select from. */
+    fprintf(stderr, "Scanning...\n");
+
+    if (!(ctx = nextwall_open(db_path)) ||
+            nextwall_load_ann(ctx, ann_file) == -1 ||
+            scan_dir(ctx, corpus, 1) <= 0) {
+        fprintf(stderr, "Error: Failed to scan the corpus\n");
+        goto Return;
+    }
+
+    nextwall_close(ctx);
+    ctx = NULL;
+
+    shared_size = sizeof *writer + readers * sizeof *reader;
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+        goto Return;
+    }
+
+    writer = shared;
+    reader = (struct reader_results *)(writer + 1);
+
+    fprintf(stderr, "Running 1 writer and %u readers for %u seconds...\n",
+            readers, seconds);
+
+    /* The writer sends the progress of its scans to /dev/null. */
+    fflush(stdout);
+    deadline = get_seconds() + seconds;
+
+    for (i = 0; i <= readers; i++) {
+        if ((pid = fork()) == -1) {
+            fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (pid == 0) {
+            if (i == 0) {
+                if (!freopen("/dev/null", "w", stdout)) {
+                    _exit(EXIT_FAILURE);
+                }
+                run_writer(db_path, ann_file, corpus, deadline, writer);
+            }
+            else {
+                run_reader(db_path, corpus, seed + i, deadline, &reader[i - 1]);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    while (wait(NULL) > 0) {
+        continue;
+    }
+
+    if (i <= readers) {
+        goto Return;
+    }
+
+    for (i = 0; i < readers; i++) {
+        samples += reader[i].count;
+    }
+
+    if (samples == 0 || !(latency = malloc(samples * sizeof *latency))) {
+        fprintf(stderr, "Error: No selections were recorded\n");
+        goto Return;
+    }
+
+    for (i = 0, samples = 0; i < readers; i++) {
+        memcpy(latency + samples, reader[i].latency,
+                reader[i].count * sizeof *latency);
+        samples += reader[i].count;
+        failures += reader[i].failures;
+    }
+
+    qsort(latency, samples, sizeof *latency, compare_doubles);
+
+    printf("{\n"
+           "  \"readers\": %u,\n"
+           "  \"seconds\": %u,\n"
+           "  \"scans\": %u,\n"
+           "  \"scan_failures\": %u,\n"
+           "  \"selections\": %zu,\n"
+           "  \"selection_failures\": %u,\n"
+           "  \"selections_per_second\": %.3f,\n"
+           "  \"latency_ms\": {\n"
+           "    \"p50\": %.3f,\n"
+           "    \"p90\": %.3f,\n"
+           "    \"p99\": %.3f,\n"
+           "    \"p999\": %.3f,\n"
+           "    \"max\": %.3f\n"
+           "  }\n"
+           "}\n",
+           readers, seconds, writer->scans, writer->failures,
+           samples, failures, (double)samples / seconds,
+           percentile(latency, samples, 0.5) * 1e3,
+           percentile(latency, samples, 0.9) * 1e3,
+           percentile(latency, samples, 0.99) * 1e3,
+           percentile(latency, samples, 0.999) * 1e3,
+           latency[samples - 1] * 1e3);
+
+    exit_status = failures == 0 && writer->failures == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+
+Return:
+    nextwall_close(ctx);
+    free(latency);
+    if (shared != MAP_FAILED) {
+        munmap(shared, shared_size);
+    }
+    remove_tree(base);
+
+    return exit_status;
+}
+
+/**
+  Run the writer process of the load test.
+
+  Until the deadline, removes half of the wallpapers from the database and
+  scans the corpus, which adds them again. Like a scan, the removal is done
+  in a single transaction.
+
+  @param[in] db_path The path of the database.
+  @param[in] ann_file The path of the ANN for the scans.
+  @param[in] corpus The directory to scan.
+  @param[in] deadline The time to stop, see get_seconds().
+  @param[out] results The results of the writer.
+ */
+void run_writer(const char *db_path, const char *ann_file,
+                const char *corpus, double deadline,
+                struct writer_results *results) {
+    sqlite3 *db = NULL;
+    struct nextwall_ctx *ctx;
+
+    if (!(ctx = nextwall_open(db_path)) ||
+            nextwall_load_ann(ctx, ann_file) == -1 ||
+            sqlite3_open(db_path, &db) != SQLITE_OK) {
+        results->failures++;
+        goto Return;
+    }
+
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT);
+
+    while (get_seconds() < deadline) {
+        if (sqlite3_exec(db, "DELETE FROM wallpapers WHERE id IN " \
+                    "(SELECT id FROM wallpapers ORDER BY random() " \
+                    "LIMIT (SELECT count(*) / 2 FROM wallpapers));",
+                    NULL, NULL, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Writer: %s\n", sqlite3_errmsg(db));
+            results->failures++;
+        }
+
+        if (scan_dir(ctx, corpus, 1) > 0) {
+            results->scans++;
+        }
+        else {
+            results->failures++;
+        }
+    }
+
+Return:
+    sqlite3_close(db);
+    nextwall_close(ctx);
+}
+
+/**
+  Run a reader process of the load test.
+
+  Until the deadline, selects wallpapers from the corpus and marks them as
+  shown, like a wallpaper change does, and records how long each selection
+  takes. A selection that finds no wallpaper counts as a failure.
+
+  @param[in] db_path The path of the database.
+  @param[in] corpus The base directory to select from.
+  @param[in] seed The seed for the random number generator.
+  @param[in] deadline The time to stop, see get_seconds().
+  @param[out] results The results of the reader.
+ */
+void run_reader(const char *db_path, const char *corpus,
+                unsigned long long seed, double deadline,
+                struct reader_results *results) {
+    int id;
+    double start;
+    char path[PATH_MAX];
+    struct nextwall_ctx *ctx;
+
+    if (!(ctx = nextwall_open(db_path))) {
+        results->failures++;
+        return;
+    }
+
+    nextwall_seed(ctx, seed);
+
+    while ((start = get_seconds()) < deadline &&
+            results->count < MAX_SAMPLES) {
+        id = -1;
+
+        if (select_wallpaper(ctx, corpus, -1, NULL, "", &id, path) == -1 ||
+                mark_wallpaper_shown(ctx, id) == -1) {
+            results->failures++;
+        }
+
+        results->latency[results->count++] = get_seconds() - start;
+    }
+
+    nextwall_close(ctx);
+}
+
+/**
+  qsort() comparison function for doubles in ascending order.
+ */
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+  Return a percentile of sorted values, using the nearest rank.
+
+  @param[in] sorted The values in ascending order.
+  @param[in] count The number of values, at least 1.
+  @param[in] p The percentile as a fraction between 0 and 1.
+  @return The value at the percentile.
+ */
+double percentile(const double *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p * count + 0.5);
+    return sorted[rank > 0 ? (rank < count ? rank : count) - 1 : 0];
+}
+
+/**
+  Return the value of the monotonic clock in seconds.
+ */
+double get_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,204 @@
+/*
+  This file is part of nextwall - a wallpaper rotator with some sense of time.
+
+   Copyright 2004, Davyd Madeley <davyd@madeley.id.au>
+   Copyright 2010-2013, Serrano Pereira <serrano@bitosis.nl>
+
+   Nextwall is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Nextwall is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+   Scan throughput benchmark.
+
+   Generates a reproducible corpus of JPEG, PNG and WebP images at mixed
+   resolutions and directory depths in a temporary directory, scans it into a
+   fresh database and prints the results as JSON.
+ */
+
+#define _GNU_SOURCE     /* asprintf */
+#define _XOPEN_SOURCE 500 /* nftw */
+
+#include <errno.h>
+#include <floatfann.h>
+#include <ftw.h>
+#include <limits.h>
+#include <locale.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bsd/string.h> /* strlcpy */
+#include <sys/resource.h> /* getrusage */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "database.h"
+
+/* Default number of images in the corpus */
+#define DEFAULT_COUNT 48
+
+/* Default seed for the corpus generator */
+#define DEFAULT_SEED 2718
+
+/* Total size of the files visited by add_size() */
+static unsigned long long corpus_bytes = 0;
+
+/* Function prototypes */
+static int add_size(const char *path, const struct stat *sb, int flag,
+                    struct FTW *ftwbuf);
+static double get_seconds(void);
+
+int main(int argc, char **argv) {
+    int opt;
+    int found;
+    int keep = 0;
+    int status;
+    int exit_status = EXIT_FAILURE;
+    unsigned count = DEFAULT_COUNT;
+    uint32_t seed = DEFAULT_SEED;
+    double start, elapsed;
+    char *ann_file = NULL;
+    char base[] = "/tmp/nextwall-bench-XXXXXX";
+    char corpus[PATH_MAX];
+    char db_path[PATH_MAX];
+    pid_t pid;
+    struct rusage usage;
+    struct scan_stats stats = {0};
+    struct nextwall_ctx *ctx = NULL;
+
+    while ((opt = getopt(argc, argv, "a:kn:s:")) != -1) {
+        switch (opt) {
+            case 'a':
+                ann_file = optarg;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                ann_file = NULL;
+                break;
+        }
+    }
+
+    if (!ann_file || count == 0) {
+        fprintf(stderr, "Usage: %s -a ANN [-n COUNT] [-s SEED] [-k]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Set the locale to something that works with FANN configuration files. */
+    setlocale(LC_ALL, "C");
+
+    if (!mkdtemp(base)) {
+        fprintf(stderr, "mkdtemp() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    snprintf(corpus, sizeof corpus, "%s/corpus", base);
+    snprintf(db_path, sizeof db_path, "%s/nextwall.db", base);
+
+    /* Generate the corpus in a child process, so that the memory used by the
+       generator does not count towards the peak RSS of the scan. */
+    fprintf(stderr, "Generating %u images in %s...\n", count, corpus);
+
+    if ((pid = fork()) == 0) {
+        _exit(generate_corpus(corpus, count, seed) == 0 ?
+                EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: Failed to generate the corpus\n");
+        goto Return;
+    }
+
+    nftw(corpus, add_size, 16, FTW_PHYS);
+
+    if (!(ctx = nextwall_open(db_path)) ||
+            nextwall_load_ann(ctx, ann_file) == -1) {
+        goto Return;
+    }
+
+    fprintf(stderr, "Scanning...\n");
+    scan_set_stats(ctx, &stats);
+    start = get_seconds();
+    found = scan_dir(ctx, corpus, 1);
+    elapsed = get_seconds() - start;
+    scan_set_stats(ctx, NULL);
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n"
+           "  \"images\": %d,\n"
+           "  \"bytes\": %llu,\n"
+           "  \"seconds\": %.6f,\n"
+           "  \"images_per_second\": %.3f,\n"
+           "  \"mb_per_second\": %.3f,\n"
+           "  \"peak_rss_kb\": %ld,\n"
+           "  \"phases\": {\n"
+           "    \"sniff\": %.6f,\n"
+           "    \"decode\": %.6f,\n"
+           "    \"classify\": %.6f,\n"
+           "    \"insert\": %.6f\n"
+           "  }\n"
+           "}\n",
+           found, corpus_bytes, elapsed,
+           found / elapsed,
+           corpus_bytes / 1e6 / elapsed,
+           usage.ru_maxrss,
+           stats.sniff, stats.decode, stats.classify, stats.insert);
+
+    exit_status = EXIT_SUCCESS;
+
+Return:
+    nextwall_close(ctx);
+    if (!keep) {
+        remove_tree(base);
+    }
+    else {
+        fprintf(stderr, "Kept corpus and database in %s\n", base);
+    }
+
+    return exit_status;
+}
+
+/**
+  nftw() callback that adds the size of regular files to corpus_bytes.
+ */
+int add_size(const char *path, const struct stat *sb, int flag,
+             struct FTW *ftwbuf) {
+    if (flag == FTW_F) {
+        corpus_bytes += sb->st_size;
+    }
+    return 0;
+}
+
+/**
+  Return the value of the monotonic clock in seconds.
+ */
+double get_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}